@@ -0,0 +1,630 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Block and inode allocation.  Every change to the bitmaps is written
+  straight back through the block layer (and so the block cache) one
+  bitmap block at a time.
+
+  Each bitmap block's worth of bits forms a group, and the number of
+  clear bits in every group is kept in memory.  Scans looking for a
+  free bit skip full groups, scans looking for the end of a free run
+  skip empty ones, and the word scans in between come from bitops.c.
+
+  Only the groups that are partly used are kept in memory.  Mounting
+  reads the bitmaps once to count every group; an empty or full group
+  is dropped after counting, and its words are made up again from the
+  count the first time one of its bits changes.  A large image that
+  is mostly empty (or mostly full) so costs a few bytes per group
+  rather than its whole bitmap.
+
+  While the metadata journal is on, freed blocks are held back until
+  the transaction that frees them has committed (alloc_free_deferred()).
+  Handing them out earlier would let a new owner write to them while a
+  crash could still bring back the old one.
+
+  Writes to different files allocate at the same time under the
+  shared file system lock, so the bitmaps, the free counts in the
+  superblock and the deferred frees are all under alloc_lock.  It is
+  held while bitmap blocks are written, and so is taken before the
+  block cache's and the journal's locks, never after.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "bitops.h"
+#include "block.h"
+#include "journal.h"
+#include "super.h"
+
+// bytes of bitmap read at a time while counting the groups at mount
+#define ALLOC_LOAD_CHUNK (1024 * 1024)
+
+struct bitmap {
+    uint64_t **words;           // each group's words, NULL if empty or full
+    uint64_t nbits;
+    blkno_t disk_start;         // first block of the on-disk copy
+    uint64_t disk_blocks;
+    uint64_t hint;              // where the next search starts
+    uint64_t group_bits;        // bits per group, a multiple of 64
+    uint64_t ngroups;
+    uint32_t *group_free;       // clear bits in each group
+};
+
+struct free_run {
+    blkno_t start;
+    uint64_t count;
+};
+
+static struct bitmap bmap;      // bit i is block sb.data_start + i
+static struct bitmap imap;      // bit i is inode i
+
+// block frees waiting for the running transaction to commit
+static struct free_run *deferred = NULL;
+static unsigned int ndeferred = 0;
+static unsigned int deferred_cap = 0;
+
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t group_end(const struct bitmap *bm, const uint64_t g)
+{
+    uint64_t end = (g + 1) * bm->group_bits;
+
+    return end < bm->nbits ? end : bm->nbits;
+}
+
+/** Number of bits in group @g; only the last one can be short */
+static uint64_t group_size(const struct bitmap *bm, const uint64_t g)
+{
+    return group_end(bm, g) - g * bm->group_bits;
+}
+
+static int bit_test(const struct bitmap *bm, const uint64_t i)
+{
+    uint64_t g = i / bm->group_bits, b = i % bm->group_bits;
+
+    if (bm->words[g] == NULL)
+	return bm->group_free[g] == 0;
+    return (bm->words[g][b >> 6] >> (b & 63)) & 1;
+}
+
+/** Word @w of the bitmap; its group must be in memory */
+static uint64_t *word_at(const struct bitmap *bm, const uint64_t w)
+{
+    uint64_t per_group = bm->group_bits / 64;
+
+    return &bm->words[w / per_group][w % per_group];
+}
+
+/** Recount the clear bits of group @g, which must be in memory */
+static void group_recount(struct bitmap *bm, const uint64_t g)
+{
+    bm->group_free[g] = group_size(bm, g)
+	- bitops_count(bm->words[g], 0, group_size(bm, g));
+}
+
+/** Bring group @g into memory, rebuilding it from its free count
+ *
+ * Groups that are not in memory are either empty or full, so there
+ * is nothing to read.  Returns 0 or -ENOMEM.
+ */
+static int group_get(struct bitmap *bm, const uint64_t g)
+{
+    uint64_t *words, size = group_size(bm, g);
+
+    if (bm->words[g] != NULL)
+	return 0;
+
+    words = calloc(1, block_size);
+    if (words == NULL)
+	return -ENOMEM;
+    if (bm->group_free[g] == 0) {
+	memset(words, 0xff, size / 64 * sizeof(uint64_t));
+	if (size % 64)
+	    words[size / 64] = ~(~0ULL << (size % 64));
+    }
+    bm->words[g] = words;
+
+    return 0;
+}
+
+/** Drop group @g from memory if it has gone empty or full */
+static void group_put(struct bitmap *bm, const uint64_t g)
+{
+    if (bm->group_free[g] == 0 || bm->group_free[g] == group_size(bm, g)) {
+	free(bm->words[g]);
+	bm->words[g] = NULL;
+    }
+}
+
+static void bitmap_free(struct bitmap *bm)
+{
+    uint64_t g;
+
+    if (bm->words != NULL)
+	for (g = 0; g < bm->ngroups; g++)
+	    free(bm->words[g]);
+    free(bm->words);
+    free(bm->group_free);
+    bm->words = NULL;
+    bm->group_free = NULL;
+}
+
+/** Count every group of the bitmap at @start, keeping the partly
+ *  used ones in memory
+ */
+static int bitmap_load(struct bitmap *bm, const uint64_t nbits,
+		       const blkno_t start, const uint64_t blocks)
+{
+    uint64_t g, i, n, size, chunk = ALLOC_LOAD_CHUNK / block_size;
+    uint64_t *buf, *words;
+    int retstat;
+
+    bm->group_bits = 8ULL * block_size;
+    bm->ngroups = (nbits + bm->group_bits - 1) / bm->group_bits;
+    bm->words = calloc(bm->ngroups, sizeof(uint64_t *));
+    bm->group_free = malloc(bm->ngroups * sizeof(uint32_t));
+    if (chunk == 0)
+	chunk = 1;
+    buf = malloc(chunk * block_size);
+    if (bm->words == NULL || bm->group_free == NULL || buf == NULL) {
+	retstat = -ENOMEM;
+	goto fail;
+    }
+    bm->nbits = nbits;
+    bm->disk_start = start;
+    bm->disk_blocks = blocks;
+    bm->hint = 0;
+
+    // the bitmap may run past its last group, but never short of it
+    for (g = 0; g < bm->ngroups; g += n) {
+	n = bm->ngroups - g < chunk ? bm->ngroups - g : chunk;
+	retstat = block_read_blocks(start + g, n, buf);
+	if (retstat < 0)
+	    goto fail;
+	for (i = 0; i < n; i++) {
+	    words = (uint64_t *) ((char *) buf + i * block_size);
+	    size = group_size(bm, g + i);
+	    bm->group_free[g + i] = size - bitops_count(words, 0, size);
+	    if (bm->group_free[g + i] == 0 || bm->group_free[g + i] == size)
+		continue;
+	    bm->words[g + i] = malloc(block_size);
+	    if (bm->words[g + i] == NULL) {
+		retstat = -ENOMEM;
+		goto fail;
+	    }
+	    memcpy(bm->words[g + i], words, block_size);
+	}
+    }
+
+    free(buf);
+    return 0;
+
+fail:
+    free(buf);
+    bitmap_free(bm);
+    return retstat;
+}
+
+/** Write back the bitmap blocks holding bits [@first, @last]
+ *
+ * Returns 0 or the first error, which stops the write-back there;
+ * journal_write() fails with -ENOMEM when the running transaction
+ * has pinned every frame it could use.
+ */
+static int bitmap_store(struct bitmap *bm, const uint64_t first,
+			const uint64_t last)
+{
+    uint64_t b;
+    int retstat;
+
+    for (b = first / bm->group_bits; b <= last / bm->group_bits; b++) {
+	retstat = journal_write(bm->disk_start + b, bm->words[b]);
+	if (retstat < 0)
+	    return retstat;
+    }
+
+    return 0;
+}
+
+/** Set or clear bits [@start, @start + @n), returning how many changed
+ *
+ * Their groups must be in memory.
+ */
+static uint64_t bitmap_update(struct bitmap *bm, const uint64_t start,
+			      const uint64_t n, const int set)
+{
+    uint64_t i = start, end = start + n;
+    uint64_t w, mask, old, changed, total = 0;
+
+    while (i < end) {
+	w = i >> 6;
+	mask = ~0ULL << (i & 63);
+	if (end < (w + 1) << 6)
+	    mask &= ~(~0ULL << (end & 63));
+
+	old = *word_at(bm, w);
+	*word_at(bm, w) = set ? old | mask : old & ~mask;
+	changed = __builtin_popcountll(old ^ *word_at(bm, w));
+	// a word never straddles two groups
+	if (set)
+	    bm->group_free[i / bm->group_bits] -= changed;
+	else
+	    bm->group_free[i / bm->group_bits] += changed;
+	total += changed;
+	i = (w + 1) << 6;
+    }
+
+    return total;
+}
+
+/** Set or clear bits [@start, @start + @n) and write them back
+ *
+ * *@changed is set to how many bits changed.  If the bitmap blocks
+ * cannot all be written, the bits are put back as they were, in
+ * memory and in the blocks already written, and -errno is returned.
+ */
+static int bitmap_change(struct bitmap *bm, const uint64_t start,
+			 const uint64_t n, const int set, uint64_t *changed)
+{
+    uint64_t first = start >> 6, nwords = ((start + n - 1) >> 6) - first + 1;
+    uint64_t gfirst = start / bm->group_bits, glast = (start + n - 1) / bm->group_bits;
+    uint64_t *saved, g, w;
+    int retstat;
+
+    *changed = 0;
+    for (g = gfirst; g <= glast; g++) {
+	retstat = group_get(bm, g);
+	if (retstat < 0)
+	    goto out;
+    }
+    saved = malloc(nwords * sizeof(uint64_t));
+    if (saved == NULL) {
+	retstat = -ENOMEM;
+	goto out;
+    }
+    for (w = 0; w < nwords; w++)
+	saved[w] = *word_at(bm, first + w);
+
+    *changed = bitmap_update(bm, start, n, set);
+    retstat = bitmap_store(bm, start, start + n - 1);
+    if (retstat < 0) {
+	for (w = 0; w < nwords; w++)
+	    *word_at(bm, first + w) = saved[w];
+	for (g = gfirst; g <= glast; g++)
+	    group_recount(bm, g);
+	bitmap_store(bm, start, start + n - 1);
+	*changed = 0;
+    }
+    free(saved);
+
+out:
+    for (g = gfirst; g <= glast; g++)
+	group_put(bm, g);
+
+    return retstat;
+}
+
+static uint64_t bitmap_count_free(const struct bitmap *bm)
+{
+    uint64_t g, n = 0;
+
+    for (g = 0; g < bm->ngroups; g++)
+	n += bm->group_free[g];
+
+    return n;
+}
+
+/** First clear bit in [@from, @end), skipping full groups, or @end */
+static uint64_t bitmap_find_clear(const struct bitmap *bm, uint64_t from,
+				  const uint64_t end)
+{
+    uint64_t g, gend, bit;
+
+    while (from < end) {
+	g = from / bm->group_bits;
+	gend = group_end(bm, g);
+	if (gend > end)
+	    gend = end;
+	if (bm->words[g] != NULL) {
+	    bit = g * bm->group_bits
+		+ bitops_find(bm->words[g], from - g * bm->group_bits,
+			      gend - g * bm->group_bits, 0);
+	    if (bit < gend)
+		return bit;
+	} else if (bm->group_free[g] != 0) {
+	    return from;
+	}
+	from = gend;
+    }
+
+    return end;
+}
+
+/** First set bit in [@from, @end), skipping empty groups, or @end */
+static uint64_t bitmap_find_set(const struct bitmap *bm, uint64_t from,
+				const uint64_t end)
+{
+    uint64_t g, gend, bit;
+
+    while (from < end) {
+	g = from / bm->group_bits;
+	gend = group_end(bm, g);
+	if (gend > end)
+	    gend = end;
+	if (bm->words[g] != NULL) {
+	    bit = g * bm->group_bits
+		+ bitops_find(bm->words[g], from - g * bm->group_bits,
+			      gend - g * bm->group_bits, 1);
+	    if (bit < gend)
+		return bit;
+	} else if (bm->group_free[g] == 0) {
+	    return from;
+	}
+	from = gend;
+    }
+
+    return end;
+}
+
+/** Look for @want clear bits in a row, starting at @from
+ *
+ * Wraps around once.  Returns the first run of @want bits that turns
+ * up; failing that, the longest shorter run seen.  *@got is set to
+ * the run length, or to 0 if the bitmap is full.
+ */
+static uint64_t bitmap_find(const struct bitmap *bm, const uint64_t from,
+			    const uint64_t want, uint64_t *got)
+{
+    uint64_t seg_start[2] = { from, 0 };
+    uint64_t seg_end[2] = { bm->nbits, from };
+    uint64_t best = 0, best_len = 0;
+    uint64_t i, pos, start, stop;
+    int seg;
+
+    for (seg = 0; seg < 2; seg++) {
+	pos = seg_start[seg];
+	while (pos < seg_end[seg]) {
+	    start = bitmap_find_clear(bm, pos, seg_end[seg]);
+	    if (start >= seg_end[seg])
+		break;
+	    stop = start + want < bm->nbits ? start + want : bm->nbits;
+	    i = bitmap_find_set(bm, start, stop);
+	    if (i - start >= want) {
+		*got = want;
+		return start;
+	    }
+	    if (i - start > best_len) {
+		best = start;
+		best_len = i - start;
+	    }
+	    pos = i;
+	}
+    }
+
+    *got = best_len;
+    return best;
+}
+
+/** Load both bitmaps of the mounted image and recount free space */
+int alloc_init()
+{
+    int retstat;
+
+    bitops_init();
+
+    retstat = bitmap_load(&bmap, sb.nblocks - sb.data_start,
+			  sb.bitmap_start, sb.bitmap_blocks);
+    if (retstat < 0)
+	return retstat;
+
+    retstat = bitmap_load(&imap, sb.ninodes, sb.ibitmap_start, sb.ibitmap_blocks);
+    if (retstat < 0) {
+	bitmap_free(&bmap);
+	return retstat;
+    }
+
+    sb.free_blocks = bitmap_count_free(&bmap);
+    sb.free_inodes = bitmap_count_free(&imap);
+
+    return 0;
+}
+
+void alloc_exit()
+{
+    bitmap_free(&bmap);
+    bitmap_free(&imap);
+    free(deferred);
+    deferred = NULL;
+    ndeferred = 0;
+    deferred_cap = 0;
+}
+
+/** Allocate up to @want contiguous blocks, as close after @goal as possible
+ *
+ * If @goal itself is free, the run starting there is taken even when
+ * it is shorter than @want, so a growing file stays in one piece.
+ * Otherwise the first run of @want blocks at or after @goal wins, and
+ * only if there is none does a shorter one do.  Requests are capped
+ * at one group's worth of blocks.
+ *
+ * Sets *@first to the first block and *@got to the number allocated.
+ * Returns 0, -ENOSPC when the disk is full, or -errno when the
+ * bitmap could not be written, in which case nothing was allocated.
+ */
+int alloc_blocks(const blkno_t goal, uint64_t want, blkno_t *first,
+		 uint64_t *got)
+{
+    uint64_t from, start, changed;
+    int retstat = 0;
+
+    if (want > bmap.group_bits)
+	want = bmap.group_bits;
+
+    pthread_mutex_lock(&alloc_lock);
+    if (goal >= sb.data_start && goal < sb.nblocks) {
+	from = goal - sb.data_start;
+	if (!bit_test(&bmap, from)) {
+	    start = from;
+	    *got = bitmap_find_set(&bmap, from, from + want < bmap.nbits
+				   ? from + want : bmap.nbits) - from;
+	    goto found;
+	}
+    } else {
+	from = bmap.hint;
+    }
+
+    start = bitmap_find(&bmap, from, want, got);
+    if (*got == 0) {
+	retstat = -ENOSPC;
+	goto out;
+    }
+
+found:
+    retstat = bitmap_change(&bmap, start, *got, 1, &changed);
+    if (retstat < 0) {
+	*got = 0;
+	goto out;
+    }
+    sb.free_blocks -= changed;
+    bmap.hint = start + *got;
+    *first = sb.data_start + start;
+
+out:
+    pthread_mutex_unlock(&alloc_lock);
+    return retstat;
+}
+
+static int alloc_release(const blkno_t start, const uint64_t count)
+{
+    uint64_t changed;
+    int retstat;
+
+    retstat = bitmap_change(&bmap, start - sb.data_start, count, 0, &changed);
+    sb.free_blocks += changed;
+
+    return retstat;
+}
+
+/** Free blocks [@start, @start + @count)
+ *
+ * With the journal on they only become free once the running
+ * transaction has committed.  If there is no memory to remember
+ * them, they are freed right away.  Returns 0, or -errno if the
+ * bitmap could not be written and the blocks are still in use.
+ */
+int alloc_free_blocks(const blkno_t start, const uint64_t count)
+{
+    struct free_run *runs;
+    int retstat;
+
+    if (count == 0 || start < sb.data_start || start + count > sb.nblocks)
+	return 0;
+
+    pthread_mutex_lock(&alloc_lock);
+    if (journal_active()) {
+	journal_revoke(start, count);
+	if (ndeferred == deferred_cap) {
+	    runs = realloc(deferred, (deferred_cap ? 2 * deferred_cap : 64)
+			   * sizeof(struct free_run));
+	    if (runs != NULL) {
+		deferred = runs;
+		deferred_cap = deferred_cap ? 2 * deferred_cap : 64;
+	    }
+	}
+	if (ndeferred < deferred_cap) {
+	    deferred[ndeferred].start = start;
+	    deferred[ndeferred].count = count;
+	    ndeferred++;
+	    pthread_mutex_unlock(&alloc_lock);
+	    return 0;
+	}
+    }
+
+    retstat = alloc_release(start, count);
+    pthread_mutex_unlock(&alloc_lock);
+    return retstat;
+}
+
+/** Number of block frees held back so far, oldest first */
+unsigned int alloc_deferred()
+{
+    unsigned int n;
+
+    pthread_mutex_lock(&alloc_lock);
+    n = ndeferred;
+    pthread_mutex_unlock(&alloc_lock);
+
+    return n;
+}
+
+/** Really free the oldest @n of the blocks held back by
+ *  alloc_free_blocks()
+ *
+ * Called by the journal once the transactions that freed them are
+ * durable.  The bitmap blocks this dirties go into the running one.
+ * Runs whose bitmap blocks cannot be written now stay held back and
+ * go with the next call.
+ */
+void alloc_free_deferred(const unsigned int n)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&alloc_lock);
+    for (i = 0; i < n && i < ndeferred; i++)
+	if (alloc_release(deferred[i].start, deferred[i].count) < 0)
+	    break;
+    memmove(deferred, deferred + i, (ndeferred - i) * sizeof(struct free_run));
+    ndeferred -= i;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+/** Allocate an inode number into *@ino
+ *
+ * Returns 0, -ENOSPC if there are none left, or -errno if the bitmap
+ * could not be written.
+ */
+int alloc_inode(uint32_t *ino)
+{
+    uint64_t bit, got, changed;
+    int retstat;
+
+    pthread_mutex_lock(&alloc_lock);
+    bit = bitmap_find(&imap, imap.hint, 1, &got);
+    if (got == 0) {
+	retstat = -ENOSPC;
+    } else {
+	retstat = bitmap_change(&imap, bit, 1, 1, &changed);
+	if (retstat == 0) {
+	    sb.free_inodes -= changed;
+	    imap.hint = bit + 1;
+	    *ino = bit;
+	}
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+    return retstat;
+}
+
+/** Free inode number @ino; returns 0 or -errno with it still in use */
+int alloc_free_inode(const uint32_t ino)
+{
+    uint64_t changed;
+    int retstat;
+
+    if (ino == 0 || ino >= imap.nbits)
+	return 0;
+
+    pthread_mutex_lock(&alloc_lock);
+    retstat = bitmap_change(&imap, ino, 1, 0, &changed);
+    sb.free_inodes += changed;
+    pthread_mutex_unlock(&alloc_lock);
+
+    return retstat;
+}
@@ -0,0 +1,25 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+#include <stdint.h>
+
+#include "block.h"
+
+int alloc_init();
+void alloc_exit();
+int alloc_blocks(const blkno_t goal, const uint64_t want, blkno_t *first,
+		 uint64_t *got);
+int alloc_free_blocks(const blkno_t start, const uint64_t count);
+unsigned int alloc_deferred();
+void alloc_free_deferred(const unsigned int n);
+int alloc_inode(uint32_t *ino);
+int alloc_free_inode(const uint32_t ino);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Word-at-a-time bitmap scans for the allocator.  Bit i of a bitmap
+  is bit (i % 64) of word i / 64, which is also the byte-wise LSB-first
+  order the bitmaps have on disk as long as the host is little-endian.
+
+  The portable scan looks at 64 bits per step.  On x86-64 hosts with
+  AVX2, runs of all-ones or all-zeroes words are skipped 256 bits at a
+  time instead; bitops_init() picks one at mount time.
+*/
+
+#include <stdint.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define BITOPS_AVX2
+#endif
+
+#include "bitops.h"
+
+typedef uint64_t (*bitops_find_t)(const uint64_t *, uint64_t, uint64_t, uint64_t);
+
+/** Mask of the bits of word w that lie in [from, end) */
+static inline uint64_t word_mask(const uint64_t w, const uint64_t from,
+				 const uint64_t end)
+{
+    uint64_t mask = ~0ULL;
+
+    if (from > w << 6)
+	mask <<= from & 63;
+    if (end < (w + 1) << 6)
+	mask &= ~(~0ULL << (end & 63));
+
+    return mask;
+}
+
+/** Finish a scan at word @w: first bit at or after it, clipped to @end */
+static inline uint64_t find_tail(const uint64_t *words, uint64_t w,
+				 const uint64_t end, const uint64_t flip)
+{
+    uint64_t last = (end + 63) >> 6;
+    uint64_t x, bit;
+
+    for (; w < last; w++) {
+	x = (words[w] ^ flip) & word_mask(w, 0, end);
+	if (x != 0) {
+	    bit = (w << 6) + __builtin_ctzll(x);
+	    return bit < end ? bit : end;
+	}
+    }
+
+    return end;
+}
+
+/** First bit in [@from, @end) that differs from @flip's bits, or @end */
+static uint64_t find_word(const uint64_t *words, uint64_t from,
+			  uint64_t end, uint64_t flip)
+{
+    uint64_t w = from >> 6;
+    uint64_t x;
+
+    if (from >= end)
+	return end;
+
+    x = (words[w] ^ flip) & word_mask(w, from, end);
+    if (x != 0)
+	return (w << 6) + __builtin_ctzll(x);
+
+    return find_tail(words, w + 1, end, flip);
+}
+
+#ifdef BITOPS_AVX2
+__attribute__((target("avx2")))
+static uint64_t find_avx2(const uint64_t *words, uint64_t from,
+			  uint64_t end, uint64_t flip)
+{
+    uint64_t w = from >> 6;
+    uint64_t last = (end + 63) >> 6;
+    __m256i v, ones = _mm256_set1_epi64x(-1);
+    uint64_t x;
+
+    if (from >= end)
+	return end;
+
+    x = (words[w] ^ flip) & word_mask(w, from, end);
+    if (x != 0)
+	return (w << 6) + __builtin_ctzll(x);
+
+    // skip 4 words at a time while they are all flip
+    for (w++; w + 4 <= last; w += 4) {
+	v = _mm256_loadu_si256((const __m256i *) (words + w));
+	if (flip ? !_mm256_testc_si256(v, ones) : !_mm256_testz_si256(v, v))
+	    break;
+    }
+
+    return find_tail(words, w, end, flip);
+}
+#endif
+
+static bitops_find_t find_impl = find_word;
+static const char *find_name = "64-bit words";
+
+/** Pick the fastest scan this CPU can run */
+void bitops_init()
+{
+#ifdef BITOPS_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+	find_impl = find_avx2;
+	find_name = "avx2";
+	return;
+    }
+#endif
+    find_impl = find_word;
+    find_name = "64-bit words";
+}
+
+const char *bitops_impl()
+{
+    return find_name;
+}
+
+/** Index of the first bit in [@from, @end) that is @set, or @end */
+uint64_t bitops_find(const uint64_t *words, const uint64_t from,
+		     const uint64_t end, const int set)
+{
+    return find_impl(words, from, end, set ? 0 : ~0ULL);
+}
+
+/** Number of set bits in [@from, @end) */
+uint64_t bitops_count(const uint64_t *words, const uint64_t from,
+		      const uint64_t end)
+{
+    uint64_t w, n = 0;
+
+    if (from >= end)
+	return 0;
+
+    for (w = from >> 6; w < (end + 63) >> 6; w++)
+	n += __builtin_popcountll(words[w] & word_mask(w, from, end));
+
+    return n;
+}
@@ -0,0 +1,20 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _BITOPS_H_
+#define _BITOPS_H_
+
+#include <stdint.h>
+
+void bitops_init();
+const char *bitops_impl();
+uint64_t bitops_find(const uint64_t *words, const uint64_t from,
+		     const uint64_t end, const int set);
+uint64_t bitops_count(const uint64_t *words, const uint64_t from,
+		      const uint64_t end);
+
+#endif
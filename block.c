@@ -5,50 +5,263 @@
   See the file COPYING.
 */
 
+// need this to get IOV_MAX out of <limits.h>
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "block.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "diskmap.h"
+#include "holemap.h"
+#include "readahead.h"
+#include "uring.h"
+
+// largest run, in bytes, that goes to io_uring as a single request
+#define DISK_URING_CHUNK (64 * 1024)
+
+// buffer, length and offset alignment we assume O_DIRECT needs
+#define DISK_DIRECT_ALIGN 512
 
 int diskfile = -1;
+static int disk_direct = 0;     // diskfile is open with O_DIRECT
+
+/** A block_commit() caller, on its own stack until its fdatasync is done */
+struct commit_waiter {
+    unsigned long long ticket;
+    int result;                 // what the fdatasync covering the ticket returned
+    int done;
+    struct commit_waiter *next;
+};
+
+// group commit state for block_commit(), under commit_lock
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_done = PTHREAD_COND_INITIALIZER;
+static unsigned long long commit_requested = 0;  // tickets handed out
+static unsigned long long commit_completed = 0;  // tickets covered by a finished fdatasync
+static int commit_running = 0;                   // a caller is in fdatasync
+static struct commit_waiter *commit_waiters = NULL; // callers not yet covered
+static unsigned long long commit_last_group = 0; // callers the last fdatasync covered
+static unsigned int commit_window = BLOCK_COMMIT_WINDOW;
+static struct commit_stats commit_stats;
+unsigned int block_size = SFS_MIN_BLOCK_SIZE;
+unsigned int block_shift = 9;
 
-void disk_open(const char* diskfile_path)
+/** Open the disk file
+ *
+ * @flags picks optional backends: DISK_IO_URING batches multi-block
+ * transfers through io_uring, falling back to synchronous
+ * preadv/pwritev if the kernel does not support it.  DISK_MMAP maps
+ * the whole file so block transfers become memcpy; it takes
+ * precedence over DISK_IO_URING and DISK_DIRECT.  DISK_DIRECT opens
+ * the file with O_DIRECT so data does not also sit in the host page
+ * cache; unaligned transfers are bounced through a pool of aligned
+ * buffers.
+ *
+ * Unless the file is mapped, its data and hole extents are charted
+ * with SEEK_DATA/SEEK_HOLE so reads of holes skip the I/O.
+ */
+void disk_open(const char* diskfile_path, const int flags)
 {
+    int retstat;
+
     if(diskfile >= 0){
 	return;
     }
     
-    diskfile = open(diskfile_path, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
+    if ((flags & DISK_DIRECT) && !(flags & DISK_MMAP)) {
+	diskfile = open(diskfile_path, O_CREAT|O_RDWR|O_DIRECT, S_IRUSR|S_IWUSR);
+	if (diskfile >= 0 && bufpool_init(BUFPOOL_COUNT, BUFPOOL_BUF_SIZE) < 0) {
+	    close(diskfile);
+	    diskfile = -1;
+	    errno = ENOMEM;
+	}
+	if (diskfile >= 0)
+	    disk_direct = 1;
+	else
+	    fprintf(stderr, "cannot open disk file with O_DIRECT (%s), using buffered I/O\n",
+		    strerror(errno));
+    }
+
+    if (diskfile < 0)
+	diskfile = open(diskfile_path, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR);
     if (diskfile < 0) {
 	perror("disk_open failed");
 	exit(EXIT_FAILURE);
     }
+
+    if (flags & DISK_MMAP) {
+	retstat = diskmap_init(diskfile);
+	if (retstat < 0)
+	    fprintf(stderr, "cannot mmap disk file (%s), using read/write\n",
+		    strerror(-retstat));
+    }
+
+    if (!diskmap_active())
+	holemap_init(diskfile);
+
+    if ((flags & DISK_IO_URING) && !diskmap_active()) {
+	retstat = uring_init(URING_ENTRIES);
+	if (retstat < 0)
+	    fprintf(stderr, "io_uring unavailable (%s), using synchronous I/O\n",
+		    strerror(-retstat));
+    }
 }
 
 void disk_close()
 {
     if(diskfile >= 0){
+	readahead_exit();
+	cache_destroy();
+	diskmap_exit();
+	holemap_exit();
+	uring_exit();
 	close(diskfile);
+	diskfile = -1;
+	disk_direct = 0;
+	bufpool_exit();
     }
 }
 
-/** Read a block from an open file
+static int direct_aligned(const void *buf, const size_t len, const off_t offset)
+{
+    return (((uintptr_t) buf | len | (uintptr_t) offset) % DISK_DIRECT_ALIGN) == 0;
+}
+
+static int iov_direct_aligned(const struct iovec *iov, const int iovcnt,
+			      const off_t offset)
+{
+    int i;
+
+    if (offset % DISK_DIRECT_ALIGN)
+	return 0;
+    for (i = 0; i < iovcnt; i++)
+	if (!direct_aligned(iov[i].iov_base, iov[i].iov_len, 0))
+	    return 0;
+
+    return 1;
+}
+
+/** Drop O_DIRECT after the kernel refused an aligned transfer
  *
- * Read should return   (1) exactly @BLOCK_SIZE when succeeded, or 
-                        (2) 0 when the requested block has never been touched before, or 
-                        (3) a negtive value when failed. 
- * In cases of error or return value equals to 0, the content of the @buf is set to 0.
+ * That happens when the device wants a larger alignment than
+ * DISK_DIRECT_ALIGN, or the host file system does not do direct I/O
+ * on this file.
+ */
+static void disk_direct_off()
+{
+    int fl = fcntl(diskfile, F_GETFL);
+
+    fcntl(diskfile, F_SETFL, fl & ~O_DIRECT);
+    disk_direct = 0;
+    fprintf(stderr, "O_DIRECT transfer rejected, falling back to buffered I/O\n");
+}
+
+/** Record that [@offset, +@len) of the disk file now holds data */
+static void disk_written(const off_t offset, const off_t len)
+{
+    holemap_add(offset, len);
+    readahead_cancel(offset >> block_shift,
+		     (len + block_size - 1) >> block_shift);
+}
+
+/** pread/pwrite one buffer, bouncing it through the pool if O_DIRECT needs it
+ *
+ * @len must not exceed bufpool_buf_size().  Returns what pread/pwrite
+ * returned, with errno set on failure.
  */
-int block_read(const int block_num, void *buf)
+static ssize_t disk_pio(const int write, void *buf, const size_t len,
+			const off_t offset)
+{
+    void *io = buf;
+    ssize_t ret;
+    int err;
+
+    if (disk_direct && !direct_aligned(buf, len, offset)) {
+	io = bufpool_get();
+	if (io == NULL) {
+	    errno = ENOMEM;
+	    return -1;
+	}
+	if (write)
+	    memcpy(io, buf, len);
+    }
+
+    for (;;) {
+	if (write)
+	    ret = pwrite(diskfile, io, len, offset);
+	else
+	    ret = pread(diskfile, io, len, offset);
+	if (ret < 0 && errno == EINTR)
+	    continue;
+	if (ret < 0 && errno == EINVAL && disk_direct) {
+	    disk_direct_off();
+	    continue;
+	}
+	break;
+    }
+    err = errno;
+
+    if (io != buf) {
+	if (!write && ret > 0)
+	    memcpy(buf, io, ret);
+	bufpool_put(io);
+    }
+
+    errno = err;
+    return ret;
+}
+
+/** Switch the block size once it is known from the superblock
+ *
+ * @size must be a power of two between SFS_MIN_BLOCK_SIZE and
+ * SFS_MAX_BLOCK_SIZE, and the block cache must not be set up yet.
+ * Returns 0 or -EINVAL/-EBUSY.
+ */
+int block_set_size(const unsigned int size)
+{
+    if (size < SFS_MIN_BLOCK_SIZE || size > SFS_MAX_BLOCK_SIZE
+	|| (size & (size - 1)) != 0)
+	return -EINVAL;
+    if (cache_enabled())
+	return -EBUSY;
+
+    block_size = size;
+    for (block_shift = 0; (1U << block_shift) < size; block_shift++)
+	;
+    return 0;
+}
+
+/** Read a block straight from the disk file, bypassing the cache
+ *
+ * Same return convention as block_read().
+ */
+int disk_read(const blkno_t block_num, void *buf)
 {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    if (diskmap_active())
+	return diskmap_read(block_offset(block_num), buf, block_size);
+
+    if (holemap_is_hole(block_offset(block_num), block_size)) {
+	memset(buf, 0, block_size);
+	return 0;
+    }
+
+    retstat = disk_pio(0, buf, block_size, block_offset(block_num));
     if (retstat <= 0){
-	memset(buf, 0, BLOCK_SIZE);
+	memset(buf, 0, block_size);
 	if(retstat<0)
 	perror("block_read failed");
     }
@@ -56,17 +269,774 @@ int block_read(const int block_num, void *buf)
     return retstat;
 }
 
-/** Write a block to an open file
+/** Write a block straight to the disk file, bypassing the cache
  *
- * Write should return exactly @BLOCK_SIZE except on error. 
+ * Same return convention as block_write().
  */
-int block_write(const int block_num, const void *buf)
+int disk_write(const blkno_t block_num, const void *buf)
 {
     int retstat = 0;
-    retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+    if (diskmap_active())
+	return diskmap_write(block_offset(block_num), buf, block_size);
+
+    retstat = disk_pio(1, (void *) buf, block_size, block_offset(block_num));
     if (retstat < 0)
 	perror("block_write failed");
-    
+    else
+	disk_written(block_offset(block_num), retstat);
+
     return retstat;
 }
 
+/** Zero blocks [@block_num, +@count) of the disk file, bypassing the cache
+ *
+ * Meant for formatting, where the range can be as large as a whole
+ * bitmap: the part inside the file is punched out rather than
+ * written, and the part past its end already reads as zeroes.  Falls
+ * back to writing zeroes where the host cannot punch holes.  Returns
+ * 0 or -errno.
+ */
+int disk_zero(const blkno_t block_num, const uint64_t count)
+{
+    off_t offset = block_offset(block_num), len = (off_t) count << block_shift;
+    struct stat st;
+    uint64_t i, n;
+    char *buf;
+    int retstat = 0;
+
+    if (fstat(diskfile, &st) < 0)
+	return -errno;
+    if (S_ISREG(st.st_mode)) {
+	if (offset >= st.st_size)
+	    return 0;
+	if (len > st.st_size - offset)
+	    len = st.st_size - offset;
+    }
+    if (fallocate(diskfile, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+	return 0;
+
+    buf = calloc(1, block_size);
+    if (buf == NULL)
+	return -ENOMEM;
+    n = (len + block_size - 1) >> block_shift;
+    for (i = 0; i < n && retstat >= 0; i++)
+	retstat = disk_write(block_num + i, buf);
+    free(buf);
+
+    return retstat < 0 ? -EIO : 0;
+}
+
+/** Read blocks [@block_num, +@count) straight from the disk file
+ *
+ * Goes around the block cache and the hole map, so the readahead
+ * thread can call it without holding up the threads that use them.
+ * @buf must be aligned for O_DIRECT.  Whatever lies past the end of
+ * the disk file reads as zeroes.  Returns 0 or -errno.
+ */
+int disk_read_blocks(const blkno_t block_num, const int count, void *buf)
+{
+    size_t len = (size_t) count << block_shift;
+    size_t done = 0;
+    ssize_t ret;
+
+    if (diskmap_active())
+	return -EINVAL;
+
+    while (done < len) {
+	ret = disk_pio(0, (char *) buf + done, len - done,
+		       block_offset(block_num) + done);
+	if (ret < 0)
+	    return -errno;
+	if (ret == 0) {
+	    memset((char *) buf + done, 0, len - done);
+	    break;
+	}
+	done += ret;
+    }
+
+    return 0;
+}
+
+/** Start reading blocks [@block_num, +@count) into the block cache
+ *
+ * Returns right away; later block_read()s of these blocks will hit
+ * the cache if the reads have finished by then.  Without the
+ * readahead thread this is only a hint to the host (block_advise()).
+ */
+void block_prefetch(const blkno_t block_num, const int count)
+{
+    if (readahead_active())
+	readahead_submit(block_num, count);
+    else
+	block_advise(block_num, count);
+}
+
+/** Ask the host to start reading blocks [@block_num, +@count) into
+ *  its page cache, for data that will be taken through block_fd()
+ *
+ * An O_DIRECT disk file skips the page cache and block_fd() is not
+ * available, so the blocks go to the block cache instead.
+ */
+void block_advise(const blkno_t block_num, const int count)
+{
+    if (disk_direct) {
+	if (readahead_active())
+	    readahead_submit(block_num, count);
+	return;
+    }
+
+    posix_fadvise(diskfile, block_offset(block_num),
+		  (off_t) count << block_shift, POSIX_FADV_WILLNEED);
+}
+
+/** Read a block from an open file
+ *
+ * Read should return   (1) exactly @block_size when succeeded, or 
+                        (2) 0 when the requested block has never been touched before, or 
+                        (3) a negtive value when failed. 
+ * In cases of error or return value equals to 0, the content of the @buf is set to 0.
+ *
+ * Goes through the block cache when one has been set up with cache_init().
+ */
+int block_read(const blkno_t block_num, void *buf)
+{
+    if (cache_enabled()) {
+	readahead_reap();
+	return cache_read(block_num, buf);
+    }
+
+    return disk_read(block_num, buf);
+}
+
+/** Write a block to an open file
+ *
+ * Write should return exactly @block_size except on error. 
+ *
+ * With the block cache enabled the write only dirties the cached
+ * copy; it reaches the disk file on eviction or block_sync().
+ */
+int block_write(const blkno_t block_num, const void *buf)
+{
+    if (cache_enabled())
+	return cache_write(block_num, buf);
+
+    return disk_write(block_num, buf);
+}
+
+/** Push every dirty cached block to the disk file and make it durable
+ *
+ * Returns 0 on success or -errno.
+ */
+int block_sync()
+{
+    int retstat = 0;
+
+    if (cache_enabled()) {
+	retstat = cache_flush();
+	if (retstat < 0)
+	    return retstat;
+    }
+
+    if (diskmap_active()) {
+	retstat = diskmap_sync();
+	if (retstat < 0)
+	    return retstat;
+    }
+
+    if (fdatasync(diskfile) < 0) {
+	retstat = -errno;
+	perror("block_sync failed");
+    }
+
+    return retstat;
+}
+
+/** Push every dirty cached block to the disk file without waiting
+ *  for it to reach stable storage; see block_commit()
+ *
+ * Returns 0 on success or -errno.
+ */
+int block_flush()
+{
+    if (cache_enabled())
+	return cache_flush();
+
+    return 0;
+}
+
+/** Set how long, in microseconds, a group commit waits for company */
+void block_commit_window(const unsigned int usec)
+{
+    commit_window = usec;
+}
+
+/** Make everything written to the disk file so far durable
+ *
+ * Concurrent callers share one fdatasync: each takes a ticket, and
+ * whoever finds no fdatasync in progress runs one for every ticket
+ * handed out by then while the others wait for it.  Callers arriving
+ * during an fdatasync are covered by the next one.  When the last
+ * group had more than one member the leader first waits
+ * @commit_window microseconds for more to join, so a lone caller
+ * fsyncing in a loop is never delayed.  mmap'ed pages are covered
+ * too, fdatasync writes them like any other dirty page.
+ *
+ * Does not take the file system lock; call block_flush() under it
+ * first.  Returns 0, or -errno from the fdatasync that covered this
+ * caller.
+ */
+int block_commit()
+{
+    struct commit_waiter self, **link;
+    unsigned long long target;
+    int retstat;
+
+    pthread_mutex_lock(&commit_lock);
+    self.ticket = ++commit_requested;
+    self.done = 0;
+    self.next = commit_waiters;
+    commit_waiters = &self;
+    commit_stats.requests++;
+    while (!self.done) {
+	if (commit_running) {
+	    pthread_cond_wait(&commit_done, &commit_lock);
+	    continue;
+	}
+
+	commit_running = 1;
+	if (commit_window > 0 && commit_last_group > 1) {
+	    pthread_mutex_unlock(&commit_lock);
+	    usleep(commit_window);
+	    pthread_mutex_lock(&commit_lock);
+	}
+	target = commit_requested;
+	pthread_mutex_unlock(&commit_lock);
+
+	retstat = 0;
+	if (fdatasync(diskfile) < 0) {
+	    retstat = -errno;
+	    perror("block_commit failed");
+	}
+
+	pthread_mutex_lock(&commit_lock);
+	commit_last_group = target - commit_completed;
+	commit_completed = target;
+	// hand the result to exactly the callers this fdatasync covered,
+	// a later one may have failed or succeeded by the time they wake
+	for (link = &commit_waiters; *link != NULL; ) {
+	    if ((*link)->ticket <= target) {
+		(*link)->result = retstat;
+		(*link)->done = 1;
+		*link = (*link)->next;
+	    } else {
+		link = &(*link)->next;
+	    }
+	}
+	commit_running = 0;
+	commit_stats.syncs++;
+	pthread_cond_broadcast(&commit_done);
+    }
+    pthread_mutex_unlock(&commit_lock);
+
+    return self.result;
+}
+
+void block_commit_stats(struct commit_stats *out)
+{
+    pthread_mutex_lock(&commit_lock);
+    *out = commit_stats;
+    pthread_mutex_unlock(&commit_lock);
+}
+
+int disk_mapped()
+{
+    return diskmap_active();
+}
+
+/** Pointer to a block inside the mapped disk file
+ *
+ * Only available with DISK_MMAP; returns NULL otherwise.  Stores
+ * through the pointer must be followed by block_dirty() so that they
+ * get msync'ed.  The pointer stays valid until disk_close().
+ */
+void *block_ptr(const blkno_t block_num)
+{
+    if (!diskmap_active())
+	return NULL;
+
+    return diskmap_ptr(block_offset(block_num), block_size);
+}
+
+void block_dirty(const blkno_t block_num)
+{
+    if (diskmap_active())
+	diskmap_dirty(block_offset(block_num), block_size);
+}
+
+/** Hand out the disk file for I/O on blocks [@block_num, +@count)
+ *
+ * For callers that move data between the disk file and another file
+ * descriptor themselves, e.g. with splice.  Any newer copies of the
+ * blocks in the block cache are written back first.  Returns the
+ * descriptor with *@offset set to the byte offset of @block_num, or
+ * -1 when the disk file cannot be used that way (O_DIRECT).  Writes
+ * must be reported with block_fd_written().
+ */
+int block_fd(const blkno_t block_num, const int count, off_t *offset)
+{
+    if (disk_direct || cache_writeback(block_num, count) < 0)
+	return -1;
+
+    *offset = block_offset(block_num);
+    return diskfile;
+}
+
+/** Note that blocks [@block_num, +@count) were written through block_fd() */
+void block_fd_written(const blkno_t block_num, const int count)
+{
+    cache_invalidate(block_num, count);
+    disk_written(block_offset(block_num), (off_t) count << block_shift);
+}
+
+static int iov_total(const struct iovec *iov, const int iovcnt)
+{
+    int i, len = 0;
+
+    for (i = 0; i < iovcnt; i++)
+	len += iov[i].iov_len;
+
+    return len;
+}
+
+/** Copy @len bytes between @buf and the scatter list, starting at
+ *  entry *@idx, byte *@pos, and advance the cursor past them.
+ */
+static void iov_copy(const int to_iov, const struct iovec *iov, int *idx,
+		     size_t *pos, char *buf, size_t len)
+{
+    size_t n;
+
+    while (len > 0) {
+	n = iov[*idx].iov_len - *pos;
+	if (n > len)
+	    n = len;
+	if (to_iov)
+	    memcpy((char *) iov[*idx].iov_base + *pos, buf, n);
+	else
+	    memcpy(buf, (char *) iov[*idx].iov_base + *pos, n);
+	buf += n;
+	len -= n;
+	*pos += n;
+	if (*pos == iov[*idx].iov_len) {
+	    (*idx)++;
+	    *pos = 0;
+	}
+    }
+}
+
+/** O_DIRECT transfer of an unaligned scatter list through pool buffers
+ *
+ * The run is moved in bufpool_buf_size() pieces.  Same return
+ * convention as disk_xfer().
+ */
+static int disk_xfer_bounce(const int write, off_t offset,
+			    const struct iovec *iov, const int iovcnt)
+{
+    char *bounce;
+    size_t chunk = bufpool_buf_size();
+    size_t len, pos = 0, done;
+    int idx = 0;
+    int total = 0;
+    int size = iov_total(iov, iovcnt);
+    ssize_t ret;
+
+    bounce = bufpool_get();
+    if (bounce == NULL)
+	return -ENOMEM;
+
+    while (total < size) {
+	len = size - total;
+	if (len > chunk)
+	    len = chunk;
+	if (write)
+	    iov_copy(0, iov, &idx, &pos, bounce, len);
+
+	for (done = 0; done < len; done += ret) {
+	    ret = disk_pio(write, bounce + done, len - done, offset + done);
+	    if (ret < 0) {
+		total = -errno;
+		perror(write ? "block_writev failed" : "block_readv failed");
+		goto out;
+	    }
+	    if (ret == 0) {
+		if (write) {
+		    total = -EIO;
+		    goto out;
+		}
+		memset(bounce + done, 0, len - done);
+		break;
+	    }
+	}
+
+	if (!write)
+	    iov_copy(1, iov, &idx, &pos, bounce, len);
+	offset += len;
+	total += len;
+    }
+
+out:
+    bufpool_put(bounce);
+    return total;
+}
+
+/** Transfer a contiguous run of blocks with preadv/pwritev
+ *
+ * Splits the vector at IOV_MAX and retries short transfers.  A read
+ * that runs off the end of the disk file zero-fills the remainder.
+ * Returns the number of bytes covered by @iov or -errno.
+ */
+static int disk_xfer(const int write, off_t offset,
+		     const struct iovec *iov, int iovcnt)
+{
+    struct iovec *vec;
+    struct iovec *cur;
+    off_t start;
+    ssize_t done;
+    int total = 0;
+    int i, n;
+
+    if (diskmap_active()) {
+	for (i = 0; i < iovcnt; i++) {
+	    if (write)
+		n = diskmap_write(offset, iov[i].iov_base, iov[i].iov_len);
+	    else
+		n = diskmap_read(offset, iov[i].iov_base, iov[i].iov_len);
+	    if (n < 0)
+		return n;
+	    offset += iov[i].iov_len;
+	    total += iov[i].iov_len;
+	}
+	return total;
+    }
+
+    if (!write && holemap_is_hole(offset, iov_total(iov, iovcnt))) {
+	for (i = 0; i < iovcnt; i++)
+	    memset(iov[i].iov_base, 0, iov[i].iov_len);
+	return iov_total(iov, iovcnt);
+    }
+
+    if (disk_direct && !iov_direct_aligned(iov, iovcnt, offset)) {
+	total = disk_xfer_bounce(write, offset, iov, iovcnt);
+	if (write && total > 0)
+	    disk_written(offset, total);
+	return total;
+    }
+
+    vec = malloc(iovcnt * sizeof(struct iovec));
+    if (vec == NULL)
+	return -ENOMEM;
+    memcpy(vec, iov, iovcnt * sizeof(struct iovec));
+    cur = vec;
+    start = offset;
+
+    while (iovcnt > 0) {
+	n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+	if (write)
+	    done = pwritev(diskfile, cur, n, offset);
+	else
+	    done = preadv(diskfile, cur, n, offset);
+
+	if (done < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EINVAL && disk_direct) {
+		disk_direct_off();
+		continue;
+	    }
+	    total = -errno;
+	    perror(write ? "block_writev failed" : "block_readv failed");
+	    break;
+	}
+	if (done == 0) {
+	    if (write) {
+		total = -EIO;
+		break;
+	    }
+	    for (i = 0; i < iovcnt; i++) {
+		memset(cur[i].iov_base, 0, cur[i].iov_len);
+		total += cur[i].iov_len;
+	    }
+	    break;
+	}
+
+	offset += done;
+	total += done;
+	while (done > 0) {
+	    if ((size_t) done >= cur->iov_len) {
+		done -= cur->iov_len;
+		cur++;
+		iovcnt--;
+	    } else {
+		cur->iov_base = (char *) cur->iov_base + done;
+		cur->iov_len -= done;
+		done = 0;
+	    }
+	}
+    }
+
+    if (write && total > 0)
+	disk_written(start, total);
+    free(vec);
+    return total;
+}
+
+/** Carry out a batch of contiguous transfers
+ *
+ * With io_uring enabled the whole batch is in flight at once; any
+ * request that comes back short (end of file, partial transfer) is
+ * redone synchronously.  Under O_DIRECT the ring is only used when
+ * every buffer is aligned, the rest go through the bounce pool.
+ * Otherwise each request is one preadv/pwritev.  Returns 0 or -errno.
+ */
+static int disk_submit(struct uring_req *reqs, const int nreqs)
+{
+    int i;
+    int retstat;
+    int use_ring;
+
+    use_ring = nreqs > 1 && uring_available();
+    for (i = 0; use_ring && disk_direct && i < nreqs; i++)
+	if (!iov_direct_aligned(reqs[i].iov, reqs[i].iovcnt, reqs[i].offset))
+	    use_ring = 0;
+    if (use_ring && uring_submit(reqs, nreqs) < 0)
+	use_ring = 0;
+
+    for (i = 0; i < nreqs; i++) {
+	if (use_ring && reqs[i].res == iov_total(reqs[i].iov, reqs[i].iovcnt)) {
+	    if (reqs[i].write)
+		disk_written(reqs[i].offset, reqs[i].res);
+	    continue;
+	}
+	retstat = disk_xfer(reqs[i].write, reqs[i].offset, reqs[i].iov,
+			    reqs[i].iovcnt);
+	if (retstat < 0)
+	    return retstat;
+    }
+
+    return 0;
+}
+
+/** Build an iovec for blocks [@first, @last) of the per-block buffer list,
+ *  merging buffers that are adjacent in memory.  Returns the entry count.
+ */
+static int block_iov_run(char **bufs, const int first, const int last,
+			 struct iovec *iov)
+{
+    int i, n = 0;
+
+    for (i = first; i < last; i++) {
+	if (n > 0 && (char *) iov[n-1].iov_base + iov[n-1].iov_len == bufs[i]) {
+	    iov[n-1].iov_len += block_size;
+	} else {
+	    iov[n].iov_base = bufs[i];
+	    iov[n].iov_len = block_size;
+	    n++;
+	}
+    }
+
+    return n;
+}
+
+/** Move the blocks in @blocks to or from the per-block buffers in @bufs
+ *
+ * The list is cut into runs of physically adjacent blocks and each run
+ * becomes one request for disk_submit().  Reads take cached copies
+ * (which may be dirty) from the block cache, zero-fill blocks that
+ * sit in holes of the disk file, and only fetch what is left.  Writes
+ * refresh any cached copies afterwards so the cache never holds stale
+ * data.  When io_uring is in use, long runs are also split at
+ * DISK_URING_CHUNK bytes so that a single big transfer keeps several
+ * requests in flight.
+ *
+ * Returns @count * block_size or a negative value on failure.
+ */
+static int block_xfer(const int write, const blkno_t *blocks, char **bufs,
+		      const int count)
+{
+    struct uring_req *reqs;
+    struct iovec *iov;
+    int nreqs = 0, niov = 0;
+    int i, j, n, max;
+    int retstat;
+
+    if (count == 0)
+	return 0;
+
+    reqs = malloc(count * sizeof(struct uring_req));
+    iov = malloc(count * sizeof(struct iovec));
+    if (reqs == NULL || iov == NULL) {
+	retstat = -ENOMEM;
+	goto out;
+    }
+
+    // take in finished readahead so cache_peek() below can see it
+    if (!write)
+	readahead_reap();
+
+    max = INT_MAX;
+    if (uring_available() && DISK_URING_CHUNK > block_size)
+	max = DISK_URING_CHUNK / block_size;
+    for (i = 0; i < count; i = j) {
+	j = i + 1;
+	if (!write && cache_peek(blocks[i], bufs[i]) >= 0)
+	    continue;
+	if (!write && holemap_is_hole(block_offset(blocks[i]), block_size)) {
+	    memset(bufs[i], 0, block_size);
+	    continue;
+	}
+	for (; j < count && j - i < max; j++) {
+	    if (blocks[j] != blocks[j-1] + 1)
+		break;
+	    if (!write && (cache_peek(blocks[j], NULL) >= 0
+			   || holemap_is_hole(block_offset(blocks[j]), block_size)))
+		break;
+	}
+
+	n = block_iov_run(bufs, i, j, iov + niov);
+	reqs[nreqs].write = write;
+	reqs[nreqs].fd = diskfile;
+	reqs[nreqs].offset = block_offset(blocks[i]);
+	reqs[nreqs].iov = iov + niov;
+	reqs[nreqs].iovcnt = n;
+	reqs[nreqs].res = 0;
+	niov += n;
+	nreqs++;
+    }
+
+    retstat = disk_submit(reqs, nreqs);
+    if (retstat < 0)
+	goto out;
+
+    if (write)
+	for (i = 0; i < count; i++)
+	    cache_update(blocks[i], bufs[i]);
+    retstat = count * block_size;
+
+out:
+    free(reqs);
+    free(iov);
+    return retstat;
+}
+
+/** Expand a scatter list over consecutive blocks into per-block arrays */
+static int block_xfer_iov(const int write, const blkno_t block_num,
+			  const struct iovec *iov, const int iovcnt)
+{
+    blkno_t *blocks;
+    char **bufs;
+    int count = 0;
+    int i, j, k;
+    int retstat;
+
+    for (i = 0; i < iovcnt; i++) {
+	if (iov[i].iov_len % block_size)
+	    return -EINVAL;
+	count += iov[i].iov_len / block_size;
+    }
+
+    blocks = malloc(count * sizeof(blkno_t));
+    bufs = malloc(count * sizeof(char *));
+    if (blocks == NULL || bufs == NULL) {
+	free(blocks);
+	free(bufs);
+	return -ENOMEM;
+    }
+    for (i = 0, k = 0; i < iovcnt; i++) {
+	for (j = 0; (size_t) j < iov[i].iov_len / block_size; j++, k++) {
+	    blocks[k] = block_num + k;
+	    bufs[k] = (char *) iov[i].iov_base + j * block_size;
+	}
+    }
+
+    retstat = block_xfer(write, blocks, bufs, count);
+    free(blocks);
+    free(bufs);
+    return retstat;
+}
+
+/** Expand a flat buffer over a block list into per-block buffers */
+static int block_xfer_buf(const int write, const blkno_t *blocks, const int count,
+			  const char *buf)
+{
+    char **bufs;
+    int i;
+    int retstat;
+
+    bufs = malloc(count * sizeof(char *));
+    if (bufs == NULL)
+	return -ENOMEM;
+    for (i = 0; i < count; i++)
+	bufs[i] = (char *) buf + i * block_size;
+
+    retstat = block_xfer(write, blocks, bufs, count);
+    free(bufs);
+    return retstat;
+}
+
+/** Read a contiguous run of blocks into a scatter list
+ *
+ * Every iov_len must be a multiple of @block_size.  Blocks that were
+ * never written read back as zeroes.  Returns the number of bytes
+ * read or a negative value on failure.
+ */
+int block_readv(const blkno_t block_num, const struct iovec *iov, const int iovcnt)
+{
+    return block_xfer_iov(0, block_num, iov, iovcnt);
+}
+
+/** Write a contiguous run of blocks from a gather list
+ *
+ * Every iov_len must be a multiple of @block_size.  Returns the
+ * number of bytes written or a negative value on failure.
+ */
+int block_writev(const blkno_t block_num, const struct iovec *iov, const int iovcnt)
+{
+    return block_xfer_iov(1, block_num, iov, iovcnt);
+}
+
+/** Read @count consecutive blocks starting at @block_num into @buf */
+int block_read_blocks(const blkno_t block_num, const int count, void *buf)
+{
+    struct iovec iov = { buf, (size_t) count * block_size };
+
+    return block_readv(block_num, &iov, 1);
+}
+
+/** Write @count consecutive blocks starting at @block_num from @buf */
+int block_write_blocks(const blkno_t block_num, const int count, const void *buf)
+{
+    struct iovec iov = { (void *) buf, (size_t) count * block_size };
+
+    return block_writev(block_num, &iov, 1);
+}
+
+/** Read the blocks listed in @blocks into consecutive slots of @buf
+ *
+ * Runs of physically adjacent block numbers are coalesced into a
+ * single request, and with io_uring all the runs are in flight
+ * together.  Returns the number of bytes read or a negative value on
+ * failure.
+ */
+int block_read_list(const blkno_t *blocks, const int count, void *buf)
+{
+    return block_xfer_buf(0, blocks, count, buf);
+}
+
+/** Write consecutive slots of @buf to the blocks listed in @blocks
+ *
+ * The write-side counterpart of block_read_list().
+ */
+int block_write_list(const blkno_t *blocks, const int count, const void *buf)
+{
+    return block_xfer_buf(1, blocks, count, buf);
+}
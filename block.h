@@ -8,11 +8,76 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
-#define BLOCK_SIZE 512
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
-void disk_open(const char* diskfile_path);
+#define SFS_MIN_BLOCK_SIZE 512
+#define SFS_MAX_BLOCK_SIZE (64 * 1024)
+
+// block numbers are 64 bits wide so images can go well past 2 GiB
+typedef uint64_t blkno_t;
+
+// bytes per block; SFS_MIN_BLOCK_SIZE until the superblock has been read
+extern unsigned int block_size;
+extern unsigned int block_shift;    // log2(block_size)
+
+/** Byte offset of a block in the disk file */
+static inline off_t block_offset(const blkno_t block_num)
+{
+    return (off_t) (block_num << block_shift);
+}
+
+// disk_open() flags
+#define DISK_IO_URING 0x1
+#define DISK_MMAP 0x2
+#define DISK_DIRECT 0x4
+
+void disk_open(const char* diskfile_path, const int flags);
 void disk_close();
-int block_read(const int block_num, void *buf);
-int block_write(const int block_num, const void *buf);
+int block_set_size(const unsigned int size);
+int block_read(const blkno_t block_num, void *buf);
+int block_write(const blkno_t block_num, const void *buf);
+int block_sync();
+int block_flush();
+
+// group commit of durable writes, see block_commit()
+#define BLOCK_COMMIT_WINDOW 500     // default microseconds to gather a group
+
+struct commit_stats {
+    unsigned long long requests;    // block_commit() calls
+    unsigned long long syncs;       // fdatasyncs they took
+};
+
+void block_commit_window(const unsigned int usec);
+int block_commit();
+void block_commit_stats(struct commit_stats *stats);
+
+// direct access to blocks when the disk file is memory-mapped
+int disk_mapped();
+void *block_ptr(const blkno_t block_num);
+void block_dirty(const blkno_t block_num);
+
+// raw access to the disk file for zero-copy transfers
+int block_fd(const blkno_t block_num, const int count, off_t *offset);
+void block_fd_written(const blkno_t block_num, const int count);
+
+// asynchronous readahead, into the block cache or the host page cache
+void block_prefetch(const blkno_t block_num, const int count);
+void block_advise(const blkno_t block_num, const int count);
+
+// multi-block I/O; each call costs one preadv/pwritev per contiguous run
+int block_readv(const blkno_t block_num, const struct iovec *iov, const int iovcnt);
+int block_writev(const blkno_t block_num, const struct iovec *iov, const int iovcnt);
+int block_read_blocks(const blkno_t block_num, const int count, void *buf);
+int block_write_blocks(const blkno_t block_num, const int count, const void *buf);
+int block_read_list(const blkno_t *blocks, const int count, void *buf);
+int block_write_list(const blkno_t *blocks, const int count, const void *buf);
+
+// uncached access to the disk file, used by the block cache
+int disk_read(const blkno_t block_num, void *buf);
+int disk_write(const blkno_t block_num, const void *buf);
+int disk_read_blocks(const blkno_t block_num, const int count, void *buf);
+int disk_zero(const blkno_t block_num, const uint64_t count);
 
 #endif
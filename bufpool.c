@@ -0,0 +1,100 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Pool of page-aligned buffers for the O_DIRECT backend.  Everything
+  is allocated once at mount time; when the pool runs dry a one-off
+  aligned buffer is allocated instead of waiting.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "bufpool.h"
+
+static void **pool_free = NULL;     // stack of buffers not in use
+static int pool_nfree = 0;
+static int pool_count = 0;
+static size_t pool_size = 0;
+static char *pool_mem = NULL;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Allocate @count buffers of @size bytes, aligned to BUFPOOL_ALIGN
+ *
+ * Returns 0 or -ENOMEM.
+ */
+int bufpool_init(const int count, const size_t size)
+{
+    int i;
+
+    if (pool_mem != NULL)
+	return 0;
+
+    pool_free = malloc(count * sizeof(void *));
+    if (pool_free == NULL)
+	return -ENOMEM;
+    if (posix_memalign((void **) &pool_mem, BUFPOOL_ALIGN, count * size) != 0) {
+	free(pool_free);
+	pool_free = NULL;
+	pool_mem = NULL;
+	return -ENOMEM;
+    }
+
+    for (i = 0; i < count; i++)
+	pool_free[i] = pool_mem + i * size;
+    pool_nfree = count;
+    pool_count = count;
+    pool_size = size;
+
+    return 0;
+}
+
+void bufpool_exit()
+{
+    free(pool_mem);
+    free(pool_free);
+    pool_mem = NULL;
+    pool_free = NULL;
+    pool_nfree = 0;
+    pool_count = 0;
+}
+
+/** Take a buffer of bufpool_buf_size() bytes out of the pool
+ *
+ * Returns NULL only if the pool is empty and a fresh aligned buffer
+ * cannot be allocated either.
+ */
+void *bufpool_get()
+{
+    void *buf = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    if (pool_nfree > 0)
+	buf = pool_free[--pool_nfree];
+    pthread_mutex_unlock(&pool_lock);
+
+    if (buf == NULL && posix_memalign(&buf, BUFPOOL_ALIGN, bufpool_buf_size()) != 0)
+	return NULL;
+
+    return buf;
+}
+
+/** Hand a buffer from bufpool_get() back */
+void bufpool_put(void *buf)
+{
+    if ((char *) buf >= pool_mem && (char *) buf < pool_mem + pool_count * pool_size) {
+	pthread_mutex_lock(&pool_lock);
+	pool_free[pool_nfree++] = buf;
+	pthread_mutex_unlock(&pool_lock);
+    } else {
+	free(buf);
+    }
+}
+
+size_t bufpool_buf_size()
+{
+    return pool_size ? pool_size : BUFPOOL_BUF_SIZE;
+}
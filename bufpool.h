@@ -0,0 +1,24 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _BUFPOOL_H_
+#define _BUFPOOL_H_
+
+#include <stddef.h>
+
+// number and size of the buffers set aside for O_DIRECT bounce copies
+#define BUFPOOL_COUNT 16
+#define BUFPOOL_BUF_SIZE (256 * 1024)
+#define BUFPOOL_ALIGN 4096
+
+int bufpool_init(const int count, const size_t size);
+void bufpool_exit();
+void *bufpool_get();
+void bufpool_put(void *buf);
+size_t bufpool_buf_size();
+
+#endif
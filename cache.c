@@ -0,0 +1,763 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Write-back block cache sitting between block_read()/block_write()
+  and the disk file.  Frames are replaced with the CLOCK algorithm
+  and dirty frames only reach the disk on eviction or cache_flush().
+
+  Metadata blocks written with cache_write_meta() belong to the
+  running journal transaction and are pinned: they are neither
+  evicted nor written back until journal.c has logged them, synced
+  the log and called cache_meta_commit().  In between, once logged,
+  a block can already join the next transaction.
+
+  Readers sharing the file system lock come through here at the same
+  time, so the frames are split into shards by block number, each
+  with its own lock, hash table, clock hand and counters.  A block
+  always lives in the same shard; a miss or an eviction only holds up
+  lookups in that one.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "block.h"
+#include "bufpool.h"
+#include "cache.h"
+
+#define CACHE_MIN_FRAMES 16
+#define CACHE_MAX_SHARDS 16     // power of two
+#define CACHE_EMPTY ((blkno_t) -1)
+
+// journal state of a frame
+#define CACHE_META_NONE 0
+#define CACHE_META_RUNNING 1    // in the running transaction, pinned
+#define CACHE_META_COMMITTED 2  // logged, may go home any time
+#define CACHE_META_LOGGED 3     // logged but not synced yet, still pinned
+
+struct cache_frame {
+    blkno_t block_num;  // CACHE_EMPTY when the frame holds nothing
+    int next;           // next frame in the same hash bucket, -1 ends the chain
+    int len;            // what disk_read() returned when the block came in
+    unsigned char ref;  // CLOCK reference bit
+    unsigned char dirty;
+    unsigned char meta; // CACHE_META_*
+    time_t dirtied;     // when the frame last went from clean to dirty
+    char *data;
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache_frame *frames;
+    int *buckets;
+    unsigned int nframes;
+    unsigned int nbuckets;
+    unsigned int hand;
+    struct cache_stats stats;   // nframes is left 0, the total is kept below
+};
+
+static struct cache_shard shards[CACHE_MAX_SHARDS];
+static struct cache_frame *frames = NULL;
+static char *slab = NULL;
+static int *buckets = NULL;
+static unsigned int nframes = 0;
+static unsigned int nshards = 0;
+
+static uint64_t cache_mix(const blkno_t block_num)
+{
+    return block_num * 0x9e3779b97f4a7c15ULL;
+}
+
+/** The shard that holds @block_num, locked */
+static struct cache_shard *cache_shard_lock(const blkno_t block_num)
+{
+    // the top bits pick the shard, cache_hash() uses the ones below
+    struct cache_shard *sh = &shards[cache_mix(block_num) >> 60 & (nshards - 1)];
+
+    pthread_mutex_lock(&sh->lock);
+    return sh;
+}
+
+static void cache_shard_unlock(struct cache_shard *sh)
+{
+    pthread_mutex_unlock(&sh->lock);
+}
+
+static unsigned int cache_hash(const struct cache_shard *sh,
+			       const blkno_t block_num)
+{
+    return (unsigned int) (cache_mix(block_num) >> 32) & (sh->nbuckets - 1);
+}
+
+static int cache_lookup(const struct cache_shard *sh, const blkno_t block_num)
+{
+    int i;
+
+    for (i = sh->buckets[cache_hash(sh, block_num)]; i >= 0; i = sh->frames[i].next)
+	if (sh->frames[i].block_num == block_num)
+	    return i;
+
+    return -1;
+}
+
+/** Is the frame held for the journal, so it must not go home? */
+static int cache_pinned(const struct cache_frame *f)
+{
+    return f->meta == CACHE_META_RUNNING || f->meta == CACHE_META_LOGGED;
+}
+
+/** Move frame @f of @sh to journal state @meta, counting the pinned */
+static void cache_set_meta(struct cache_shard *sh, struct cache_frame *f,
+			   const unsigned char meta)
+{
+    if (cache_pinned(f))
+	sh->stats.npinned--;
+    f->meta = meta;
+    if (cache_pinned(f))
+	sh->stats.npinned++;
+}
+
+static void cache_unhash(struct cache_shard *sh, const int idx)
+{
+    struct cache_frame *f = sh->frames;
+    int *link = &sh->buckets[cache_hash(sh, f[idx].block_num)];
+
+    while (*link != idx)
+	link = &f[*link].next;
+    *link = f[idx].next;
+    f[idx].block_num = CACHE_EMPTY;
+    f[idx].next = -1;
+    cache_set_meta(sh, &f[idx], CACHE_META_NONE);
+}
+
+static void cache_hash_in(struct cache_shard *sh, const int idx,
+			  const blkno_t block_num)
+{
+    unsigned int h = cache_hash(sh, block_num);
+
+    sh->frames[idx].block_num = block_num;
+    sh->frames[idx].next = sh->buckets[h];
+    sh->buckets[h] = idx;
+}
+
+/** Write a dirty frame of @sh back to its home block */
+static int cache_frame_clean(struct cache_shard *sh, struct cache_frame *f)
+{
+    if (disk_write(f->block_num, f->data) < 0)
+	return -EIO;
+    f->dirty = 0;
+    cache_set_meta(sh, f, CACHE_META_NONE);
+    sh->stats.writebacks++;
+    sh->stats.ndirty--;
+
+    return 0;
+}
+
+/** Pick a frame of @sh to reuse with CLOCK, writing it back if dirty
+ *
+ * Returns the frame index, or -1 if a dirty victim could not be
+ * written back or every frame is pinned for the journal.
+ */
+static int cache_victim(struct cache_shard *sh)
+{
+    struct cache_frame *f;
+    unsigned int scanned;
+    int idx;
+
+    // two sweeps clear every reference bit on the way
+    for (scanned = 0; scanned < 2 * sh->nframes; scanned++) {
+	idx = sh->hand;
+	f = &sh->frames[idx];
+	sh->hand = (sh->hand + 1) % sh->nframes;
+
+	if (f->block_num == CACHE_EMPTY)
+	    return idx;
+	if (cache_pinned(f))
+	    continue;
+	if (f->ref) {
+	    f->ref = 0;
+	    continue;
+	}
+	if (f->dirty && cache_frame_clean(sh, f) < 0)
+	    return -1;
+	cache_unhash(sh, idx);
+	sh->stats.evictions++;
+	return idx;
+    }
+
+    return -1;
+}
+
+/** Set up the cache with room for roughly @mem_budget bytes of blocks
+ *
+ * A budget of 0 leaves the cache disabled.  Returns 0 on success or
+ * -ENOMEM.
+ */
+int cache_init(size_t mem_budget)
+{
+    struct cache_shard *sh;
+    unsigned int i, j, per, first = 0;
+
+    if (frames != NULL || mem_budget == 0)
+	return 0;
+
+    nframes = mem_budget / block_size;
+    if (nframes < CACHE_MIN_FRAMES)
+	nframes = CACHE_MIN_FRAMES;
+    // no shard smaller than a whole small cache
+    for (nshards = CACHE_MAX_SHARDS; nshards > 1; nshards >>= 1)
+	if (nframes / nshards >= CACHE_MIN_FRAMES)
+	    break;
+    per = nframes / nshards;
+    nframes = per * nshards;
+
+    frames = calloc(nframes, sizeof(struct cache_frame));
+    // aligned so that frames can go to an O_DIRECT disk file without a bounce
+    if (posix_memalign((void **) &slab, BUFPOOL_ALIGN, (size_t) nframes * block_size) != 0)
+	slab = NULL;
+    for (j = 1; j < per; j <<= 1)
+	;
+    buckets = malloc((size_t) nshards * j * sizeof(int));
+    if (frames == NULL || slab == NULL || buckets == NULL) {
+	free(frames);
+	free(slab);
+	free(buckets);
+	frames = NULL;
+	slab = NULL;
+	buckets = NULL;
+	return -ENOMEM;
+    }
+
+    for (i = 0; i < nframes; i++) {
+	frames[i].block_num = CACHE_EMPTY;
+	frames[i].next = -1;
+	frames[i].data = slab + (size_t) i * block_size;
+    }
+
+    for (i = 0; i < nshards; i++) {
+	sh = &shards[i];
+	pthread_mutex_init(&sh->lock, NULL);
+	sh->frames = frames + first;
+	sh->nframes = per;
+	sh->nbuckets = j;
+	sh->buckets = buckets + (size_t) i * j;
+	sh->hand = 0;
+	memset(&sh->stats, 0, sizeof(sh->stats));
+	first += per;
+    }
+    for (i = 0; i < nshards * j; i++)
+	buckets[i] = -1;
+
+    return 0;
+}
+
+/** Write back everything that is dirty and release the cache */
+void cache_destroy()
+{
+    unsigned int i;
+
+    if (frames == NULL)
+	return;
+
+    cache_flush();
+    for (i = 0; i < nshards; i++)
+	pthread_mutex_destroy(&shards[i].lock);
+    free(frames);
+    free(slab);
+    free(buckets);
+    frames = NULL;
+    slab = NULL;
+    buckets = NULL;
+    nframes = 0;
+    nshards = 0;
+}
+
+int cache_enabled()
+{
+    return frames != NULL;
+}
+
+/** Read a block through the cache
+ *
+ * Same contract as block_read().
+ */
+int cache_read(const blkno_t block_num, void *buf)
+{
+    struct cache_shard *sh = cache_shard_lock(block_num);
+    struct cache_frame *f;
+    int idx;
+    int retstat;
+
+    idx = cache_lookup(sh, block_num);
+    if (idx >= 0) {
+	f = &sh->frames[idx];
+	f->ref = 1;
+	sh->stats.hits++;
+	memcpy(buf, f->data, block_size);
+	retstat = f->len;
+	goto out;
+    }
+
+    sh->stats.misses++;
+    idx = cache_victim(sh);
+    if (idx < 0) {
+	retstat = disk_read(block_num, buf);
+	goto out;
+    }
+
+    f = &sh->frames[idx];
+    retstat = disk_read(block_num, f->data);
+    if (retstat < 0) {
+	memset(buf, 0, block_size);
+	goto out;
+    }
+
+    f->len = retstat;
+    f->ref = 1;
+    f->dirty = 0;
+    cache_hash_in(sh, idx, block_num);
+    memcpy(buf, f->data, block_size);
+
+out:
+    cache_shard_unlock(sh);
+    return retstat;
+}
+
+/** Write a block into the cache, deferring the disk write
+ *
+ * Same contract as block_write().
+ */
+int cache_write(const blkno_t block_num, const void *buf)
+{
+    struct cache_shard *sh = cache_shard_lock(block_num);
+    struct cache_frame *f;
+    int idx;
+    int retstat;
+
+    idx = cache_lookup(sh, block_num);
+    if (idx >= 0) {
+	sh->stats.hits++;
+    } else {
+	sh->stats.misses++;
+	idx = cache_victim(sh);
+	if (idx < 0) {
+	    retstat = disk_write(block_num, buf);
+	    cache_shard_unlock(sh);
+	    return retstat;
+	}
+	cache_hash_in(sh, idx, block_num);
+	sh->frames[idx].dirty = 0;
+    }
+
+    f = &sh->frames[idx];
+    memcpy(f->data, buf, block_size);
+    f->len = block_size;
+    f->ref = 1;
+    // a journaled block only takes data once it has been freed
+    cache_set_meta(sh, f, CACHE_META_NONE);
+    if (!f->dirty) {
+	f->dirty = 1;
+	f->dirtied = time(NULL);
+	sh->stats.ndirty++;
+    }
+    cache_shard_unlock(sh);
+
+    return block_size;
+}
+
+/** Write a metadata block into the running journal transaction
+ *
+ * Like cache_write(), but the frame stays pinned until
+ * cache_meta_commit().  If it still holds a logged copy that has not
+ * gone home yet, that copy is written back first: the journal may
+ * drop it at the next checkpoint.  Returns 1 if the block joined the
+ * transaction, 0 if it was in it already, or -errno.
+ */
+int cache_write_meta(const blkno_t block_num, const void *buf)
+{
+    struct cache_shard *sh = cache_shard_lock(block_num);
+    struct cache_frame *f;
+    int idx, joined;
+
+    idx = cache_lookup(sh, block_num);
+    if (idx >= 0) {
+	sh->stats.hits++;
+	f = &sh->frames[idx];
+	if (f->meta == CACHE_META_COMMITTED && f->dirty
+	    && cache_frame_clean(sh, f) < 0) {
+	    cache_shard_unlock(sh);
+	    return -EIO;
+	}
+    } else {
+	sh->stats.misses++;
+	idx = cache_victim(sh);
+	if (idx < 0) {
+	    cache_shard_unlock(sh);
+	    return -ENOMEM;
+	}
+	cache_hash_in(sh, idx, block_num);
+	sh->frames[idx].dirty = 0;
+    }
+
+    f = &sh->frames[idx];
+    memcpy(f->data, buf, block_size);
+    f->len = block_size;
+    f->ref = 1;
+    if (!f->dirty) {
+	f->dirty = 1;
+	f->dirtied = time(NULL);
+	sh->stats.ndirty++;
+    }
+    joined = f->meta != CACHE_META_RUNNING;
+    cache_set_meta(sh, f, CACHE_META_RUNNING);
+    cache_shard_unlock(sh);
+
+    return joined;
+}
+
+/** Copy out a block of the running transaction for logging
+ *
+ * Returns 0, or -1 if the block is no longer part of it (it was
+ * dropped from the cache or overwritten with data after a free).
+ */
+int cache_meta_copy(const blkno_t block_num, void *buf)
+{
+    struct cache_shard *sh;
+    int idx, retstat = -1;
+
+    if (frames == NULL)
+	return -1;
+
+    sh = cache_shard_lock(block_num);
+    idx = cache_lookup(sh, block_num);
+    if (idx >= 0 && sh->frames[idx].meta == CACHE_META_RUNNING) {
+	memcpy(buf, sh->frames[idx].data, block_size);
+	retstat = 0;
+    }
+    cache_shard_unlock(sh);
+
+    return retstat;
+}
+
+/** Note that a block of the running transaction has been written to
+ *  the journal; it stays pinned until the journal is synced
+ */
+void cache_meta_logged(const blkno_t block_num)
+{
+    struct cache_shard *sh;
+    int idx;
+
+    if (frames == NULL)
+	return;
+
+    sh = cache_shard_lock(block_num);
+    idx = cache_lookup(sh, block_num);
+    if (idx >= 0 && sh->frames[idx].meta == CACHE_META_RUNNING)
+	cache_set_meta(sh, &sh->frames[idx], CACHE_META_LOGGED);
+    cache_shard_unlock(sh);
+}
+
+/** Unpin a logged block once its transaction is safely in the journal
+ *
+ * A block that has joined a newer transaction since stays pinned.
+ */
+void cache_meta_commit(const blkno_t block_num)
+{
+    struct cache_shard *sh;
+    int idx;
+
+    if (frames == NULL)
+	return;
+
+    sh = cache_shard_lock(block_num);
+    idx = cache_lookup(sh, block_num);
+    if (idx >= 0 && sh->frames[idx].meta == CACHE_META_LOGGED)
+	cache_set_meta(sh, &sh->frames[idx], CACHE_META_COMMITTED);
+    cache_shard_unlock(sh);
+}
+
+/** Copy out a cached block without touching the disk on a miss
+ *
+ * @buf may be NULL to only test for presence.  Returns the cached
+ * length, or -1 if the block is not cached.  Used by the multi-block
+ * paths, which do their own disk I/O for the misses.
+ */
+int cache_peek(const blkno_t block_num, void *buf)
+{
+    struct cache_shard *sh;
+    int idx, retstat = -1;
+
+    if (frames == NULL)
+	return -1;
+
+    sh = cache_shard_lock(block_num);
+    idx = cache_lookup(sh, block_num);
+    if (idx >= 0) {
+	if (buf != NULL) {
+	    sh->frames[idx].ref = 1;
+	    sh->stats.hits++;
+	    memcpy(buf, sh->frames[idx].data, block_size);
+	}
+	retstat = sh->frames[idx].len;
+    }
+    cache_shard_unlock(sh);
+
+    return retstat;
+}
+
+/** Refresh a cached copy after the block was written straight to disk
+ *
+ * The frame ends up clean.  Blocks that are not cached are left alone.
+ */
+void cache_update(const blkno_t block_num, const void *buf)
+{
+    struct cache_shard *sh;
+    struct cache_frame *f;
+    int idx;
+
+    if (frames == NULL)
+	return;
+
+    sh = cache_shard_lock(block_num);
+    idx = cache_lookup(sh, block_num);
+    if (idx >= 0) {
+	f = &sh->frames[idx];
+	memcpy(f->data, buf, block_size);
+	f->len = block_size;
+	cache_set_meta(sh, f, CACHE_META_NONE);
+	if (f->dirty) {
+	    f->dirty = 0;
+	    sh->stats.ndirty--;
+	}
+    }
+    cache_shard_unlock(sh);
+}
+
+/** Install a block that was read ahead of time
+ *
+ * The block comes in clean and only if it is not cached already,
+ * since a cached copy may be newer than the disk.  Returns 1 if the
+ * block was installed, 0 if not.
+ */
+int cache_fill(const blkno_t block_num, const void *buf)
+{
+    struct cache_shard *sh;
+    struct cache_frame *f;
+    int idx;
+
+    if (frames == NULL)
+	return 0;
+
+    sh = cache_shard_lock(block_num);
+    if (cache_lookup(sh, block_num) >= 0 || (idx = cache_victim(sh)) < 0) {
+	cache_shard_unlock(sh);
+	return 0;
+    }
+
+    f = &sh->frames[idx];
+    memcpy(f->data, buf, block_size);
+    f->len = block_size;
+    f->ref = 1;
+    f->dirty = 0;
+    cache_hash_in(sh, idx, block_num);
+    cache_shard_unlock(sh);
+
+    return 1;
+}
+
+/** Write back dirty frames for blocks [@block_num, @block_num + @count)
+ *
+ * Afterwards the disk file holds the latest contents of the range,
+ * so it can be read from directly.  Returns 0 or -errno; -EBUSY if
+ * part of the range is pinned for the journal.
+ */
+int cache_writeback(const blkno_t block_num, const int count)
+{
+    struct cache_shard *sh;
+    struct cache_frame *f;
+    int i, idx, retstat = 0;
+
+    if (frames == NULL)
+	return 0;
+
+    for (i = 0; i < count && retstat == 0; i++) {
+	sh = cache_shard_lock(block_num + i);
+	idx = cache_lookup(sh, block_num + i);
+	if (idx >= 0 && sh->frames[idx].dirty) {
+	    f = &sh->frames[idx];
+	    if (cache_pinned(f))
+		retstat = -EBUSY;
+	    else if (cache_frame_clean(sh, f) < 0)
+		retstat = -EIO;
+	}
+	cache_shard_unlock(sh);
+    }
+
+    return retstat;
+}
+
+/** Drop frames for blocks [@block_num, @block_num + @count) that were
+ * overwritten on disk behind the cache's back
+ */
+void cache_invalidate(const blkno_t block_num, const int count)
+{
+    struct cache_shard *sh;
+    int i, idx;
+
+    if (frames == NULL)
+	return;
+
+    for (i = 0; i < count; i++) {
+	sh = cache_shard_lock(block_num + i);
+	idx = cache_lookup(sh, block_num + i);
+	if (idx >= 0) {
+	    if (sh->frames[idx].dirty) {
+		sh->frames[idx].dirty = 0;
+		sh->stats.ndirty--;
+	    }
+	    cache_unhash(sh, idx);
+	}
+	cache_shard_unlock(sh);
+    }
+}
+
+// a dirty frame as cache_clean() found it
+struct cache_dirty {
+    blkno_t block_num;
+    int idx;
+};
+
+static int cache_cmp_block(const void *a, const void *b)
+{
+    blkno_t x = ((const struct cache_dirty *) a)->block_num;
+    blkno_t y = ((const struct cache_dirty *) b)->block_num;
+
+    return (x > y) - (x < y);
+}
+
+/** Shard that frame @idx of the whole array belongs to */
+static struct cache_shard *cache_shard_of(const int idx)
+{
+    return &shards[idx / shards[0].nframes];
+}
+
+/** Write back some of the dirty frames, in block order
+ *
+ * Frames dirtied at or before @expire are written first; then more
+ * until no more than @target frames are dirty.  At most @max frames
+ * are written, and none of the running transaction's.  The dirty
+ * frames are listed one shard at a time and sorted; each is then
+ * written holding only its own shard, and skipped if it was cleaned,
+ * pinned or reused in the meantime.  Returns the number written or
+ * the first error from disk_write().
+ */
+int cache_clean(const unsigned int target, const time_t expire,
+		const unsigned int max)
+{
+    struct cache_shard *sh;
+    struct cache_frame *f;
+    struct cache_dirty *dirty;
+    unsigned int i, j, n = 0, done = 0, ndirty = 0;
+    int pass;
+    int retstat = 0;
+
+    if (frames == NULL)
+	return 0;
+
+    for (i = 0; i < nshards; i++) {
+	pthread_mutex_lock(&shards[i].lock);
+	ndirty += shards[i].stats.ndirty - shards[i].stats.npinned;
+	pthread_mutex_unlock(&shards[i].lock);
+    }
+    if (ndirty == 0)
+	return 0;
+
+    dirty = malloc(ndirty * sizeof(*dirty));
+    if (dirty == NULL)
+	return -ENOMEM;
+    // frames dirtied since the count above wait for the next call
+    for (i = 0; i < nshards; i++) {
+	sh = &shards[i];
+	pthread_mutex_lock(&sh->lock);
+	for (j = 0; j < sh->nframes && n < ndirty; j++) {
+	    f = &sh->frames[j];
+	    if (f->block_num != CACHE_EMPTY && f->dirty && !cache_pinned(f)) {
+		dirty[n].block_num = f->block_num;
+		dirty[n].idx = f - frames;
+		n++;
+	    }
+	}
+	pthread_mutex_unlock(&sh->lock);
+    }
+    qsort(dirty, n, sizeof(*dirty), cache_cmp_block);
+
+    for (pass = 0; pass < 2; pass++) {
+	for (i = 0; i < n && done < max; i++) {
+	    if (pass == 1 && ndirty <= target)
+		break;
+
+	    f = &frames[dirty[i].idx];
+	    sh = cache_shard_of(dirty[i].idx);
+	    pthread_mutex_lock(&sh->lock);
+	    if (f->block_num != dirty[i].block_num || !f->dirty || cache_pinned(f)
+		|| (pass == 0 && f->dirtied > expire)) {
+		pthread_mutex_unlock(&sh->lock);
+		continue;
+	    }
+	    if (cache_frame_clean(sh, f) < 0) {
+		pthread_mutex_unlock(&sh->lock);
+		if (retstat == 0)
+		    retstat = -EIO;
+		continue;
+	    }
+	    pthread_mutex_unlock(&sh->lock);
+	    ndirty--;
+	    done++;
+	}
+    }
+    free(dirty);
+
+    return retstat < 0 ? retstat : (int) done;
+}
+
+/** Write every dirty frame back to the disk file in block order,
+ *  except those pinned for the journal
+ *
+ * Returns 0 on success or the first error from disk_write().
+ */
+int cache_flush()
+{
+    int retstat;
+
+    retstat = cache_clean(0, 0, UINT_MAX);
+    return retstat < 0 ? retstat : 0;
+}
+
+/** Counters summed over the shards */
+void cache_get_stats(struct cache_stats *out)
+{
+    struct cache_shard *sh;
+    unsigned int i;
+
+    memset(out, 0, sizeof(*out));
+    for (i = 0; i < nshards; i++) {
+	sh = &shards[i];
+	pthread_mutex_lock(&sh->lock);
+	out->hits += sh->stats.hits;
+	out->misses += sh->stats.misses;
+	out->evictions += sh->stats.evictions;
+	out->writebacks += sh->stats.writebacks;
+	out->ndirty += sh->stats.ndirty;
+	out->npinned += sh->stats.npinned;
+	pthread_mutex_unlock(&sh->lock);
+    }
+    out->nframes = nframes;
+}
@@ -0,0 +1,46 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stddef.h>
+#include <time.h>
+
+// default memory budget for cached block data, in bytes
+#define CACHE_DEFAULT_SIZE (8 * 1024 * 1024)
+
+struct cache_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long writebacks;
+    unsigned int nframes;
+    unsigned int ndirty;
+    unsigned int npinned;   // of those, held for the journal until it commits
+};
+
+int cache_init(size_t mem_budget);
+void cache_destroy();
+int cache_enabled();
+int cache_read(const blkno_t block_num, void *buf);
+int cache_write(const blkno_t block_num, const void *buf);
+int cache_peek(const blkno_t block_num, void *buf);
+int cache_write_meta(const blkno_t block_num, const void *buf);
+int cache_meta_copy(const blkno_t block_num, void *buf);
+void cache_meta_logged(const blkno_t block_num);
+void cache_meta_commit(const blkno_t block_num);
+void cache_update(const blkno_t block_num, const void *buf);
+int cache_fill(const blkno_t block_num, const void *buf);
+int cache_writeback(const blkno_t block_num, const int count);
+void cache_invalidate(const blkno_t block_num, const int count);
+int cache_clean(const unsigned int target, const time_t expire,
+		const unsigned int max);
+int cache_flush();
+void cache_get_stats(struct cache_stats *stats);
+
+#endif
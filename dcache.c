@@ -0,0 +1,239 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Dentry cache: maps absolute paths, and every directory prefix of
+  them that path_lookup() walks through, to inode numbers.  An inode
+  number of 0 records that the path does not exist.
+
+  Paths are the keys, so an entry only goes stale when that exact path
+  is created or removed.  There is no rename or link, so create,
+  mkdir, unlink and rmdir are the only places that update it, and they
+  overwrite the one entry for the path they change.  (A directory must
+  be empty to be removed, so nothing below it can still be cached as
+  present.)  Entries are replaced with CLOCK, as in cache.c.
+
+  Lookups sharing the file system lock add entries too, so every
+  entry point takes dcache_lock.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+
+#define DCACHE_MIN_ENTRIES 64
+
+struct dentry {
+    char *path;         // NULL when the slot is free
+    size_t len;
+    uint64_t hash;
+    uint32_t ino;       // 0 for a negative entry
+    int next;           // next slot in the same hash bucket, -1 ends the chain
+    unsigned char ref;  // CLOCK reference bit
+};
+
+static struct dentry *dentries = NULL;
+static int *buckets = NULL;
+static unsigned int nentries = 0;
+static unsigned int nbuckets = 0;
+static unsigned int hand = 0;
+static struct dcache_stats stats;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** FNV-1a */
+static uint64_t dcache_hash(const char *path, const size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	h ^= (unsigned char) path[i];
+	h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static int dcache_find(const char *path, const size_t len, const uint64_t hash)
+{
+    struct dentry *d;
+    int i;
+
+    for (i = buckets[hash & (nbuckets - 1)]; i >= 0; i = d->next) {
+	d = &dentries[i];
+	if (d->hash == hash && d->len == len && memcmp(d->path, path, len) == 0)
+	    return i;
+    }
+
+    return -1;
+}
+
+static void dcache_unhash(const int idx)
+{
+    int *link = &buckets[dentries[idx].hash & (nbuckets - 1)];
+
+    while (*link != idx)
+	link = &dentries[*link].next;
+    *link = dentries[idx].next;
+
+    free(dentries[idx].path);
+    dentries[idx].path = NULL;
+    dentries[idx].next = -1;
+}
+
+static int dcache_victim()
+{
+    struct dentry *d;
+    int idx;
+
+    for (;;) {
+	idx = hand;
+	d = &dentries[idx];
+	hand = (hand + 1) % nentries;
+
+	if (d->path == NULL)
+	    return idx;
+	if (d->ref) {
+	    d->ref = 0;
+	    continue;
+	}
+	dcache_unhash(idx);
+	stats.evictions++;
+	return idx;
+    }
+}
+
+/** Set up room for @n paths; 0 leaves the cache disabled */
+int dcache_init(unsigned int n)
+{
+    unsigned int i;
+
+    if (dentries != NULL || n == 0)
+	return 0;
+
+    nentries = n < DCACHE_MIN_ENTRIES ? DCACHE_MIN_ENTRIES : n;
+    for (nbuckets = 1; nbuckets < nentries; nbuckets <<= 1)
+	;
+
+    dentries = calloc(nentries, sizeof(struct dentry));
+    buckets = malloc(nbuckets * sizeof(int));
+    if (dentries == NULL || buckets == NULL) {
+	free(dentries);
+	free(buckets);
+	dentries = NULL;
+	buckets = NULL;
+	return -ENOMEM;
+    }
+
+    for (i = 0; i < nentries; i++)
+	dentries[i].next = -1;
+    for (i = 0; i < nbuckets; i++)
+	buckets[i] = -1;
+
+    hand = 0;
+    memset(&stats, 0, sizeof(stats));
+    stats.nentries = nentries;
+
+    return 0;
+}
+
+void dcache_destroy()
+{
+    unsigned int i;
+
+    if (dentries == NULL)
+	return;
+
+    for (i = 0; i < nentries; i++)
+	free(dentries[i].path);
+    free(dentries);
+    free(buckets);
+    dentries = NULL;
+    buckets = NULL;
+    nentries = 0;
+}
+
+/** Look up the first @len bytes of @path
+ *
+ * Returns 1 with *@ino set (0 if the path is known not to exist), or
+ * 0 if the path is not cached.
+ */
+int dcache_lookup(const char *path, const size_t len, uint32_t *ino)
+{
+    uint64_t hash;
+    int idx;
+
+    if (dentries == NULL)
+	return 0;
+
+    hash = dcache_hash(path, len);
+    pthread_mutex_lock(&dcache_lock);
+    idx = dcache_find(path, len, hash);
+    if (idx < 0) {
+	stats.misses++;
+	pthread_mutex_unlock(&dcache_lock);
+	return 0;
+    }
+
+    dentries[idx].ref = 1;
+    *ino = dentries[idx].ino;
+    if (*ino == 0)
+	stats.negative_hits++;
+    else
+	stats.hits++;
+    pthread_mutex_unlock(&dcache_lock);
+
+    return 1;
+}
+
+/** Record that the first @len bytes of @path name inode @ino, or
+ * nothing when @ino is 0
+ */
+void dcache_add(const char *path, const size_t len, const uint32_t ino)
+{
+    uint64_t hash;
+    char *copy;
+    int idx;
+
+    if (dentries == NULL)
+	return;
+
+    hash = dcache_hash(path, len);
+    pthread_mutex_lock(&dcache_lock);
+    idx = dcache_find(path, len, hash);
+    if (idx >= 0) {
+	dentries[idx].ino = ino;
+	dentries[idx].ref = 1;
+	pthread_mutex_unlock(&dcache_lock);
+	return;
+    }
+
+    copy = malloc(len);
+    if (copy == NULL) {
+	pthread_mutex_unlock(&dcache_lock);
+	return;
+    }
+    memcpy(copy, path, len);
+
+    idx = dcache_victim();
+    dentries[idx].path = copy;
+    dentries[idx].len = len;
+    dentries[idx].hash = hash;
+    dentries[idx].ino = ino;
+    dentries[idx].ref = 1;
+    dentries[idx].next = buckets[hash & (nbuckets - 1)];
+    buckets[hash & (nbuckets - 1)] = idx;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+void dcache_get_stats(struct dcache_stats *s)
+{
+    pthread_mutex_lock(&dcache_lock);
+    *s = stats;
+    pthread_mutex_unlock(&dcache_lock);
+}
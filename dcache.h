@@ -0,0 +1,31 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _DCACHE_H_
+#define _DCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// default number of cached paths, positive and negative
+#define DCACHE_DEFAULT_ENTRIES 65536
+
+struct dcache_stats {
+    unsigned long long hits;
+    unsigned long long negative_hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned int nentries;
+};
+
+int dcache_init(unsigned int nentries);
+void dcache_destroy();
+int dcache_lookup(const char *path, const size_t len, uint32_t *ino);
+void dcache_add(const char *path, const size_t len, const uint32_t ino);
+void dcache_get_stats(struct dcache_stats *stats);
+
+#endif
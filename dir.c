@@ -0,0 +1,585 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Directories are linear hash tables keyed by a hash of the entry
+  name, so lookups, inserts and removals touch one bucket no matter
+  how big the directory is.
+
+  Logical block 0 holds the table header and bucket b lives in
+  logical block 1 + b.  Each bucket is a chain of blocks of dirent
+  slots; a bucket that fills up before its turn to split borrows
+  overflow blocks, which sit far past the buckets (from
+  DIR_OVERFLOW_BASE on) so the table can keep growing in place.
+  Whenever the table gets more than 3/4 full, the bucket at the split
+  pointer is rehashed into itself and one new bucket.  Directories
+  never shrink; emptied overflow blocks go on a free list in the
+  header.  "." and ".." are not stored.
+
+  A bucket that was never written is a hole and reads back as an
+  empty block, which is also a valid empty bucket.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "block.h"
+#include "dcache.h"
+#include "dir.h"
+#include "file.h"
+#include "inode.h"
+#include "super.h"
+
+#define DIR_OVERFLOW_BASE (1ULL << 32)
+#define DIR_BUCKET(b) (1 + (b))
+
+// the on-disk layout depends on this
+typedef char sfs_dirent_size_check[sizeof(struct sfs_dirent) == SFS_DIRENT_SIZE ? 1 : -1];
+
+/** A directory being worked on, with its header block in memory */
+struct dir_ctx {
+    struct sfs_inode *dir;
+    struct sfs_dir_header *hdr;     // points into hbuf
+    char *hbuf;
+    char *buf;                      // one bucket or overflow block
+};
+
+/** FNV-1a */
+static uint64_t dir_hash(const char *name, const size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+	h ^= (unsigned char) name[i];
+	h *= 0x100000001b3ULL;
+    }
+
+    return h;
+}
+
+static unsigned int dir_slots()
+{
+    return (block_size - sizeof(struct sfs_dir_block)) / SFS_DIRENT_SIZE;
+}
+
+static struct sfs_dirent *dir_slot(char *blk, const unsigned int i)
+{
+    return (struct sfs_dirent *) (blk + sizeof(struct sfs_dir_block)
+				  + i * SFS_DIRENT_SIZE);
+}
+
+static uint64_t dir_nbuckets(const struct sfs_dir_header *hdr)
+{
+    return (1ULL << hdr->level) + hdr->split;
+}
+
+static uint64_t dir_bucket(const struct sfs_dir_header *hdr, const uint64_t hash)
+{
+    uint64_t b = hash & ((1ULL << hdr->level) - 1);
+
+    if (b < hdr->split)
+	b = hash & ((1ULL << (hdr->level + 1)) - 1);
+
+    return b;
+}
+
+static int dirent_match(const struct sfs_dirent *de, const char *name,
+			const size_t len)
+{
+    return de->ino != 0 && de->name_len == len && memcmp(de->name, name, len) == 0;
+}
+
+/** Load the header of @dir; an empty directory gets a blank one */
+static int dir_open(struct dir_ctx *c, const struct sfs_inode *dir)
+{
+    int retstat = 0;
+
+    c->dir = (struct sfs_inode *) dir;
+    c->hbuf = malloc(block_size);
+    c->buf = malloc(block_size);
+    if (c->hbuf == NULL || c->buf == NULL) {
+	retstat = -ENOMEM;
+	goto fail;
+    }
+    c->hdr = (struct sfs_dir_header *) c->hbuf;
+
+    if (dir->size == 0) {
+	memset(c->hbuf, 0, block_size);
+	return 0;
+    }
+
+    retstat = file_block_read(dir, 0, c->hbuf);
+    if (retstat == 0 && c->hdr->magic != SFS_DIR_MAGIC)
+	retstat = -EIO;
+    if (retstat == 0)
+	return 0;
+
+fail:
+    free(c->hbuf);
+    free(c->buf);
+    return retstat;
+}
+
+static void dir_close(struct dir_ctx *c)
+{
+    free(c->hbuf);
+    free(c->buf);
+}
+
+/** Write the header back; the directory's size covers its buckets */
+static int dir_put_header(struct dir_ctx *c)
+{
+    c->hdr->magic = SFS_DIR_MAGIC;
+    c->dir->size = (1 + dir_nbuckets(c->hdr)) << block_shift;
+
+    return file_block_write(c->dir, 0, c->hbuf);
+}
+
+/** Hand out an overflow block, reusing a freed one first; uses c->buf */
+static int dir_over_alloc(struct dir_ctx *c, uint64_t *lblk)
+{
+    int retstat;
+
+    if (c->hdr->free_over == 0) {
+	*lblk = DIR_OVERFLOW_BASE + c->hdr->nover++;
+	return 0;
+    }
+
+    *lblk = c->hdr->free_over;
+    retstat = file_block_read(c->dir, *lblk, c->buf);
+    if (retstat < 0)
+	return retstat;
+    c->hdr->free_over = ((struct sfs_dir_block *) c->buf)->next;
+
+    return 0;
+}
+
+static int dir_over_free(struct dir_ctx *c, const uint64_t lblk)
+{
+    memset(c->buf, 0, block_size);
+    ((struct sfs_dir_block *) c->buf)->next = c->hdr->free_over;
+    c->hdr->free_over = lblk;
+
+    return file_block_write(c->dir, lblk, c->buf);
+}
+
+/** Find @name; on success c->buf holds the block *@lblk with it at *@slot */
+static int dir_find(struct dir_ctx *c, const char *name, const size_t len,
+		    uint64_t *lblk, unsigned int *slot)
+{
+    unsigned int i, n = dir_slots();
+    uint64_t blk;
+    int retstat;
+
+    if (c->hdr->magic == 0)
+	return -ENOENT;
+
+    blk = DIR_BUCKET(dir_bucket(c->hdr, dir_hash(name, len)));
+    while (blk != 0) {
+	retstat = file_block_read(c->dir, blk, c->buf);
+	if (retstat < 0)
+	    return retstat;
+	for (i = 0; i < n; i++) {
+	    if (dirent_match(dir_slot(c->buf, i), name, len)) {
+		*lblk = blk;
+		*slot = i;
+		return 0;
+	    }
+	}
+	blk = ((struct sfs_dir_block *) c->buf)->next;
+    }
+
+    return -ENOENT;
+}
+
+/** Lay out @n entries as the chain starting at @head
+ *
+ * Overflow blocks come from @pool first, then from dir_over_alloc.
+ */
+static int dir_chain_write(struct dir_ctx *c, const uint64_t head,
+			   const struct sfs_dirent *ents, const uint64_t n,
+			   uint64_t *pool, unsigned int *npool)
+{
+    unsigned int s, slots = dir_slots();
+    uint64_t i = 0, lblk = head, next;
+    int retstat;
+
+    while (lblk != 0) {
+	next = 0;
+	if (n - i > slots) {
+	    if (*npool > 0) {
+		next = pool[--*npool];
+	    } else {
+		retstat = dir_over_alloc(c, &next);
+		if (retstat < 0)
+		    return retstat;
+	    }
+	}
+
+	memset(c->buf, 0, block_size);
+	for (s = 0; s < slots && i < n; s++, i++)
+	    memcpy(dir_slot(c->buf, s), &ents[i], SFS_DIRENT_SIZE);
+	((struct sfs_dir_block *) c->buf)->next = next;
+	retstat = file_block_write(c->dir, lblk, c->buf);
+	if (retstat < 0)
+	    return retstat;
+	lblk = next;
+    }
+
+    return 0;
+}
+
+/** Split the bucket at the split pointer and advance it */
+static int dir_split(struct dir_ctx *c)
+{
+    uint64_t old = c->hdr->split;
+    uint64_t new = old + (1ULL << c->hdr->level);
+    uint64_t mask = (1ULL << (c->hdr->level + 1)) - 1;
+    unsigned int i, slots = dir_slots(), npool = 0, maxpool = 0;
+    struct sfs_dirent *ents = NULL, *de, *tmp, swap;
+    uint64_t n = 0, nkeep = 0, cap = 0, blk, *pool = NULL, *ptmp;
+    int retstat = 0;
+
+    // pull the whole chain into memory, remembering its overflow blocks
+    blk = DIR_BUCKET(old);
+    while (blk != 0) {
+	retstat = file_block_read(c->dir, blk, c->buf);
+	if (retstat < 0)
+	    goto out;
+	if (n + slots > cap) {
+	    cap = (cap + slots) * 2;
+	    tmp = realloc(ents, cap * sizeof(*ents));
+	    if (tmp == NULL) {
+		retstat = -ENOMEM;
+		goto out;
+	    }
+	    ents = tmp;
+	}
+	for (i = 0; i < slots; i++) {
+	    de = dir_slot(c->buf, i);
+	    if (de->ino != 0)
+		memcpy(&ents[n++], de, SFS_DIRENT_SIZE);
+	}
+	if (blk != DIR_BUCKET(old)) {
+	    if (npool == maxpool) {
+		maxpool = maxpool ? maxpool * 2 : 8;
+		ptmp = realloc(pool, maxpool * sizeof(*pool));
+		if (ptmp == NULL) {
+		    retstat = -ENOMEM;
+		    goto out;
+		}
+		pool = ptmp;
+	    }
+	    pool[npool++] = blk;
+	}
+	blk = ((struct sfs_dir_block *) c->buf)->next;
+    }
+
+    // entries staying in the old bucket go first, in place
+    for (i = 0; i < n; i++) {
+	if ((dir_hash(ents[i].name, ents[i].name_len) & mask) == old) {
+	    swap = ents[nkeep];
+	    ents[nkeep++] = ents[i];
+	    ents[i] = swap;
+	}
+    }
+
+    retstat = dir_chain_write(c, DIR_BUCKET(old), ents, nkeep, pool, &npool);
+    if (retstat == 0)
+	retstat = dir_chain_write(c, DIR_BUCKET(new), ents + nkeep, n - nkeep,
+				  pool, &npool);
+    while (retstat == 0 && npool > 0)
+	retstat = dir_over_free(c, pool[--npool]);
+    if (retstat < 0)
+	goto out;
+
+    if (++c->hdr->split == 1ULL << c->hdr->level) {
+	c->hdr->level++;
+	c->hdr->split = 0;
+    }
+
+out:
+    free(ents);
+    free(pool);
+    return retstat;
+}
+
+/** Find @name in @dir; returns 0 with *@ino set, or -ENOENT */
+int dir_lookup(const struct sfs_inode *dir, const char *name, uint32_t *ino)
+{
+    struct dir_ctx c;
+    unsigned int slot;
+    uint64_t lblk;
+    int retstat;
+
+    retstat = dir_open(&c, dir);
+    if (retstat < 0)
+	return retstat;
+
+    retstat = dir_find(&c, name, strlen(name), &lblk, &slot);
+    if (retstat == 0)
+	*ino = dir_slot(c.buf, slot)->ino;
+    dir_close(&c);
+
+    return retstat;
+}
+
+/** Add an entry for @name, which must not exist yet
+ *
+ * Takes the first free slot in the name's bucket, chaining on an
+ * overflow block if there is none.  The caller stores @dir.
+ */
+int dir_add(struct sfs_inode *dir, const char *name, const uint32_t ino)
+{
+    struct dir_ctx c;
+    struct sfs_dirent *de;
+    unsigned int i, slots = dir_slots();
+    size_t len = strlen(name);
+    uint64_t blk, next;
+    int retstat;
+
+    if (len > SFS_NAME_MAX)
+	return -ENAMETOOLONG;
+
+    retstat = dir_open(&c, dir);
+    if (retstat < 0)
+	return retstat;
+
+    blk = DIR_BUCKET(dir_bucket(c.hdr, dir_hash(name, len)));
+    for (;;) {
+	retstat = file_block_read(dir, blk, c.buf);
+	if (retstat < 0)
+	    goto out;
+	for (i = 0; i < slots; i++)
+	    if (dir_slot(c.buf, i)->ino == 0)
+		goto found;
+	next = ((struct sfs_dir_block *) c.buf)->next;
+	if (next == 0)
+	    break;
+	blk = next;
+    }
+
+    // every block of the chain is full: link in an overflow block
+    retstat = dir_over_alloc(&c, &next);
+    if (retstat < 0)
+	goto out;
+    retstat = file_block_read(dir, blk, c.buf);
+    if (retstat < 0)
+	goto out;
+    ((struct sfs_dir_block *) c.buf)->next = next;
+    retstat = file_block_write(dir, blk, c.buf);
+    if (retstat < 0)
+	goto out;
+    blk = next;
+    memset(c.buf, 0, block_size);
+    i = 0;
+
+found:
+    de = dir_slot(c.buf, i);
+    memset(de, 0, SFS_DIRENT_SIZE);
+    de->ino = ino;
+    de->name_len = len;
+    memcpy(de->name, name, len);
+    retstat = file_block_write(dir, blk, c.buf);
+    if (retstat < 0)
+	goto out;
+
+    c.hdr->nentries++;
+    if (c.hdr->nentries * 4 > dir_nbuckets(c.hdr) * slots * 3)
+	retstat = dir_split(&c);
+    if (retstat == 0)
+	retstat = dir_put_header(&c);
+
+out:
+    dir_close(&c);
+    return retstat;
+}
+
+/** Clear the slot of @name; returns 0 or -ENOENT.  The caller stores @dir. */
+int dir_remove(struct sfs_inode *dir, const char *name)
+{
+    struct dir_ctx c;
+    unsigned int slot;
+    uint64_t lblk;
+    int retstat;
+
+    retstat = dir_open(&c, dir);
+    if (retstat < 0)
+	return retstat;
+
+    retstat = dir_find(&c, name, strlen(name), &lblk, &slot);
+    if (retstat == 0) {
+	memset(dir_slot(c.buf, slot), 0, SFS_DIRENT_SIZE);
+	retstat = file_block_write(dir, lblk, c.buf);
+    }
+    if (retstat == 0) {
+	c.hdr->nentries--;
+	retstat = dir_put_header(&c);
+    }
+    dir_close(&c);
+
+    return retstat;
+}
+
+/** Returns 1 if @dir has no entries, 0 if it has some, or -errno */
+int dir_is_empty(const struct sfs_inode *dir)
+{
+    struct dir_ctx c;
+    int retstat;
+
+    retstat = dir_open(&c, dir);
+    if (retstat < 0)
+	return retstat;
+    retstat = c.hdr->nentries == 0;
+    dir_close(&c);
+
+    return retstat;
+}
+
+/** Call @fn for every entry of @dir until it returns non-zero
+ *
+ * Entries come in hash order.
+ */
+int dir_iterate(const struct sfs_inode *dir, dir_iter_t fn, void *arg)
+{
+    struct dir_ctx c;
+    struct sfs_dirent *de;
+    unsigned int i, slots = dir_slots();
+    uint64_t b, blk;
+    int retstat;
+
+    retstat = dir_open(&c, dir);
+    if (retstat < 0)
+	return retstat;
+
+    for (b = 0; c.hdr->magic != 0 && b < dir_nbuckets(c.hdr); b++) {
+	for (blk = DIR_BUCKET(b); blk != 0; ) {
+	    retstat = file_block_read(dir, blk, c.buf);
+	    if (retstat < 0)
+		goto out;
+	    for (i = 0; i < slots; i++) {
+		de = dir_slot(c.buf, i);
+		if (de->ino != 0 && fn(arg, de->name, de->ino) != 0)
+		    goto out;
+	    }
+	    blk = ((struct sfs_dir_block *) c.buf)->next;
+	}
+    }
+
+out:
+    dir_close(&c);
+    return retstat;
+}
+
+/** Resolve an absolute path to its inode
+ *
+ * The dentry cache is tried for the whole path first, then for each
+ * prefix on the way down, so only the components it has not seen
+ * cost a directory lookup.  Whatever the walk finds, present or
+ * missing, goes back into the cache.
+ *
+ * @inode may be NULL when only the inode number is wanted.  Returns 0,
+ * -ENOENT, -ENOTDIR if a leading component is not a directory, or
+ * -ENAMETOOLONG.
+ */
+int path_lookup(const char *path, uint32_t *ino, struct sfs_inode *inode)
+{
+    char name[SFS_NAME_MAX + 1];
+    const char *p = path, *q;
+    struct sfs_inode dir;
+    uint32_t cur = SFS_ROOT_INO, next;
+    size_t len = strlen(path);
+    int want = inode != NULL;   // the caller wants the last inode loaded
+    int loaded = 0;             // *inode holds cur
+    int retstat = 0;
+
+    if (!want)
+	inode = &dir;
+
+    while (len > 1 && path[len - 1] == '/')
+	len--;
+    if (len > 1 && dcache_lookup(path, len, &cur)) {
+	if (cur == 0)
+	    return -ENOENT;
+	p = path + len;
+    }
+
+    for (;;) {
+	while (*p == '/')
+	    p++;
+	if (*p == '\0')
+	    break;
+
+	for (q = p; *q != '\0' && *q != '/'; q++)
+	    ;
+	if (q - p > SFS_NAME_MAX)
+	    return -ENAMETOOLONG;
+
+	if (!dcache_lookup(path, q - path, &next)) {
+	    if (!loaded) {
+		retstat = inode_load(cur, inode);
+		if (retstat < 0)
+		    return retstat;
+		loaded = 1;
+	    }
+	    if (!S_ISDIR(inode->mode))
+		return -ENOTDIR;
+
+	    memcpy(name, p, q - p);
+	    name[q - p] = '\0';
+	    retstat = dir_lookup(inode, name, &next);
+	    if (retstat == -ENOENT)
+		next = 0;
+	    else if (retstat < 0)
+		return retstat;
+	    dcache_add(path, q - path, next);
+	}
+	if (next == 0)
+	    return -ENOENT;
+
+	cur = next;
+	loaded = 0;
+	p = q;
+    }
+
+    if (!loaded && want)
+	retstat = inode_load(cur, inode);
+    if (retstat == 0)
+	*ino = cur;
+    return retstat;
+}
+
+/** Resolve the directory holding the last component of @path
+ *
+ * *@name is left pointing at that component inside @path.  FUSE hands
+ * us normalized paths, so there are no trailing slashes to deal with.
+ */
+int path_parent(const char *path, uint32_t *dir_ino, struct sfs_inode *dir,
+		const char **name)
+{
+    const char *slash = strrchr(path, '/');
+    char *dpath;
+    int retstat;
+
+    if (slash == NULL || slash[1] == '\0')
+	return -EINVAL;
+    if (strlen(slash + 1) > SFS_NAME_MAX)
+	return -ENAMETOOLONG;
+
+    dpath = strndup(path, slash - path + 1);
+    if (dpath == NULL)
+	return -ENOMEM;
+    retstat = path_lookup(dpath, dir_ino, dir);
+    free(dpath);
+
+    if (retstat == 0 && !S_ISDIR(dir->mode))
+	retstat = -ENOTDIR;
+    if (retstat == 0)
+	*name = slash + 1;
+    return retstat;
+}
@@ -0,0 +1,55 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _DIR_H_
+#define _DIR_H_
+
+#include <stdint.h>
+
+#include "inode.h"
+
+#define SFS_DIRENT_SIZE 128
+#define SFS_NAME_MAX (SFS_DIRENT_SIZE - 9)
+#define SFS_DIR_MAGIC 0x48524944        // "DIRH" on a little-endian disk
+
+/** On-disk directory entry, packed into bucket blocks */
+struct sfs_dirent {
+    uint32_t ino;               // 0 for a free slot
+    uint16_t name_len;
+    uint16_t reserved;
+    char name[SFS_DIRENT_SIZE - 8];   // NUL-terminated
+};
+
+/** Logical block 0 of a directory: state of its linear hash table */
+struct sfs_dir_header {
+    uint32_t magic;
+    uint32_t level;             // 2^level <= buckets < 2^(level + 1)
+    uint64_t split;             // next bucket to split
+    uint64_t nentries;
+    uint64_t nover;             // overflow blocks handed out so far
+    uint64_t free_over;         // first free overflow block, 0 for none
+};
+
+/** Start of every bucket and overflow block, followed by dirent slots */
+struct sfs_dir_block {
+    uint64_t next;              // next overflow block in the chain, or 0
+    uint64_t reserved;
+};
+
+typedef int (*dir_iter_t)(void *arg, const char *name, uint32_t ino);
+
+int dir_lookup(const struct sfs_inode *dir, const char *name, uint32_t *ino);
+int dir_add(struct sfs_inode *dir, const char *name, const uint32_t ino);
+int dir_remove(struct sfs_inode *dir, const char *name);
+int dir_is_empty(const struct sfs_inode *dir);
+int dir_iterate(const struct sfs_inode *dir, dir_iter_t fn, void *arg);
+
+int path_lookup(const char *path, uint32_t *ino, struct sfs_inode *inode);
+int path_parent(const char *path, uint32_t *dir_ino, struct sfs_inode *dir,
+		const char **name);
+
+#endif
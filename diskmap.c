@@ -0,0 +1,276 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Memory-mapped disk file.  The whole image is mapped MAP_SHARED so
+  block reads and writes become memcpy, and metadata code can work on
+  the mapped blocks in place.  A large window of address space is
+  reserved up front and the file is grown underneath it with
+  ftruncate, so pointers into the map stay valid while the image
+  grows.  Written pages are tracked in a bitmap and msync'ed on
+  diskmap_sync().
+
+  Writes to different files reach here at the same time, and the sync
+  runs without the file system lock, so growing the file and the
+  dirty bitmap are under map_lock.  Reads only look at the size,
+  which is published with an atomic store once the file is grown.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "diskmap.h"
+
+// address space reserved for the image; halved until mmap accepts it
+#define DISKMAP_RESERVE (1ULL << 40)
+#define DISKMAP_MIN_RESERVE (1ULL << 30)
+// smallest step the file grows by
+#define DISKMAP_GROW (1 << 20)
+
+static int mapfd = -1;
+static char *map = NULL;
+static size_t map_reserved = 0;     // bytes of address space mapped
+static off_t map_size = 0;          // current size of the file
+static size_t page_size = 0;
+static unsigned long *dirty = NULL; // one bit per page of the file
+static size_t dirty_words = 0;
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define BITS_PER_WORD (8 * sizeof(unsigned long))
+
+/** Make room in the dirty bitmap for the current file size */
+static int diskmap_fit_dirty()
+{
+    size_t pages = (map_size + page_size - 1) / page_size;
+    size_t words = (pages + BITS_PER_WORD - 1) / BITS_PER_WORD;
+    unsigned long *bits;
+
+    if (words <= dirty_words)
+	return 0;
+
+    bits = realloc(dirty, words * sizeof(unsigned long));
+    if (bits == NULL)
+	return -ENOMEM;
+    memset(bits + dirty_words, 0, (words - dirty_words) * sizeof(unsigned long));
+    dirty = bits;
+    dirty_words = words;
+
+    return 0;
+}
+
+/** Map the disk file open on @fd
+ *
+ * Returns 0 on success or -errno, in which case the block layer keeps
+ * using pread/pwrite.
+ */
+int diskmap_init(const int fd)
+{
+    struct stat st;
+    size_t reserve;
+
+    if (map != NULL)
+	return 0;
+
+    if (fstat(fd, &st) < 0)
+	return -errno;
+
+    page_size = sysconf(_SC_PAGESIZE);
+    for (reserve = DISKMAP_RESERVE; reserve >= DISKMAP_MIN_RESERVE; reserve >>= 1) {
+	if ((off_t) reserve < st.st_size)
+	    return -EFBIG;
+	map = mmap(NULL, reserve, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE,
+		   fd, 0);
+	if (map != MAP_FAILED)
+	    break;
+    }
+    if (map == MAP_FAILED) {
+	map = NULL;
+	return -errno;
+    }
+
+    mapfd = fd;
+    map_reserved = reserve;
+    map_size = st.st_size;
+    if (diskmap_fit_dirty() < 0) {
+	diskmap_exit();
+	return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/** Write back whatever is dirty and unmap */
+void diskmap_exit()
+{
+    if (map == NULL)
+	return;
+
+    diskmap_sync();
+    munmap(map, map_reserved);
+    free(dirty);
+    map = NULL;
+    dirty = NULL;
+    dirty_words = 0;
+    map_reserved = 0;
+    map_size = 0;
+    mapfd = -1;
+}
+
+int diskmap_active()
+{
+    return map != NULL;
+}
+
+/** Grow the file so that [0, @end) is backed; called with map_lock held */
+static int diskmap_grow(off_t end)
+{
+    off_t size;
+
+    if (end <= map_size)
+	return 0;
+    if ((size_t) end > map_reserved)
+	return -EFBIG;
+
+    size = map_size * 2;
+    if (size < end)
+	size = end;
+    size = (size + DISKMAP_GROW - 1) / DISKMAP_GROW * DISKMAP_GROW;
+    if ((size_t) size > map_reserved)
+	size = map_reserved;
+
+    if (ftruncate(mapfd, size) < 0)
+	return -errno;
+    __atomic_store_n(&map_size, size, __ATOMIC_RELEASE);
+
+    return diskmap_fit_dirty();
+}
+
+/** Copy out of the map
+ *
+ * Anything past the end of the file reads as zeroes.  Returns the
+ * number of bytes that were backed by the file, like pread().
+ */
+int diskmap_read(off_t offset, void *buf, size_t len)
+{
+    off_t size = __atomic_load_n(&map_size, __ATOMIC_ACQUIRE);
+    size_t avail;
+
+    if (offset >= size) {
+	memset(buf, 0, len);
+	return 0;
+    }
+
+    avail = size - offset;
+    if (avail >= len) {
+	memcpy(buf, map + offset, len);
+	return len;
+    }
+
+    memcpy(buf, map + offset, avail);
+    memset((char *) buf + avail, 0, len - avail);
+    return avail;
+}
+
+/** Copy into the map, growing the file as needed
+ *
+ * Returns @len or -errno.
+ */
+int diskmap_write(off_t offset, const void *buf, size_t len)
+{
+    int retstat;
+
+    pthread_mutex_lock(&map_lock);
+    retstat = diskmap_grow(offset + len);
+    pthread_mutex_unlock(&map_lock);
+    if (retstat < 0)
+	return retstat;
+
+    memcpy(map + offset, buf, len);
+    diskmap_dirty(offset, len);
+
+    return len;
+}
+
+/** Direct pointer to [@offset, @offset + @len) in the map
+ *
+ * The file is grown to cover the range.  Callers that store through
+ * the pointer must report it with diskmap_dirty().  Returns NULL if
+ * the range cannot be mapped.
+ */
+void *diskmap_ptr(off_t offset, size_t len)
+{
+    int retstat;
+
+    if (map == NULL)
+	return NULL;
+
+    pthread_mutex_lock(&map_lock);
+    retstat = diskmap_grow(offset + len);
+    pthread_mutex_unlock(&map_lock);
+
+    return retstat < 0 ? NULL : map + offset;
+}
+
+/** Note that [@offset, @offset + @len) was modified */
+void diskmap_dirty(off_t offset, size_t len)
+{
+    size_t first = offset / page_size;
+    size_t last = (offset + len - 1) / page_size;
+    size_t p;
+
+    pthread_mutex_lock(&map_lock);
+    for (p = first; p <= last; p++)
+	dirty[p / BITS_PER_WORD] |= 1UL << (p % BITS_PER_WORD);
+    pthread_mutex_unlock(&map_lock);
+}
+
+/** msync every run of dirty pages
+ *
+ * Each run is taken off the bitmap under map_lock and synced without
+ * it.  Returns 0 or the first -errno from msync.
+ */
+int diskmap_sync()
+{
+    size_t p, start;
+    int retstat = 0;
+
+    if (map == NULL)
+	return 0;
+
+    pthread_mutex_lock(&map_lock);
+    for (p = 0; p < dirty_words * BITS_PER_WORD; ) {
+	if (dirty[p / BITS_PER_WORD] == 0 && p % BITS_PER_WORD == 0) {
+	    p += BITS_PER_WORD;
+	    continue;
+	}
+	if (!(dirty[p / BITS_PER_WORD] & (1UL << (p % BITS_PER_WORD)))) {
+	    p++;
+	    continue;
+	}
+
+	start = p;
+	while (p < dirty_words * BITS_PER_WORD
+	       && (dirty[p / BITS_PER_WORD] & (1UL << (p % BITS_PER_WORD)))) {
+	    dirty[p / BITS_PER_WORD] &= ~(1UL << (p % BITS_PER_WORD));
+	    p++;
+	}
+	pthread_mutex_unlock(&map_lock);
+	if (msync(map + start * page_size, (p - start) * page_size, MS_SYNC) < 0
+	    && retstat == 0) {
+	    retstat = -errno;
+	    perror("diskmap_sync failed");
+	}
+	pthread_mutex_lock(&map_lock);
+    }
+    pthread_mutex_unlock(&map_lock);
+
+    return retstat;
+}
@@ -0,0 +1,22 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _DISKMAP_H_
+#define _DISKMAP_H_
+
+#include <sys/types.h>
+
+int diskmap_init(const int fd);
+void diskmap_exit();
+int diskmap_active();
+int diskmap_read(off_t offset, void *buf, size_t len);
+int diskmap_write(off_t offset, const void *buf, size_t len);
+void *diskmap_ptr(off_t offset, size_t len);
+void diskmap_dirty(off_t offset, size_t len);
+int diskmap_sync();
+
+#endif
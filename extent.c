@@ -0,0 +1,403 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Extent-based block maps.  A file's logical blocks are described by
+  (lblk, start, len) runs kept sorted by lblk.  Small files keep their
+  extents in the inode itself.  Once those SFS_INODE_EXTENTS slots
+  overflow, the inode becomes the root of a B+tree: index nodes hold
+  (lblk, child block) pairs and leaves hold extents, one tree node per
+  block.  Every lookup is a binary search per level.
+
+  Inserts split full nodes on the way down, so a parent always has
+  room for the entry a split adds.  Appends split off only the last
+  entry, which keeps the tree of a sequentially written file packed.
+  The in-inode root is changed in memory only; callers write the
+  inode back.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "block.h"
+#include "extent.h"
+#include "inode.h"
+#include "journal.h"
+
+struct ext_node {
+    struct sfs_extent_header *eh;
+    struct sfs_extent *ent;
+    blkno_t blk;                // 0 for the root held in the inode
+    char *buf;                  // node block when blk != 0
+};
+
+static void node_root(struct ext_node *node, struct sfs_inode *inode)
+{
+    node->eh = &inode->eh;
+    node->ent = inode->extents;
+    node->blk = 0;
+    node->buf = NULL;
+}
+
+static void node_bind(struct ext_node *node, const blkno_t blk)
+{
+    node->blk = blk;
+    node->eh = (struct sfs_extent_header *) node->buf;
+    node->ent = (struct sfs_extent *) (node->buf + sizeof(struct sfs_extent_header));
+}
+
+static int node_load(struct ext_node *node, const blkno_t blk)
+{
+    int retstat;
+
+    node->buf = malloc(block_size);
+    if (node->buf == NULL)
+	return -ENOMEM;
+    node_bind(node, blk);
+
+    retstat = block_read(blk, node->buf);
+    if (retstat >= 0 && node->eh->magic != SFS_EXTENT_MAGIC)
+	retstat = -EIO;
+    if (retstat < 0) {
+	free(node->buf);
+	node->buf = NULL;
+	return retstat;
+    }
+
+    return 0;
+}
+
+/** Allocate an empty tree node at level @depth */
+static int node_new(struct ext_node *node, struct sfs_inode *inode,
+		    const uint16_t depth)
+{
+    uint64_t got;
+    blkno_t blk;
+    int retstat;
+
+    retstat = alloc_blocks(0, 1, &blk, &got);
+    if (retstat < 0)
+	return retstat;
+
+    node->buf = calloc(1, block_size);
+    if (node->buf == NULL) {
+	alloc_free_blocks(blk, 1);
+	return -ENOMEM;
+    }
+    node_bind(node, blk);
+    node->eh->magic = SFS_EXTENT_MAGIC;
+    node->eh->max = (block_size - sizeof(struct sfs_extent_header))
+	/ sizeof(struct sfs_extent);
+    node->eh->depth = depth;
+    inode->blocks++;
+
+    return 0;
+}
+
+static int node_save(const struct ext_node *node)
+{
+    int retstat;
+
+    if (node->blk == 0)
+	return 0;
+
+    retstat = journal_write(node->blk, node->buf);
+    return retstat < 0 ? retstat : 0;
+}
+
+static void node_put(struct ext_node *node)
+{
+    free(node->buf);
+    node->buf = NULL;
+}
+
+/** Index of the last entry whose lblk is <= @lblk, or -1 */
+static int node_search(const struct ext_node *node, const uint64_t lblk)
+{
+    int lo = 0, hi = node->eh->nentries - 1;
+    int mid, found = -1;
+
+    while (lo <= hi) {
+	mid = (lo + hi) / 2;
+	if (node->ent[mid].lblk <= lblk) {
+	    found = mid;
+	    lo = mid + 1;
+	} else {
+	    hi = mid - 1;
+	}
+    }
+
+    return found;
+}
+
+/** Translate logical block @lblk of a file
+ *
+ * Returns 1 with *@pblk set and *@len the number of blocks from
+ * there to the end of the extent, or 0 for a hole, with *@len the
+ * number of blocks until the next mapped one (UINT64_MAX past the last
+ * extent).  Negative on error.
+ */
+int extent_map(const struct sfs_inode *inode, const uint64_t lblk,
+	       blkno_t *pblk, uint64_t *len)
+{
+    struct ext_node node, child;
+    uint64_t bound = UINT64_MAX;    // first lblk past the current subtree
+    int i, retstat;
+
+    node_root(&node, (struct sfs_inode *) inode);
+    while (node.eh->depth > 0) {
+	i = node_search(&node, lblk);
+	if (i < 0)
+	    i = 0;
+	if (i + 1 < node.eh->nentries && node.ent[i + 1].lblk < bound)
+	    bound = node.ent[i + 1].lblk;
+	retstat = node_load(&child, node.ent[i].start);
+	node_put(&node);
+	if (retstat < 0)
+	    return retstat;
+	node = child;
+    }
+
+    i = node_search(&node, lblk);
+    if (i >= 0 && lblk < node.ent[i].lblk + node.ent[i].len) {
+	*pblk = node.ent[i].start + (lblk - node.ent[i].lblk);
+	*len = node.ent[i].lblk + node.ent[i].len - lblk;
+	retstat = 1;
+    } else {
+	if (i + 1 < node.eh->nentries && node.ent[i + 1].lblk < bound)
+	    bound = node.ent[i + 1].lblk;
+	*pblk = 0;
+	*len = bound - lblk;
+	retstat = 0;
+    }
+    node_put(&node);
+
+    return retstat;
+}
+
+/** Move a full in-inode root down into a new block, one level deeper */
+static int extent_grow(struct sfs_inode *inode)
+{
+    struct ext_node child;
+    int n = inode->eh.nentries;
+    int retstat;
+
+    retstat = node_new(&child, inode, inode->eh.depth);
+    if (retstat < 0)
+	return retstat;
+
+    memcpy(child.ent, inode->extents, n * sizeof(struct sfs_extent));
+    child.eh->nentries = n;
+    retstat = node_save(&child);
+    if (retstat < 0) {
+	alloc_free_blocks(child.blk, 1);
+	inode->blocks--;
+	node_put(&child);
+	return retstat;
+    }
+
+    inode->eh.depth++;
+    inode->eh.nentries = 1;
+    memset(inode->extents, 0, sizeof(inode->extents));
+    inode->extents[0].lblk = child.ent[0].lblk;
+    inode->extents[0].start = child.blk;
+    node_put(&child);
+
+    return 0;
+}
+
+/** Split the full child at slot @i of @parent, which has room
+ *
+ * The upper part of @child moves to a new @sibling linked in at slot
+ * @i + 1.  When the key being inserted lies past everything in
+ * @child, only the last entry moves, so appends leave full nodes
+ * behind them.  On failure @parent and @child are put back as they
+ * were and the sibling's block is freed again.
+ */
+static int node_split(struct sfs_inode *inode, struct ext_node *parent,
+		      const int i, struct ext_node *child,
+		      struct ext_node *sibling, const uint64_t lblk)
+{
+    int n = child->eh->nentries;
+    int keep;
+    int retstat;
+
+    retstat = node_new(sibling, inode, child->eh->depth);
+    if (retstat < 0)
+	return retstat;
+
+    keep = lblk > child->ent[n - 1].lblk ? n - 1 : n / 2;
+    memcpy(sibling->ent, child->ent + keep, (n - keep) * sizeof(struct sfs_extent));
+    sibling->eh->nentries = n - keep;
+    child->eh->nentries = keep;
+
+    memmove(parent->ent + i + 2, parent->ent + i + 1,
+	    (parent->eh->nentries - i - 1) * sizeof(struct sfs_extent));
+    memset(&parent->ent[i + 1], 0, sizeof(struct sfs_extent));
+    parent->ent[i + 1].lblk = sibling->ent[0].lblk;
+    parent->ent[i + 1].start = sibling->blk;
+    parent->eh->nentries++;
+
+    retstat = node_save(sibling);
+    if (retstat < 0)
+	goto fail;
+    retstat = node_save(child);
+    if (retstat < 0)
+	goto fail;
+    retstat = node_save(parent);
+    if (retstat < 0) {
+	// the child went out without the moved entries; put them back
+	child->eh->nentries = n;
+	node_save(child);
+	goto fail;
+    }
+
+    return 0;
+
+fail:
+    child->eh->nentries = n;
+    parent->eh->nentries--;
+    memmove(parent->ent + i + 1, parent->ent + i + 2,
+	    (parent->eh->nentries - i - 1) * sizeof(struct sfs_extent));
+    memset(&parent->ent[parent->eh->nentries], 0, sizeof(struct sfs_extent));
+    if (alloc_free_blocks(sibling->blk, 1) == 0)
+	inode->blocks--;
+    node_put(sibling);
+
+    return retstat;
+}
+
+/** Add an extent to a leaf that has room, merging with its neighbour */
+static void leaf_insert(struct ext_node *leaf, const uint64_t lblk,
+			const blkno_t pblk, const uint32_t len)
+{
+    struct sfs_extent *e;
+    int i = node_search(leaf, lblk);
+
+    if (i >= 0) {
+	e = &leaf->ent[i];
+	if (e->lblk + e->len == lblk && e->start + e->len == pblk
+	    && (uint64_t) e->len + len <= UINT32_MAX) {
+	    e->len += len;
+	    return;
+	}
+    }
+
+    memmove(leaf->ent + i + 2, leaf->ent + i + 1,
+	    (leaf->eh->nentries - i - 1) * sizeof(struct sfs_extent));
+    e = &leaf->ent[i + 1];
+    memset(e, 0, sizeof(*e));
+    e->lblk = lblk;
+    e->start = pblk;
+    e->len = len;
+    leaf->eh->nentries++;
+}
+
+/** Map logical blocks [@lblk, @lblk + @len) to [@pblk, @pblk + @len)
+ *
+ * The range must currently be a hole.  Tree blocks may be allocated
+ * along the way and are counted in inode->blocks; the data blocks are
+ * the caller's to count.  Returns 0 or -errno.
+ */
+int extent_insert(struct sfs_inode *inode, const uint64_t lblk,
+		  const blkno_t pblk, const uint32_t len)
+{
+    struct ext_node node, child, sibling;
+    int i, retstat;
+
+    if (inode->eh.nentries == inode->eh.max) {
+	retstat = extent_grow(inode);
+	if (retstat < 0)
+	    return retstat;
+    }
+
+    node_root(&node, inode);
+    while (node.eh->depth > 0) {
+	i = node_search(&node, lblk);
+	if (i < 0)
+	    i = 0;
+	retstat = node_load(&child, node.ent[i].start);
+	if (retstat < 0)
+	    goto out;
+
+	if (child.eh->nentries == child.eh->max) {
+	    retstat = node_split(inode, &node, i, &child, &sibling, lblk);
+	    if (retstat < 0) {
+		node_put(&child);
+		goto out;
+	    }
+	    if (lblk >= sibling.ent[0].lblk) {
+		node_put(&child);
+		child = sibling;
+	    } else {
+		node_put(&sibling);
+	    }
+	}
+
+	node_put(&node);
+	node = child;
+    }
+
+    leaf_insert(&node, lblk, pblk, len);
+    retstat = node_save(&node);
+
+out:
+    node_put(&node);
+    return retstat;
+}
+
+/** Free the blocks under @node, returning 0 or the first error
+ *
+ * A tree node that cannot be read is still freed, but whatever lies
+ * under it is lost; blocks that could not be freed stay allocated.
+ */
+static int node_free(struct ext_node *node, struct sfs_inode *inode)
+{
+    struct ext_node child;
+    int i, err, retstat = 0;
+
+    for (i = 0; i < node->eh->nentries; i++) {
+	if (node->eh->depth == 0) {
+	    err = alloc_free_blocks(node->ent[i].start, node->ent[i].len);
+	    if (err == 0)
+		inode->blocks -= node->ent[i].len;
+	    else if (retstat == 0)
+		retstat = err;
+	    continue;
+	}
+	err = node_load(&child, node->ent[i].start);
+	if (err == 0) {
+	    err = node_free(&child, inode);
+	    node_put(&child);
+	}
+	if (err < 0 && retstat == 0)
+	    retstat = err;
+	err = alloc_free_blocks(node->ent[i].start, 1);
+	if (err == 0)
+	    inode->blocks--;
+	else if (retstat == 0)
+	    retstat = err;
+    }
+
+    return retstat;
+}
+
+/** Release every data and tree block of a file, leaving an empty map */
+int extent_free_all(struct sfs_inode *inode)
+{
+    struct ext_node root;
+    int retstat;
+
+    node_root(&root, inode);
+    retstat = node_free(&root, inode);
+
+    inode->eh.nentries = 0;
+    inode->eh.depth = 0;
+    memset(inode->extents, 0, sizeof(inode->extents));
+
+    return retstat;
+}
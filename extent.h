@@ -0,0 +1,22 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _EXTENT_H_
+#define _EXTENT_H_
+
+#include <stdint.h>
+
+#include "block.h"
+#include "inode.h"
+
+int extent_map(const struct sfs_inode *inode, const uint64_t lblk,
+	       blkno_t *pblk, uint64_t *len);
+int extent_insert(struct sfs_inode *inode, const uint64_t lblk,
+		  const blkno_t pblk, const uint32_t len);
+int extent_free_all(struct sfs_inode *inode);
+
+#endif
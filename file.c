@@ -0,0 +1,304 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  File data I/O on top of the extent map.  Whole blocks go straight
+  between the caller's buffer and the disk, a mapped run at a time;
+  only partial blocks at either end of a request are staged.
+*/
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "block.h"
+#include "extent.h"
+#include "file.h"
+#include "inode.h"
+#include "journal.h"
+
+/** Read up to @size bytes at @offset, stopping at end of file
+ *
+ * Holes read back as zeroes.  Returns the number of bytes read or
+ * -errno.
+ */
+int file_read(const struct sfs_inode *inode, char *buf, size_t size,
+	      off_t offset)
+{
+    uint64_t pos, end, len, nblocks;
+    unsigned int boff;
+    size_t n, done = 0;
+    blkno_t pblk;
+    char *tmp = NULL;
+    int retstat = 0;
+
+    if (offset < 0)
+	return -EINVAL;
+    if ((uint64_t) offset >= inode->size)
+	return 0;
+    if (size > inode->size - offset)
+	size = inode->size - offset;
+
+    pos = offset;
+    end = pos + size;
+    while (pos < end) {
+	boff = pos & (block_size - 1);
+	retstat = extent_map(inode, pos >> block_shift, &pblk, &len);
+	if (retstat < 0)
+	    goto out;
+
+	if (boff != 0 || end - pos < block_size) {
+	    n = block_size - boff;
+	    if (n > end - pos)
+		n = end - pos;
+	    if (retstat == 0) {
+		memset(buf + done, 0, n);
+	    } else {
+		if (tmp == NULL && (tmp = malloc(block_size)) == NULL) {
+		    retstat = -ENOMEM;
+		    goto out;
+		}
+		retstat = block_read(pblk, tmp);
+		if (retstat < 0)
+		    goto out;
+		memcpy(buf + done, tmp + boff, n);
+	    }
+	} else {
+	    nblocks = (end - pos) >> block_shift;
+	    if (nblocks > len)
+		nblocks = len;
+	    n = nblocks << block_shift;
+	    if (retstat == 0) {
+		memset(buf + done, 0, n);
+	    } else {
+		retstat = block_read_blocks(pblk, nblocks, buf + done);
+		if (retstat < 0)
+		    goto out;
+	    }
+	}
+
+	pos += n;
+	done += n;
+    }
+    retstat = done;
+
+out:
+    free(tmp);
+    return retstat;
+}
+
+/** Start reading [@offset, +@size) of the file in the background
+ *
+ * Holes are skipped.  @via_fd says the data will be taken through
+ * block_fd() rather than the block cache.
+ */
+void file_readahead(const struct sfs_inode *inode, off_t offset, size_t size,
+		    const int via_fd)
+{
+    uint64_t lblk, last, len;
+    blkno_t pblk;
+    int retstat;
+
+    if ((uint64_t) offset >= inode->size || size == 0)
+	return;
+    if (size > inode->size - offset)
+	size = inode->size - offset;
+
+    lblk = offset >> block_shift;
+    last = (offset + size - 1) >> block_shift;
+    while (lblk <= last) {
+	retstat = extent_map(inode, lblk, &pblk, &len);
+	if (retstat < 0)
+	    return;
+	if (len > last - lblk + 1)
+	    len = last - lblk + 1;
+	if (retstat == 1) {
+	    if (via_fd)
+		block_advise(pblk, len);
+	    else
+		block_prefetch(pblk, len);
+	}
+	lblk += len;
+    }
+}
+
+/** Map logical block @lblk for writing, allocating it if it is a hole
+ *
+ * A hole gets up to @count new blocks, placed after @goal if possible.
+ * Returns 1 if the block was already mapped or 0 if it was just
+ * allocated, with *@pblk and *@len describing the run from @lblk;
+ * new blocks hold stale data.  Negative on error.
+ */
+int file_alloc(struct sfs_inode *inode, const uint64_t lblk, uint64_t count,
+	       const blkno_t goal, blkno_t *pblk, uint64_t *len)
+{
+    uint64_t got;
+    int retstat;
+
+    retstat = extent_map(inode, lblk, pblk, len);
+    if (retstat != 0)
+	return retstat;
+
+    if (count > *len)
+	count = *len;
+    if (count > UINT32_MAX)
+	count = UINT32_MAX;
+    retstat = alloc_blocks(goal, count, pblk, &got);
+    if (retstat < 0)
+	return retstat;
+
+    retstat = extent_insert(inode, lblk, *pblk, got);
+    if (retstat < 0) {
+	alloc_free_blocks(*pblk, got);
+	return retstat;
+    }
+    inode->blocks += got;
+    *len = got;
+
+    return 0;
+}
+
+/** Write @size bytes at @offset, allocating blocks for holes
+ *
+ * New blocks are placed right after the previous block of the file
+ * when possible, so sequential writes end up in a single extent.  The
+ * size and times are updated in @inode, which the caller stores.
+ * Returns @size or -errno.
+ */
+int file_write(struct sfs_inode *inode, const char *buf, size_t size,
+	       off_t offset)
+{
+    uint64_t pos, end, len, nblocks;
+    blkno_t pblk, goal = 0;
+    blkno_t fresh = 0, fresh_end = 0;   // blocks allocated by this call
+    unsigned int boff;
+    size_t n, done = 0;
+    char *tmp = NULL;
+    int retstat = 0;
+
+    if (offset < 0)
+	return -EINVAL;
+
+    pos = offset;
+    end = pos + size;
+    if (pos >> block_shift > 0
+	&& extent_map(inode, (pos >> block_shift) - 1, &pblk, &len) == 1)
+	goal = pblk + 1;
+
+    while (pos < end) {
+	boff = pos & (block_size - 1);
+	nblocks = ((end - 1) >> block_shift) - (pos >> block_shift) + 1;
+	retstat = file_alloc(inode, pos >> block_shift, nblocks, goal, &pblk, &len);
+	if (retstat < 0)
+	    goto out;
+	if (retstat == 0) {
+	    fresh = pblk;
+	    fresh_end = pblk + len;
+	}
+
+	if (boff != 0 || end - pos < block_size) {
+	    n = block_size - boff;
+	    if (n > end - pos)
+		n = end - pos;
+	    if (tmp == NULL && (tmp = malloc(block_size)) == NULL) {
+		retstat = -ENOMEM;
+		goto out;
+	    }
+	    // a block we just allocated may hold some old file's data
+	    if (pblk >= fresh && pblk < fresh_end)
+		memset(tmp, 0, block_size);
+	    else if ((retstat = block_read(pblk, tmp)) < 0)
+		goto out;
+	    memcpy(tmp + boff, buf + done, n);
+	    retstat = block_write(pblk, tmp);
+	    if (retstat < 0)
+		goto out;
+	    nblocks = 1;
+	} else {
+	    nblocks = (end - pos) >> block_shift;
+	    if (nblocks > len)
+		nblocks = len;
+	    n = nblocks << block_shift;
+	    retstat = block_write_blocks(pblk, nblocks, buf + done);
+	    if (retstat < 0)
+		goto out;
+	}
+
+	goal = pblk + nblocks;
+	pos += n;
+	done += n;
+    }
+    retstat = done;
+
+out:
+    if (done > 0) {
+	if (offset + done > inode->size)
+	    inode->size = offset + done;
+	inode->mtime = inode->ctime = time(NULL);
+    }
+    free(tmp);
+    return retstat;
+}
+
+/** Read logical block @lblk of a file into @buf, zero-filling holes
+ *
+ * Unlike file_read, this ignores the file size; directories use it to
+ * keep blocks outside the range reported to stat.
+ */
+int file_block_read(const struct sfs_inode *inode, const uint64_t lblk,
+		    void *buf)
+{
+    uint64_t len;
+    blkno_t pblk;
+    int retstat;
+
+    retstat = extent_map(inode, lblk, &pblk, &len);
+    if (retstat < 0)
+	return retstat;
+    if (retstat == 0) {
+	memset(buf, 0, block_size);
+	return 0;
+    }
+
+    retstat = block_read(pblk, buf);
+    return retstat < 0 ? retstat : 0;
+}
+
+/** Write logical block @lblk of a file, allocating it if needed
+ *
+ * The size and times are left alone.  Only directories use this, so
+ * the block is journaled as metadata.
+ */
+int file_block_write(struct sfs_inode *inode, const uint64_t lblk,
+		     const void *buf)
+{
+    uint64_t len, got;
+    blkno_t pblk, goal = 0;
+    int retstat;
+
+    retstat = extent_map(inode, lblk, &pblk, &len);
+    if (retstat < 0)
+	return retstat;
+
+    if (retstat == 0) {
+	if (lblk > 0 && extent_map(inode, lblk - 1, &pblk, &len) == 1)
+	    goal = pblk + 1;
+	retstat = alloc_blocks(goal, 1, &pblk, &got);
+	if (retstat < 0)
+	    return retstat;
+	retstat = extent_insert(inode, lblk, pblk, 1);
+	if (retstat < 0) {
+	    alloc_free_blocks(pblk, 1);
+	    return retstat;
+	}
+	inode->blocks++;
+    }
+
+    retstat = journal_write(pblk, buf);
+    return retstat < 0 ? retstat : 0;
+}
@@ -0,0 +1,31 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _FILE_H_
+#define _FILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "block.h"
+#include "inode.h"
+
+int file_read(const struct sfs_inode *inode, char *buf, size_t size,
+	      off_t offset);
+void file_readahead(const struct sfs_inode *inode, off_t offset, size_t size,
+		    const int via_fd);
+int file_write(struct sfs_inode *inode, const char *buf, size_t size,
+	       off_t offset);
+int file_alloc(struct sfs_inode *inode, const uint64_t lblk, uint64_t count,
+	       const blkno_t goal, blkno_t *pblk, uint64_t *len);
+int file_block_read(const struct sfs_inode *inode, const uint64_t lblk,
+		    void *buf);
+int file_block_write(struct sfs_inode *inode, const uint64_t lblk,
+		     const void *buf);
+
+#endif
@@ -0,0 +1,297 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Background write-back.  A thread wakes once a second, or sooner
+  when writers push the dirty share of the block cache past the
+  background threshold, and writes back whatever has been dirty for
+  longer than the expiry time, then enough of the rest to get back
+  under the threshold.  Buffered writes and dirty inodes are written
+  out on the same schedule, so the final flush at unmount only has
+  the last few seconds' worth left.
+
+  Writers that find the cache past the hard limit wait for one pass
+  of the thread instead of dirtying more.  Only frames the thread can
+  write back count towards the thresholds; those pinned by the
+  running journal transaction are cleared by committing it instead.
+
+  With the metadata journal on, the thread also commits the running
+  transaction on the expiry schedule, and checkpoints the journal
+  once it is half full.
+
+  The file system lock lives here too.  It is a reader/writer lock:
+  operations that only look things up (stat, read, readdir) share it,
+  and so do writes to file data, which hold their file's inode lock
+  on top; the caches and the allocator below them carry their own
+  locks.  Anything else that changes the file system, and each batch
+  of write-back, holds it exclusively.  Writers are preferred so a steady stream of readers
+  cannot keep the thread or a write out for good.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "block.h"
+#include "cache.h"
+#include "flusher.h"
+#include "icache.h"
+#include "journal.h"
+#include "super.h"
+#include "wbuf.h"
+
+static pthread_rwlock_t fs_rwlock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER; // the thread's state below
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;      // for the thread
+static pthread_cond_t cleaned = PTHREAD_COND_INITIALIZER;   // a pass finished
+static pthread_t thread;
+static int running = 0;
+static int stop = 0;
+static int kicked = 0;
+static unsigned long long npasses = 0;     // passes finished, for throttled writers
+static struct sfs_super last_sb;            // as the thread last wrote it
+
+static unsigned int dirty_background;
+static unsigned int dirty_limit;
+static unsigned int dirty_expire;
+static struct flusher_stats stats;
+
+/** Take the file system lock for an operation that changes things */
+void fs_lock()
+{
+    pthread_rwlock_wrlock(&fs_rwlock);
+}
+
+/** Take the file system lock for an operation that only looks */
+void fs_lock_shared()
+{
+    pthread_rwlock_rdlock(&fs_rwlock);
+}
+
+void fs_unlock()
+{
+    pthread_rwlock_unlock(&fs_rwlock);
+}
+
+static unsigned long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Dirty frames above which @pct percent of the cache is dirty */
+static unsigned int dirty_frames(const unsigned int pct)
+{
+    struct cache_stats cs;
+
+    cache_get_stats(&cs);
+    return (unsigned long long) cs.nframes * pct / 100;
+}
+
+/** Dirty frames the thread can write back
+ *
+ * Frames pinned by the running journal transaction are left out: no
+ * amount of write-back cleans them, only a commit does.
+ */
+static unsigned int ndirty()
+{
+    struct cache_stats cs;
+
+    cache_get_stats(&cs);
+    return cs.ndirty - cs.npinned;
+}
+
+static unsigned int npinned()
+{
+    struct cache_stats cs;
+
+    cache_get_stats(&cs);
+    return cs.npinned;
+}
+
+/** One round of write-back, called and returning with fs_lock() held */
+static void flusher_pass(time_t *last_meta)
+{
+    unsigned long long start;
+    unsigned int target;
+    time_t now = time(NULL);
+    time_t expire = now - dirty_expire;
+    int n, wrote = 0;
+
+    start = now_ns();
+
+    // buffered writes and inodes end up as dirty blocks, do them first
+    if (wbuf_flush_old(expire) > 0)
+	wrote = 1;
+    // a big transaction is committed early, freeing its frames for write-back
+    if (now - *last_meta >= (time_t) dirty_expire
+	|| (journal_active() && npinned() > dirty_frames(dirty_background))) {
+	if (journal_active()) {
+	    if (journal_commit() > 0)
+		wrote = 1;
+	} else {
+	    icache_flush();
+	    // the free counts are all that changes, skip it when they didn't
+	    if (memcmp(&sb, &last_sb, sizeof(sb)) != 0 && super_write() == 0)
+		last_sb = sb;
+	}
+	*last_meta = now;
+    }
+
+    target = UINT_MAX;
+    if (ndirty() > dirty_frames(dirty_background))
+	target = dirty_frames(dirty_background);
+
+    for (;;) {
+	n = cache_clean(target, expire, FLUSHER_BATCH);
+	if (n <= 0)
+	    break;
+	stats.blocks += n;
+	wrote = 1;
+	if (n < FLUSHER_BATCH)
+	    break;
+	// let waiting operations in between batches
+	fs_unlock();
+	fs_lock();
+    }
+
+    // most logged blocks went home above, this mostly just syncs
+    if (journal_usage() >= JOURNAL_CHECKPOINT && journal_checkpoint() == 0)
+	wrote = 1;
+
+    if (wrote) {
+	stats.passes++;
+	stats.busy_ns += now_ns() - start;
+    }
+}
+
+static void *flusher_thread(void *arg)
+{
+    struct timespec ts;
+    time_t last_meta = time(NULL);
+
+    pthread_mutex_lock(&flush_mutex);
+    while (!stop) {
+	if (!kicked) {
+	    clock_gettime(CLOCK_REALTIME, &ts);
+	    ts.tv_sec += FLUSHER_INTERVAL;
+	    pthread_cond_timedwait(&wake, &flush_mutex, &ts);
+	}
+	kicked = 0;
+	if (stop)
+	    break;
+	pthread_mutex_unlock(&flush_mutex);
+
+	fs_lock();
+	flusher_pass(&last_meta);
+	fs_unlock();
+
+	pthread_mutex_lock(&flush_mutex);
+	npasses++;
+	pthread_cond_broadcast(&cleaned);
+    }
+    pthread_mutex_unlock(&flush_mutex);
+
+    return NULL;
+}
+
+/** Start the write-back thread
+ *
+ * @background and @limit are percentages of the block cache, @expire
+ * is in seconds.  Needs the block cache; returns 0 or -errno.
+ */
+int flusher_init(const unsigned int background, const unsigned int limit,
+		 const unsigned int expire)
+{
+    if (running)
+	return 0;
+    if (!cache_enabled())
+	return -EINVAL;
+
+    dirty_background = background;
+    dirty_limit = limit > background ? limit : background;
+    dirty_expire = expire;
+    stop = 0;
+    kicked = 0;
+    npasses = 0;
+    last_sb = sb;
+    memset(&stats, 0, sizeof(stats));
+
+    if (pthread_create(&thread, NULL, flusher_thread, NULL) != 0)
+	return -EAGAIN;
+    running = 1;
+
+    return 0;
+}
+
+/** Stop the thread; called without fs_lock() held */
+void flusher_exit()
+{
+    if (!running)
+	return;
+
+    pthread_mutex_lock(&flush_mutex);
+    stop = 1;
+    pthread_cond_signal(&wake);
+    pthread_cond_broadcast(&cleaned);
+    pthread_mutex_unlock(&flush_mutex);
+    pthread_join(thread, NULL);
+    running = 0;
+}
+
+/** Called without the file system lock before dirtying more of the
+ *  cache
+ *
+ * Wakes the thread early past the background threshold, and past the
+ * hard limit waits until it has made a pass.
+ */
+void flusher_throttle()
+{
+    unsigned long long start, stall;
+    unsigned long long gen;
+
+    if (!running)
+	return;
+
+    if (ndirty() > dirty_frames(dirty_background)
+	|| npinned() > dirty_frames(dirty_background)) {
+	pthread_mutex_lock(&flush_mutex);
+	if (!kicked) {
+	    kicked = 1;
+	    pthread_cond_signal(&wake);
+	}
+	pthread_mutex_unlock(&flush_mutex);
+    }
+    if (ndirty() <= dirty_frames(dirty_limit))
+	return;
+
+    start = now_ns();
+    pthread_mutex_lock(&flush_mutex);
+    gen = npasses;
+    kicked = 1;
+    pthread_cond_signal(&wake);
+    while (!stop && npasses == gen)
+	pthread_cond_wait(&cleaned, &flush_mutex);
+
+    stall = now_ns() - start;
+    stats.stalls++;
+    stats.stall_ns += stall;
+    if (stall > stats.max_stall_ns)
+	stats.max_stall_ns = stall;
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+void flusher_get_stats(struct flusher_stats *out)
+{
+    pthread_mutex_lock(&flush_mutex);
+    *out = stats;
+    pthread_mutex_unlock(&flush_mutex);
+}
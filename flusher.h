@@ -0,0 +1,38 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _FLUSHER_H_
+#define _FLUSHER_H_
+
+// defaults for the mount options, as percentages of the block cache
+#define FLUSHER_DEFAULT_BACKGROUND 10   // dirty share where write-back starts
+#define FLUSHER_DEFAULT_LIMIT 40        // dirty share where writers wait
+#define FLUSHER_DEFAULT_EXPIRE 5        // seconds data may stay dirty
+
+#define FLUSHER_INTERVAL 1      // seconds between wakeups when idle
+#define FLUSHER_BATCH 256       // blocks written per hold of the fs lock
+
+struct flusher_stats {
+    unsigned long long passes;      // wakeups that found something to write
+    unsigned long long blocks;      // dirty blocks written back
+    unsigned long long busy_ns;     // time spent writing them
+    unsigned long long stalls;      // writes held at the hard limit
+    unsigned long long stall_ns;    // total time writers were held
+    unsigned long long max_stall_ns;
+};
+
+void fs_lock();
+void fs_lock_shared();
+void fs_unlock();
+
+int flusher_init(const unsigned int background, const unsigned int limit,
+		 const unsigned int expire);
+void flusher_exit();
+void flusher_throttle();
+void flusher_get_stats(struct flusher_stats *stats);
+
+#endif
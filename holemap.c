@@ -0,0 +1,184 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Map of where the disk file actually holds data.  It is built once
+  with lseek(SEEK_DATA/SEEK_HOLE) when the disk is opened and grown
+  as we write, so reads that fall entirely in a hole can be answered
+  with zeroes without going to the host file system.
+
+  The map may claim less data than the host file holds (the host
+  allocates in its own block size) but never more, so a range
+  reported as a hole really reads back as zeroes.
+
+  Concurrent readers consult the map while a cache eviction in
+  another thread may be growing it, hence map_lock.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "holemap.h"
+
+struct extent {
+    off_t start;
+    off_t end;          // exclusive
+};
+
+static struct extent *map = NULL;   // sorted, disjoint, non-adjacent
+static int nmap = 0;
+static int map_alloc = 0;
+static int map_active = 0;
+static pthread_rwlock_t map_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/** Index of the first extent that ends after @offset */
+static int holemap_find(const off_t offset)
+{
+    int lo = 0, hi = nmap;
+    int mid;
+
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (map[mid].end <= offset)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+
+    return lo;
+}
+
+static int holemap_insert(const off_t offset, const off_t len);
+
+/** Scan the file open on @fd for data extents
+ *
+ * Returns 0, or -errno if the host file system cannot report holes,
+ * in which case every read goes to the disk file as before.
+ */
+int holemap_init(const int fd)
+{
+    off_t data, hole = 0;
+    int retstat;
+
+    holemap_exit();
+
+    for (;;) {
+	data = lseek(fd, hole, SEEK_DATA);
+	if (data < 0) {
+	    if (errno == ENXIO)
+		break;
+	    retstat = -errno;
+	    holemap_exit();
+	    return retstat;
+	}
+	hole = lseek(fd, data, SEEK_HOLE);
+	if (hole < 0) {
+	    retstat = -errno;
+	    holemap_exit();
+	    return retstat;
+	}
+	retstat = holemap_insert(data, hole - data);
+	if (retstat < 0) {
+	    holemap_exit();
+	    return retstat;
+	}
+    }
+
+    map_active = 1;
+    return 0;
+}
+
+void holemap_exit()
+{
+    free(map);
+    map = NULL;
+    nmap = 0;
+    map_alloc = 0;
+    map_active = 0;
+}
+
+/** Does [@offset, @offset + @len) lie entirely in a hole?
+ *
+ * Always false while the map is not active.
+ */
+int holemap_is_hole(const off_t offset, const off_t len)
+{
+    int i, hole;
+
+    if (!map_active)
+	return 0;
+
+    pthread_rwlock_rdlock(&map_lock);
+    i = holemap_find(offset);
+    hole = map_active && (i == nmap || map[i].start >= offset + len);
+    pthread_rwlock_unlock(&map_lock);
+
+    return hole;
+}
+
+/** Merge [@offset, @offset + @len) into the extent list */
+static int holemap_insert(const off_t offset, const off_t len)
+{
+    struct extent *grown;
+    off_t start = offset, end = offset + len;
+    int i, j;
+
+    if (len <= 0)
+	return 0;
+
+    // first extent that touches or follows the new range
+    i = holemap_find(start > 0 ? start - 1 : 0);
+    for (j = i; j < nmap && map[j].start <= end; j++) {
+	if (map[j].start < start)
+	    start = map[j].start;
+	if (map[j].end > end)
+	    end = map[j].end;
+    }
+
+    if (i == j) {
+	if (nmap == map_alloc) {
+	    map_alloc = map_alloc ? map_alloc * 2 : 64;
+	    grown = realloc(map, map_alloc * sizeof(struct extent));
+	    if (grown == NULL) {
+		holemap_exit();
+		return -ENOMEM;
+	    }
+	    map = grown;
+	}
+	memmove(&map[i + 1], &map[i], (nmap - i) * sizeof(struct extent));
+	nmap++;
+    } else if (j - i > 1) {
+	memmove(&map[i + 1], &map[j], (nmap - j) * sizeof(struct extent));
+	nmap -= j - i - 1;
+    }
+    map[i].start = start;
+    map[i].end = end;
+
+    return 0;
+}
+
+/** Record that [@offset, @offset + @len) now holds data
+ *
+ * Returns 0 or -ENOMEM; on failure the map is switched off rather
+ * than left claiming holes that are no longer there.
+ */
+int holemap_add(const off_t offset, const off_t len)
+{
+    int retstat;
+
+    if (!map_active)
+	return 0;
+
+    pthread_rwlock_wrlock(&map_lock);
+    retstat = map_active ? holemap_insert(offset, len) : 0;
+    pthread_rwlock_unlock(&map_lock);
+
+    return retstat;
+}
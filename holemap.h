@@ -0,0 +1,18 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _HOLEMAP_H_
+#define _HOLEMAP_H_
+
+#include <sys/types.h>
+
+int holemap_init(const int fd);
+void holemap_exit();
+int holemap_is_hole(const off_t offset, const off_t len);
+int holemap_add(const off_t offset, const off_t len);
+
+#endif
@@ -0,0 +1,385 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Write-back inode cache behind inode_load()/inode_store().
+
+  The bookkeeping for each slot is a 16-byte record in one array, so
+  a hash chain walk touches four slots per cache line.  The inodes
+  themselves sit in a second, cache-line-aligned array where each one
+  spans exactly four lines.  Slots are replaced with CLOCK, skipping
+  inodes pinned by an open file, and dirty inodes only go back to the
+  inode table on eviction or icache_flush().
+
+  Lookups from readers sharing the file system lock can miss and
+  evict at the same time, so the table is under icache_lock.  A pinned
+  inode never moves, and only changes under the exclusive fs lock or
+  its open file's inode lock, so it is read through its pointer
+  without the table lock.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "icache.h"
+#include "inode.h"
+
+#define ICACHE_MIN_ENTRIES 64
+#define ICACHE_LINE 64
+
+struct icache_slot {
+    uint32_t ino;       // 0 when the slot holds nothing
+    int next;           // next slot in the same hash bucket, -1 ends the chain
+    uint32_t refs;      // open files pinning the inode
+    unsigned char ref;  // CLOCK reference bit
+    unsigned char dirty;
+    unsigned short pad;
+};
+
+typedef char icache_slot_size_check[sizeof(struct icache_slot) == 16 ? 1 : -1];
+
+static struct icache_slot *slots = NULL;
+static struct sfs_inode *inodes = NULL;
+static int *buckets = NULL;
+static unsigned int nslots = 0;
+static unsigned int nbuckets = 0;
+static unsigned int hand = 0;
+static struct icache_stats stats;
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int icache_hash(const uint32_t ino)
+{
+    return (ino * 0x9e3779b1U) & (nbuckets - 1);
+}
+
+static int icache_lookup(const uint32_t ino)
+{
+    int i;
+
+    for (i = buckets[icache_hash(ino)]; i >= 0; i = slots[i].next)
+	if (slots[i].ino == ino)
+	    return i;
+
+    return -1;
+}
+
+static void icache_unhash(const int idx)
+{
+    int *link = &buckets[icache_hash(slots[idx].ino)];
+
+    while (*link != idx)
+	link = &slots[*link].next;
+    *link = slots[idx].next;
+    slots[idx].ino = 0;
+    slots[idx].next = -1;
+}
+
+/** Pick an unpinned slot to reuse with CLOCK, writing it back if dirty
+ *
+ * Returns the slot index, -ENFILE if every inode is pinned, or the
+ * error from writing back a dirty victim.
+ */
+static int icache_victim()
+{
+    struct icache_slot *s;
+    unsigned int scanned;
+    int idx, retstat;
+
+    // one sweep clears every reference bit, the second finds any unpinned slot
+    for (scanned = 0; scanned < 2 * nslots; scanned++) {
+	idx = hand;
+	s = &slots[idx];
+	hand = (hand + 1) % nslots;
+
+	if (s->ino == 0)
+	    return idx;
+	if (s->refs > 0)
+	    continue;
+	if (s->ref) {
+	    s->ref = 0;
+	    continue;
+	}
+	if (s->dirty) {
+	    retstat = inode_disk_write(s->ino, &inodes[idx]);
+	    if (retstat < 0)
+		return retstat;
+	    s->dirty = 0;
+	    stats.writebacks++;
+	}
+	icache_unhash(idx);
+	stats.evictions++;
+	return idx;
+    }
+
+    return -ENFILE;
+}
+
+/** Slot holding @ino, reading it in on a miss; -errno on failure */
+static int icache_slot_of(const uint32_t ino)
+{
+    unsigned int h;
+    int idx, retstat;
+
+    idx = icache_lookup(ino);
+    if (idx >= 0) {
+	slots[idx].ref = 1;
+	stats.hits++;
+	return idx;
+    }
+
+    stats.misses++;
+    idx = icache_victim();
+    if (idx < 0)
+	return idx;
+
+    retstat = inode_disk_read(ino, &inodes[idx]);
+    if (retstat < 0)
+	return retstat;
+
+    h = icache_hash(ino);
+    slots[idx].ino = ino;
+    slots[idx].next = buckets[h];
+    slots[idx].refs = 0;
+    slots[idx].ref = 1;
+    slots[idx].dirty = 0;
+    buckets[h] = idx;
+
+    return idx;
+}
+
+/** Set up room for @n inodes; 0 leaves the cache disabled */
+int icache_init(unsigned int n)
+{
+    unsigned int i;
+
+    if (slots != NULL || n == 0)
+	return 0;
+
+    nslots = n < ICACHE_MIN_ENTRIES ? ICACHE_MIN_ENTRIES : n;
+    for (nbuckets = 1; nbuckets < nslots; nbuckets <<= 1)
+	;
+
+    slots = malloc(nslots * sizeof(struct icache_slot));
+    if (posix_memalign((void **) &inodes, ICACHE_LINE,
+		       (size_t) nslots * sizeof(struct sfs_inode)) != 0)
+	inodes = NULL;
+    buckets = malloc(nbuckets * sizeof(int));
+    if (slots == NULL || inodes == NULL || buckets == NULL) {
+	free(slots);
+	free(inodes);
+	free(buckets);
+	slots = NULL;
+	inodes = NULL;
+	buckets = NULL;
+	return -ENOMEM;
+    }
+
+    memset(slots, 0, nslots * sizeof(struct icache_slot));
+    for (i = 0; i < nslots; i++)
+	slots[i].next = -1;
+    for (i = 0; i < nbuckets; i++)
+	buckets[i] = -1;
+
+    hand = 0;
+    memset(&stats, 0, sizeof(stats));
+    stats.nentries = nslots;
+
+    return 0;
+}
+
+/** Write back every dirty inode and release the cache */
+void icache_destroy()
+{
+    if (slots == NULL)
+	return;
+
+    icache_flush();
+    free(slots);
+    free(inodes);
+    free(buckets);
+    slots = NULL;
+    inodes = NULL;
+    buckets = NULL;
+    nslots = 0;
+}
+
+int icache_enabled()
+{
+    return slots != NULL;
+}
+
+/** Copy inode @ino out of the cache, reading it in if needed
+ *
+ * When every slot is pinned the inode is read straight from disk.
+ */
+int icache_read(const uint32_t ino, struct sfs_inode *inode)
+{
+    int idx, retstat = 0;
+
+    pthread_mutex_lock(&icache_lock);
+    idx = icache_slot_of(ino);
+    if (idx == -ENFILE)
+	retstat = inode_disk_read(ino, inode);
+    else if (idx < 0)
+	retstat = idx;
+    else
+	memcpy(inode, &inodes[idx], sizeof(*inode));
+    pthread_mutex_unlock(&icache_lock);
+
+    return retstat;
+}
+
+/** Update inode @ino in the cache; it reaches the disk later
+ *
+ * When every slot is pinned the inode is written straight to disk.
+ */
+int icache_write(const uint32_t ino, const struct sfs_inode *inode)
+{
+    int idx, retstat = 0;
+
+    pthread_mutex_lock(&icache_lock);
+    idx = icache_lookup(ino);
+    if (idx < 0) {
+	idx = icache_victim();
+	if (idx == -ENFILE) {
+	    retstat = inode_disk_write(ino, inode);
+	    goto out;
+	}
+	if (idx < 0) {
+	    retstat = idx;
+	    goto out;
+	}
+	slots[idx].ino = ino;
+	slots[idx].next = buckets[icache_hash(ino)];
+	slots[idx].refs = 0;
+	buckets[icache_hash(ino)] = idx;
+    }
+
+    memcpy(&inodes[idx], inode, sizeof(*inode));
+    slots[idx].ref = 1;
+    slots[idx].dirty = 1;
+
+out:
+    pthread_mutex_unlock(&icache_lock);
+    return retstat;
+}
+
+/** Pin inode @ino in memory for an open file
+ *
+ * *@inode is set to the cached copy, which stays put until the pin is
+ * dropped; changes made through it must be followed by icache_dirty().
+ * With the cache off, *@inode is NULL.  Returns 0, or -ENFILE when
+ * every slot is already pinned.
+ */
+int icache_get(const uint32_t ino, struct sfs_inode **inode)
+{
+    int idx;
+
+    *inode = NULL;
+    if (slots == NULL)
+	return 0;
+
+    pthread_mutex_lock(&icache_lock);
+    idx = icache_slot_of(ino);
+    if (idx >= 0) {
+	if (slots[idx].refs++ == 0)
+	    stats.npinned++;
+	*inode = &inodes[idx];
+    }
+    pthread_mutex_unlock(&icache_lock);
+
+    return idx < 0 ? idx : 0;
+}
+
+/** Drop a pin taken by icache_get(); returns the pins left */
+int icache_put(const uint32_t ino)
+{
+    int idx, refs = 0;
+
+    if (slots == NULL)
+	return 0;
+
+    pthread_mutex_lock(&icache_lock);
+    idx = icache_lookup(ino);
+    if (idx >= 0 && slots[idx].refs > 0) {
+	if (--slots[idx].refs == 0)
+	    stats.npinned--;
+	refs = slots[idx].refs;
+    }
+    pthread_mutex_unlock(&icache_lock);
+
+    return refs;
+}
+
+/** Note that the pinned copy of inode @ino was changed in place */
+void icache_dirty(const uint32_t ino)
+{
+    int idx;
+
+    if (slots == NULL)
+	return;
+
+    pthread_mutex_lock(&icache_lock);
+    if ((idx = icache_lookup(ino)) >= 0)
+	slots[idx].dirty = 1;
+    pthread_mutex_unlock(&icache_lock);
+}
+
+static int icache_cmp(const void *a, const void *b)
+{
+    uint32_t x = slots[*(const int *) a].ino;
+    uint32_t y = slots[*(const int *) b].ino;
+
+    return x < y ? -1 : x > y;
+}
+
+/** Write back every dirty inode in inode number order
+ *
+ * Neighbours share an inode table block, so in order they mostly hit
+ * the same cached block.  Returns 0 or the first error.
+ */
+int icache_flush()
+{
+    unsigned int i, n = 0;
+    int *dirty;
+    int retstat = 0, err;
+
+    if (slots == NULL)
+	return 0;
+
+    dirty = malloc(nslots * sizeof(int));
+    if (dirty == NULL)
+	return -ENOMEM;
+
+    pthread_mutex_lock(&icache_lock);
+    for (i = 0; i < nslots; i++)
+	if (slots[i].ino != 0 && slots[i].dirty)
+	    dirty[n++] = i;
+    qsort(dirty, n, sizeof(int), icache_cmp);
+
+    for (i = 0; i < n; i++) {
+	err = inode_disk_write(slots[dirty[i]].ino, &inodes[dirty[i]]);
+	if (err < 0) {
+	    if (retstat == 0)
+		retstat = err;
+	    continue;
+	}
+	slots[dirty[i]].dirty = 0;
+	stats.writebacks++;
+    }
+    pthread_mutex_unlock(&icache_lock);
+    free(dirty);
+
+    return retstat;
+}
+
+void icache_get_stats(struct icache_stats *s)
+{
+    pthread_mutex_lock(&icache_lock);
+    *s = stats;
+    pthread_mutex_unlock(&icache_lock);
+}
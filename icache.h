@@ -0,0 +1,38 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _ICACHE_H_
+#define _ICACHE_H_
+
+#include <stdint.h>
+
+#include "inode.h"
+
+// default number of in-memory inodes
+#define ICACHE_DEFAULT_ENTRIES 16384
+
+struct icache_stats {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long evictions;
+    unsigned long long writebacks;
+    unsigned int nentries;
+    unsigned int npinned;
+};
+
+int icache_init(unsigned int nentries);
+void icache_destroy();
+int icache_enabled();
+int icache_read(const uint32_t ino, struct sfs_inode *inode);
+int icache_write(const uint32_t ino, const struct sfs_inode *inode);
+int icache_get(const uint32_t ino, struct sfs_inode **inode);
+int icache_put(const uint32_t ino);
+void icache_dirty(const uint32_t ino);
+int icache_flush();
+void icache_get_stats(struct icache_stats *stats);
+
+#endif
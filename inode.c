@@ -0,0 +1,169 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Inode table access and inode allocation.  inode_load() and
+  inode_store() go through the inode cache when it is on;
+  inode_disk_read() and inode_disk_write() always hit the table.
+
+  Several inodes share a table block and writes to different files
+  run at the same time, so inode_disk_write() updates its block under
+  itable_lock.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "block.h"
+#include "extent.h"
+#include "icache.h"
+#include "inode.h"
+#include "journal.h"
+#include "super.h"
+#include "wbuf.h"
+
+// the on-disk layout depends on this
+typedef char sfs_inode_size_check[sizeof(struct sfs_inode) == SFS_INODE_SIZE ? 1 : -1];
+
+static pthread_mutex_t itable_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Fill in a fresh in-memory inode with an empty block map */
+void inode_init(struct sfs_inode *inode, const mode_t mode, const uid_t uid,
+		const gid_t gid)
+{
+    memset(inode, 0, sizeof(*inode));
+    inode->mode = mode;
+    inode->nlink = 1;
+    inode->uid = uid;
+    inode->gid = gid;
+    inode->atime = inode->mtime = inode->ctime = time(NULL);
+    inode->eh.magic = SFS_EXTENT_MAGIC;
+    inode->eh.max = SFS_INODE_EXTENTS;
+}
+
+/** Block of the inode table holding @ino, and its offset in there */
+static blkno_t inode_block(const uint32_t ino, unsigned int *offset)
+{
+    uint64_t byte = (uint64_t) ino * SFS_INODE_SIZE;
+
+    *offset = byte % block_size;
+    return sb.itable_start + byte / block_size;
+}
+
+int inode_disk_read(const uint32_t ino, struct sfs_inode *inode)
+{
+    unsigned int offset;
+    blkno_t blk;
+    char *buf;
+    int retstat;
+
+    if (ino == 0 || ino >= sb.ninodes)
+	return -EINVAL;
+
+    buf = malloc(block_size);
+    if (buf == NULL)
+	return -ENOMEM;
+
+    blk = inode_block(ino, &offset);
+    retstat = block_read(blk, buf);
+    if (retstat >= 0) {
+	memcpy(inode, buf + offset, sizeof(*inode));
+	retstat = 0;
+    }
+    free(buf);
+
+    return retstat;
+}
+
+int inode_disk_write(const uint32_t ino, const struct sfs_inode *inode)
+{
+    unsigned int offset;
+    blkno_t blk;
+    char *buf;
+    int retstat;
+
+    if (ino == 0 || ino >= sb.ninodes)
+	return -EINVAL;
+
+    buf = malloc(block_size);
+    if (buf == NULL)
+	return -ENOMEM;
+
+    blk = inode_block(ino, &offset);
+    pthread_mutex_lock(&itable_lock);
+    retstat = block_read(blk, buf);
+    if (retstat >= 0) {
+	memcpy(buf + offset, inode, sizeof(*inode));
+	retstat = journal_write(blk, buf);
+    }
+    pthread_mutex_unlock(&itable_lock);
+    free(buf);
+
+    return retstat < 0 ? retstat : 0;
+}
+
+int inode_load(const uint32_t ino, struct sfs_inode *inode)
+{
+    if (ino == 0 || ino >= sb.ninodes)
+	return -EINVAL;
+
+    if (icache_enabled())
+	return icache_read(ino, inode);
+    return inode_disk_read(ino, inode);
+}
+
+int inode_store(const uint32_t ino, const struct sfs_inode *inode)
+{
+    if (ino == 0 || ino >= sb.ninodes)
+	return -EINVAL;
+
+    if (icache_enabled())
+	return icache_write(ino, inode);
+    return inode_disk_write(ino, inode);
+}
+
+/** Allocate an inode number and write out a fresh inode for it
+ *
+ * Returns 0 with *@ino and *@inode filled in, -ENOSPC, or -errno.
+ */
+int inode_new(const mode_t mode, const uid_t uid, const gid_t gid,
+	      uint32_t *ino, struct sfs_inode *inode)
+{
+    int retstat;
+
+    retstat = alloc_inode(ino);
+    if (retstat < 0)
+	return retstat;
+
+    inode_init(inode, mode, uid, gid);
+    retstat = inode_store(*ino, inode);
+    if (retstat < 0)
+	alloc_free_inode(*ino);
+
+    return retstat;
+}
+
+/** Free the blocks of an inode that has no links left, then the inode
+ *
+ * Buffered writes for it are dropped first, so the flusher can never
+ * write them into the inode number once it is handed out again.
+ */
+int inode_release(const uint32_t ino, struct sfs_inode *inode)
+{
+    int retstat, err;
+
+    wbuf_drop(ino);
+    retstat = extent_free_all(inode);
+    memset(inode, 0, sizeof(*inode));
+    err = inode_store(ino, inode);
+    if (err == 0)
+	err = alloc_free_inode(ino);
+
+    return retstat < 0 ? retstat : err;
+}
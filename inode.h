@@ -0,0 +1,69 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _INODE_H_
+#define _INODE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SFS_INODE_SIZE 256
+#define SFS_INODE_EXTENTS 8
+#define SFS_EXTENT_MAGIC 0xf30a
+
+/** One run of a file's block map
+ *
+ * In leaf nodes, logical blocks [lblk, lblk + len) live in physical
+ * blocks [start, start + len).  In index nodes, start is the block of
+ * the child node whose extents begin at lblk, and len is unused.
+ */
+struct sfs_extent {
+    uint64_t lblk;
+    uint64_t start;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+/** Header of an extent tree node, in the inode or in a tree block */
+struct sfs_extent_header {
+    uint16_t magic;
+    uint16_t nentries;
+    uint16_t max;
+    uint16_t depth;             // 0 for leaves
+};
+
+/** On-disk inode
+ *
+ * The block map starts out as up to SFS_INODE_EXTENTS extents held in
+ * the inode.  When those overflow, the inode holds the root of an
+ * extent tree instead (see extent.c).
+ */
+struct sfs_inode {
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint64_t blocks;            // blocks allocated for data and extent tree
+    struct sfs_extent_header eh;
+    struct sfs_extent extents[SFS_INODE_EXTENTS];
+};
+
+void inode_init(struct sfs_inode *inode, const mode_t mode, const uid_t uid,
+		const gid_t gid);
+int inode_disk_read(const uint32_t ino, struct sfs_inode *inode);
+int inode_disk_write(const uint32_t ino, const struct sfs_inode *inode);
+int inode_load(const uint32_t ino, struct sfs_inode *inode);
+int inode_store(const uint32_t ino, const struct sfs_inode *inode);
+int inode_new(const mode_t mode, const uid_t uid, const gid_t gid,
+	      uint32_t *ino, struct sfs_inode *inode);
+int inode_release(const uint32_t ino, struct sfs_inode *inode);
+
+#endif
@@ -0,0 +1,1010 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Write-ahead journal for metadata.  Every metadata block an
+  operation writes (bitmaps, inode table, extent nodes, directories
+  and the superblock) goes through journal_write() into the running
+  transaction, whose blocks stay pinned in the block cache.
+  journal_commit() writes the whole transaction to the journal area
+  in one sequential run -- descriptor blocks naming the home blocks,
+  the copies themselves, revoke records and a commit block with a
+  checksum -- waits for it to be durable, and only then lets the
+  cache write the blocks home.  Many operations share a transaction:
+  it is committed when the flusher's expiry timer runs out, on fsync,
+  and when it outgrows its share of the cache.
+
+  fsync splits the commit in two so that the sync is shared between
+  callers and runs without the file system lock: journal_commit_start()
+  logs the transaction under the lock and starts the next one, and
+  once block_commit() has synced the disk file journal_commit_finish()
+  unpins the blocks of every transaction logged before it.  Until
+  then such a transaction is in flight: its blocks may already have
+  joined the running one, but none goes home and none of its frees is
+  handed out.
+
+  The journal is a ring.  A checkpoint writes back whatever the cache
+  still holds from logged transactions, syncs, and moves the replay
+  start in the header block up to the head, which empties the ring.
+  The flusher does that in the background once the ring is half full.
+  At mount journal_replay() copies every complete transaction after
+  the replay start to its home blocks; a torn last one fails its
+  checksum and is dropped.
+
+  A block that is freed may still have copies in the ring, so the
+  free also logs a revoke record that keeps replay from writing those
+  copies over whatever the block holds next.
+
+  File data is not journaled.  Like ext4's data=writeback, a crash
+  can leave the newest blocks of a file with stale contents, but never
+  leaves the metadata half updated.
+
+  Commits and checkpoints only happen under the exclusive file system
+  lock.  Writes to files run under the shared one and readers can
+  evict a dirty inode from the inode cache, so journal_write() and
+  journal_revoke() take tx_lock to add to the running transaction,
+  and journal_due() tells a write whether to come back for the
+  exclusive lock and commit.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+#include "block.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "icache.h"
+#include "journal.h"
+#include "super.h"
+
+#define JOURNAL_SUM_INIT 0xcbf29ce484222325ULL
+#define LOGGED_EMPTY ((blkno_t) -1)
+
+struct revoke {
+    blkno_t block_num;
+    uint64_t seq;       // transaction that revoked it
+};
+
+// revoke records gathered by the first pass of journal_replay()
+struct replay {
+    struct revoke *revokes;
+    unsigned int n;
+    unsigned int cap;
+};
+
+static int active = 0;
+static uint64_t ring;           // log blocks, the area less its header block
+static uint64_t head;           // ring position of the next transaction
+static uint64_t tail;           // ring position replay starts at
+static uint64_t used;           // ring blocks from tail to head
+static uint64_t seq;            // sequence number of the running transaction
+static uint64_t tail_seq;       // and of the one at tail
+static unsigned int per_block;  // block numbers in a descriptor or revoke block
+static int force_checkpoint = 0; // a revoke record could not be kept
+
+// the running transaction
+static blkno_t *tx = NULL;
+static unsigned int ntx = 0;
+static unsigned int tx_cap = 0;
+static unsigned int tx_max = 0; // commit once it has this many blocks
+static blkno_t *revoked = NULL;
+static unsigned int nrevoked = 0;
+static unsigned int revoked_cap = 0;
+
+// blocks that have copies in the ring or the running transaction,
+// open addressing with linear probing
+static blkno_t *logged = NULL;
+static uint64_t logged_mask = 0;
+static uint64_t nlogged = 0;
+
+// transactions logged but not yet known to be durable, oldest first
+struct flight {
+    uint64_t seq;
+    unsigned int nblocks;       // its blocks, in order in flight_blocks
+    unsigned int ndeferred;     // block frees it holds back
+};
+
+static struct flight *flights = NULL;
+static unsigned int nflights = 0;
+static unsigned int flights_cap = 0;
+static blkno_t *flight_blocks = NULL;
+static unsigned int nflight_blocks = 0;
+static unsigned int flight_blocks_cap = 0;
+static unsigned int flight_deferred = 0; // deferred frees owned by flights
+
+static struct sfs_super committed_sb;   // as the last commit logged it
+static struct journal_stats stats;
+static pthread_mutex_t tx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static blkno_t ring_block(const uint64_t pos)
+{
+    return sb.journal_start + 1 + pos;
+}
+
+/** Zeroed buffer of @count blocks, aligned for O_DIRECT */
+static char *journal_alloc(const uint64_t count)
+{
+    void *buf;
+
+    if (posix_memalign(&buf, BUFPOOL_ALIGN, count * block_size) != 0)
+	return NULL;
+    memset(buf, 0, count * block_size);
+
+    return buf;
+}
+
+/** Fold a block into a running checksum, FNV-1a over 64-bit words */
+static uint64_t journal_sum(uint64_t sum, const void *buf)
+{
+    const uint64_t *w = buf;
+    unsigned int i;
+
+    for (i = 0; i < block_size / sizeof(uint64_t); i++)
+	sum = (sum ^ w[i]) * 0x100000001b3ULL;
+
+    return sum;
+}
+
+static int journal_write_header()
+{
+    struct journal_header *h;
+    char *buf;
+    int retstat;
+
+    buf = journal_alloc(1);
+    if (buf == NULL)
+	return -ENOMEM;
+
+    h = (struct journal_header *) buf;
+    h->magic = JOURNAL_MAGIC;
+    h->type = JOURNAL_HEADER;
+    h->seq = tail_seq;
+    h->tail = tail;
+    retstat = disk_write(sb.journal_start, buf);
+    free(buf);
+
+    return retstat < 0 ? retstat : 0;
+}
+
+static int journal_read_header()
+{
+    struct journal_header *h;
+    char *buf;
+    int retstat;
+
+    buf = journal_alloc(1);
+    if (buf == NULL)
+	return -ENOMEM;
+
+    ring = sb.journal_blocks - 1;
+    per_block = (block_size - sizeof(struct journal_header)) / sizeof(uint64_t);
+
+    retstat = disk_read(sb.journal_start, buf);
+    h = (struct journal_header *) buf;
+    if (retstat >= 0 && (h->magic != JOURNAL_MAGIC || h->type != JOURNAL_HEADER
+			 || h->tail >= ring))
+	retstat = -EINVAL;
+    if (retstat >= 0) {
+	tail = h->tail;
+	tail_seq = h->seq;
+    }
+    free(buf);
+
+    return retstat < 0 ? retstat : 0;
+}
+
+/** Write the header of an empty journal, when formatting an image */
+int journal_format()
+{
+    if (sb.journal_blocks == 0)
+	return 0;
+
+    tail = 0;
+    tail_seq = 1;
+    return journal_write_header();
+}
+
+static uint64_t logged_slot(const blkno_t block_num)
+{
+    return (block_num * 0x9e3779b97f4a7c15ULL >> 32) & logged_mask;
+}
+
+static int logged_has(const blkno_t block_num)
+{
+    uint64_t i;
+
+    for (i = logged_slot(block_num); logged[i] != LOGGED_EMPTY;
+	 i = (i + 1) & logged_mask)
+	if (logged[i] == block_num)
+	    return 1;
+
+    return 0;
+}
+
+static void logged_insert(const blkno_t block_num)
+{
+    uint64_t i;
+
+    for (i = logged_slot(block_num); logged[i] != LOGGED_EMPTY;
+	 i = (i + 1) & logged_mask)
+	if (logged[i] == block_num)
+	    return;
+    logged[i] = block_num;
+    nlogged++;
+}
+
+/** Empty the set of logged blocks, leaving room for @expect of them */
+static int logged_reset(const uint64_t expect)
+{
+    blkno_t *table;
+    uint64_t size;
+
+    for (size = 64; size < 2 * expect; size <<= 1)
+	;
+    if (logged == NULL || size != logged_mask + 1) {
+	table = malloc(size * sizeof(blkno_t));
+	if (table == NULL)
+	    return -ENOMEM;
+	free(logged);
+	logged = table;
+	logged_mask = size - 1;
+    }
+    memset(logged, 0xff, size * sizeof(blkno_t));
+    nlogged = 0;
+
+    return 0;
+}
+
+/** Remember that @block_num has a copy in the journal
+ *
+ * If the set cannot grow, the next commit checkpoints instead of
+ * relying on revoke records.
+ */
+static void logged_add(const blkno_t block_num)
+{
+    blkno_t *old = logged;
+    uint64_t i, size = logged_mask + 1;
+
+    if (nlogged + 1 > size * 3 / 4) {
+	logged = NULL;
+	if (logged_reset(size) < 0) {
+	    logged = old;
+	    force_checkpoint = 1;
+	    return;
+	}
+	for (i = 0; i < size; i++)
+	    if (old[i] != LOGGED_EMPTY)
+		logged_insert(old[i]);
+	free(old);
+    }
+    logged_insert(block_num);
+}
+
+static int replay_add(struct replay *rp, const blkno_t block_num, const uint64_t s)
+{
+    struct revoke *grown;
+
+    if (rp->n == rp->cap) {
+	grown = realloc(rp->revokes, (rp->cap ? 2 * rp->cap : 64) * sizeof(struct revoke));
+	if (grown == NULL)
+	    return -ENOMEM;
+	rp->revokes = grown;
+	rp->cap = rp->cap ? 2 * rp->cap : 64;
+    }
+    rp->revokes[rp->n].block_num = block_num;
+    rp->revokes[rp->n].seq = s;
+    rp->n++;
+
+    return 0;
+}
+
+static int revoke_cmp(const void *a, const void *b)
+{
+    const struct revoke *x = a, *y = b;
+
+    if (x->block_num != y->block_num)
+	return (x->block_num > y->block_num) - (x->block_num < y->block_num);
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/** Whether a copy of @block_num logged by transaction @s was revoked
+ *  by it or a later one
+ */
+static int replay_revoked(const struct replay *rp, const blkno_t block_num,
+			  const uint64_t s)
+{
+    unsigned int lo = 0, hi = rp->n, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo) / 2;
+	if (rp->revokes[mid].block_num < block_num)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    for (; lo < rp->n && rp->revokes[lo].block_num == block_num; lo++)
+	if (rp->revokes[lo].seq >= s)
+	    return 1;
+
+    return 0;
+}
+
+/** A block number a descriptor may name: past the journal, on the disk */
+static int replay_valid(const blkno_t block_num)
+{
+    return block_num < sb.nblocks
+	&& (block_num < sb.journal_start
+	    || block_num >= sb.journal_start + sb.journal_blocks);
+}
+
+/** Walk transaction @s, which starts at ring position *@pos
+ *
+ * Without @apply the checksum is verified and the revoke records are
+ * gathered into @rp; with it the logged copies are written home,
+ * except revoked ones.  Returns 1 and moves *@pos past the commit
+ * block if the transaction is complete, 0 if it is not, or -errno.
+ */
+static int replay_tx(struct replay *rp, const int apply, uint64_t *pos,
+		     const uint64_t s, char *desc, char *data)
+{
+    struct journal_header *h = (struct journal_header *) desc;
+    uint64_t *entries = (uint64_t *) (h + 1);
+    uint64_t p = *pos, walked = 0, sum = JOURNAL_SUM_INIT;
+    unsigned int i;
+
+    for (;;) {
+	if (walked++ >= ring)
+	    return 0;
+	if (disk_read(ring_block(p), desc) < 0)
+	    return -EIO;
+	p = (p + 1) % ring;
+
+	if (h->magic != JOURNAL_MAGIC || h->seq != s)
+	    return 0;
+	if (h->type == JOURNAL_COMMIT)
+	    break;
+	if ((h->type != JOURNAL_DESC && h->type != JOURNAL_REVOKE)
+	    || h->count > per_block)
+	    return 0;
+	sum = journal_sum(sum, desc);
+
+	for (i = 0; i < h->count; i++) {
+	    if (!replay_valid(entries[i]))
+		return 0;
+	    if (h->type == JOURNAL_REVOKE) {
+		if (!apply && replay_add(rp, entries[i], s) < 0)
+		    return -ENOMEM;
+		continue;
+	    }
+
+	    if (walked++ >= ring)
+		return 0;
+	    if (disk_read(ring_block(p), data) < 0)
+		return -EIO;
+	    p = (p + 1) % ring;
+	    sum = journal_sum(sum, data);
+	    if (apply && !replay_revoked(rp, entries[i], s)
+		&& disk_write(entries[i], data) < 0)
+		return -EIO;
+	}
+    }
+
+    if (h->sum != sum)
+	return 0;
+    *pos = p;
+    return 1;
+}
+
+/** Bring the metadata up to date with the journal after a crash
+ *
+ * Runs at mount, after super_load() and before the block cache is
+ * set up.  Complete transactions are written home in order and the
+ * journal is emptied.  Returns the number of transactions replayed,
+ * 0 if the journal was empty, or -errno.  The superblock may have
+ * been among the blocks replayed, so the caller has to read it again
+ * when the result is positive.
+ */
+int journal_replay()
+{
+    struct replay rp = { NULL, 0, 0 };
+    struct journal_header *h;
+    char *desc, *data;
+    uint64_t pos, s, i, n = 0;
+    int torn = 0;
+    int retstat;
+
+    if (sb.journal_blocks == 0)
+	return 0;
+
+    retstat = journal_read_header();
+    if (retstat < 0)
+	return retstat;
+
+    desc = journal_alloc(1);
+    data = journal_alloc(1);
+    if (desc == NULL || data == NULL) {
+	retstat = -ENOMEM;
+	goto out;
+    }
+
+    // find where the complete transactions end, gathering revokes
+    pos = tail;
+    s = tail_seq;
+    while ((retstat = replay_tx(&rp, 0, &pos, s, desc, data)) == 1) {
+	s++;
+	n++;
+    }
+    if (retstat < 0)
+	goto out;
+
+    // a torn transaction after them keeps its sequence number on disk,
+    // so the next one must not reuse it
+    h = (struct journal_header *) desc;
+    if (disk_read(ring_block(pos), desc) >= 0 && h->magic == JOURNAL_MAGIC
+	&& h->seq == s)
+	torn = 1;
+    retstat = 0;
+    if (n == 0 && !torn)
+	goto out;
+
+    qsort(rp.revokes, rp.n, sizeof(struct revoke), revoke_cmp);
+    pos = tail;
+    for (i = 0; i < n; i++) {
+	retstat = replay_tx(&rp, 1, &pos, tail_seq + i, desc, data);
+	if (retstat != 1) {
+	    retstat = retstat < 0 ? retstat : -EIO;
+	    goto out;
+	}
+    }
+
+    retstat = block_sync();
+    if (retstat < 0)
+	goto out;
+    tail = pos;
+    tail_seq = s + torn;
+    retstat = journal_write_header();
+    if (retstat == 0)
+	retstat = block_sync();
+    if (retstat == 0)
+	retstat = n;
+    stats.replayed = n;
+
+out:
+    free(rp.revokes);
+    free(desc);
+    free(data);
+    return retstat;
+}
+
+/** Start journaling metadata writes
+ *
+ * Needs the block cache to hold transactions until they commit, and
+ * the allocator; without either, or when the image has no journal,
+ * metadata is written in place as before.  Returns 0 or -errno.
+ */
+int journal_init()
+{
+    struct cache_stats cs;
+    int retstat;
+
+    if (active || sb.journal_blocks == 0 || !cache_enabled())
+	return 0;
+
+    retstat = journal_read_header();
+    if (retstat < 0)
+	return retstat;
+    head = tail;
+    used = 0;
+    seq = tail_seq;
+
+    // keep three quarters of the cache free of pinned blocks, and
+    // leave room in the ring for the descriptors
+    cache_get_stats(&cs);
+    tx_max = cs.nframes / 4;
+    if (tx_max > ring / 2)
+	tx_max = ring / 2;
+
+    retstat = logged_reset(ring + tx_max);
+    if (retstat < 0)
+	return retstat;
+
+    ntx = 0;
+    nrevoked = 0;
+    nflights = 0;
+    nflight_blocks = 0;
+    flight_deferred = 0;
+    force_checkpoint = 0;
+    committed_sb = sb;
+    active = 1;
+
+    return 0;
+}
+
+int journal_active()
+{
+    return active;
+}
+
+/** Write metadata block @block_num
+ *
+ * Same contract as block_write().  With the journal on, the block
+ * joins the running transaction instead of going home.
+ */
+int journal_write(const blkno_t block_num, const void *buf)
+{
+    blkno_t *grown;
+    int retstat;
+
+    if (!active)
+	return block_write(block_num, buf);
+
+    pthread_mutex_lock(&tx_lock);
+    if (ntx == tx_cap) {
+	grown = realloc(tx, (tx_cap ? 2 * tx_cap : 64) * sizeof(blkno_t));
+	if (grown == NULL) {
+	    pthread_mutex_unlock(&tx_lock);
+	    return -ENOMEM;
+	}
+	tx = grown;
+	tx_cap = tx_cap ? 2 * tx_cap : 64;
+    }
+
+    retstat = cache_write_meta(block_num, buf);
+    if (retstat == 1) {
+	tx[ntx++] = block_num;
+	logged_add(block_num);
+    }
+    pthread_mutex_unlock(&tx_lock);
+
+    return retstat < 0 ? retstat : (int) block_size;
+}
+
+/** Note that blocks [@block_num, +@count) are being freed
+ *
+ * Those with copies in the journal get a revoke record in the running
+ * transaction.
+ */
+void journal_revoke(const blkno_t block_num, const uint64_t count)
+{
+    blkno_t *grown;
+    uint64_t i;
+
+    if (!active)
+	return;
+
+    pthread_mutex_lock(&tx_lock);
+    for (i = 0; i < count; i++) {
+	if (!logged_has(block_num + i))
+	    continue;
+	if (nrevoked == revoked_cap) {
+	    grown = realloc(revoked, (revoked_cap ? 2 * revoked_cap : 64)
+			    * sizeof(blkno_t));
+	    if (grown == NULL) {
+		force_checkpoint = 1;
+		break;
+	    }
+	    revoked = grown;
+	    revoked_cap = revoked_cap ? 2 * revoked_cap : 64;
+	}
+	revoked[nrevoked++] = block_num + i;
+    }
+    pthread_mutex_unlock(&tx_lock);
+}
+
+/** Write @count blocks from @buf to the ring at the head, wrapping */
+static int journal_log(const char *buf, const uint64_t count)
+{
+    uint64_t first = ring - head < count ? ring - head : count;
+    int retstat;
+
+    retstat = block_write_blocks(ring_block(head), first, buf);
+    if (retstat >= 0 && first < count)
+	retstat = block_write_blocks(ring_block(0), count - first,
+				     buf + first * block_size);
+
+    return retstat < 0 ? retstat : 0;
+}
+
+/** Drop the running transaction without logging it, unpinning its
+ *  blocks so they are written in place
+ */
+static void journal_done()
+{
+    unsigned int i;
+
+    for (i = 0; i < ntx; i++) {
+	cache_meta_logged(tx[i]);
+	cache_meta_commit(tx[i]);
+    }
+    pthread_mutex_lock(&tx_lock);
+    ntx = 0;
+    nrevoked = 0;
+    pthread_mutex_unlock(&tx_lock);
+    seq++;
+}
+
+/** Make room to put the running transaction in flight */
+static int journal_flight_reserve()
+{
+    struct flight *f;
+    blkno_t *b;
+    unsigned int cap;
+
+    if (nflights == flights_cap) {
+	cap = flights_cap ? 2 * flights_cap : 8;
+	f = realloc(flights, cap * sizeof(struct flight));
+	if (f == NULL)
+	    return -ENOMEM;
+	flights = f;
+	flights_cap = cap;
+    }
+    if (nflight_blocks + ntx > flight_blocks_cap) {
+	cap = flight_blocks_cap ? flight_blocks_cap : 64;
+	while (cap < nflight_blocks + ntx)
+	    cap *= 2;
+	b = realloc(flight_blocks, cap * sizeof(blkno_t));
+	if (b == NULL)
+	    return -ENOMEM;
+	flight_blocks = b;
+	flight_blocks_cap = cap;
+    }
+
+    return 0;
+}
+
+/** The running transaction is in the ring: keep its blocks pinned
+ *  until it is synced, and start the next one
+ */
+static void journal_fly()
+{
+    struct flight *f = &flights[nflights++];
+    unsigned int i;
+
+    f->seq = seq;
+    f->nblocks = ntx;
+    f->ndeferred = alloc_deferred() - flight_deferred;
+    flight_deferred += f->ndeferred;
+    for (i = 0; i < ntx; i++) {
+	cache_meta_logged(tx[i]);
+	flight_blocks[nflight_blocks++] = tx[i];
+    }
+    pthread_mutex_lock(&tx_lock);
+    ntx = 0;
+    nrevoked = 0;
+    pthread_mutex_unlock(&tx_lock);
+    seq++;
+}
+
+/** Transactions before @upto are durable: let their blocks go home
+ *  and hand out the blocks they freed
+ */
+static void journal_finish(const uint64_t upto)
+{
+    unsigned int i, j, nb = 0, nd = 0;
+
+    for (i = 0; i < nflights && flights[i].seq < upto; i++) {
+	for (j = 0; j < flights[i].nblocks; j++)
+	    cache_meta_commit(flight_blocks[nb + j]);
+	nb += flights[i].nblocks;
+	nd += flights[i].ndeferred;
+    }
+    if (i == 0)
+	return;
+
+    memmove(flights, flights + i, (nflights - i) * sizeof(struct flight));
+    nflights -= i;
+    memmove(flight_blocks, flight_blocks + nb,
+	    (nflight_blocks - nb) * sizeof(blkno_t));
+    nflight_blocks -= nb;
+    flight_deferred -= nd;
+    alloc_free_deferred(nd);
+}
+
+/** Write a transaction too big for the ring straight home
+ *
+ * Only happens if a single operation dirtied more blocks than the
+ * journal holds; that one transaction is then not atomic.
+ */
+static int journal_overflow()
+{
+    int retstat;
+
+    journal_done();
+    stats.overflows++;
+
+    retstat = cache_flush();
+    if (retstat == 0)
+	retstat = block_commit();
+    if (retstat < 0)
+	return retstat;
+    // the checkpoint before this left nothing in flight
+    alloc_free_deferred(alloc_deferred());
+
+    return 1;
+}
+
+/** Write the running transaction to the journal without waiting
+ *
+ * Dirty inodes and the superblock are written into it first so that
+ * it holds a consistent picture of the metadata.  Called under
+ * fs_lock() between operations.  *@upto is set for
+ * journal_commit_finish(), to be called after a block_commit() that
+ * started after this returned.  Returns 1 if a transaction was
+ * logged, 0 if there was nothing to log, or -errno.
+ */
+int journal_commit_start(uint64_t *upto)
+{
+    struct journal_header *h;
+    uint64_t *entries;
+    uint64_t need, total = 0, sum = JOURNAL_SUM_INIT;
+    unsigned int i, j, n, nlog = 0;
+    char *buf;
+    int retstat;
+
+    *upto = seq;
+    if (!active)
+	return 0;
+
+    retstat = icache_flush();
+    if (retstat < 0)
+	return retstat;
+    if (memcmp(&sb, &committed_sb, sizeof(sb)) != 0) {
+	retstat = super_write();
+	if (retstat < 0)
+	    return retstat;
+	committed_sb = sb;
+    }
+    if (ntx == 0 && nrevoked == 0)
+	return 0;
+
+    need = ntx + (ntx + per_block - 1) / per_block
+	+ (nrevoked + per_block - 1) / per_block + 1;
+    if (need > ring - used) {
+	retstat = journal_checkpoint();
+	if (retstat < 0)
+	    return retstat;
+	need = ntx + (ntx + per_block - 1) / per_block
+	    + (nrevoked + per_block - 1) / per_block + 1;
+    }
+    if (need > ring - used) {
+	retstat = journal_overflow();
+	*upto = seq;
+	return retstat;
+    }
+
+    retstat = journal_flight_reserve();
+    if (retstat < 0)
+	return retstat;
+    buf = journal_alloc(need);
+    if (buf == NULL)
+	return -ENOMEM;
+
+    // descriptors, each followed by the copies it names
+    for (i = 0; i < ntx; i = j) {
+	h = (struct journal_header *) (buf + total++ * block_size);
+	entries = (uint64_t *) (h + 1);
+	for (j = i, n = 0; j < ntx && n < per_block; j++) {
+	    if (cache_meta_copy(tx[j], buf + total * block_size) < 0)
+		continue;
+	    entries[n++] = tx[j];
+	    total++;
+	}
+	if (n == 0) {
+	    total--;
+	    continue;
+	}
+	h->magic = JOURNAL_MAGIC;
+	h->type = JOURNAL_DESC;
+	h->seq = seq;
+	h->count = n;
+	nlog += n;
+    }
+
+    for (i = 0; i < nrevoked; i += n) {
+	h = (struct journal_header *) (buf + total++ * block_size);
+	entries = (uint64_t *) (h + 1);
+	n = nrevoked - i < per_block ? nrevoked - i : per_block;
+	memcpy(entries, revoked + i, n * sizeof(blkno_t));
+	h->magic = JOURNAL_MAGIC;
+	h->type = JOURNAL_REVOKE;
+	h->seq = seq;
+	h->count = n;
+    }
+
+    for (i = 0; i < total; i++)
+	sum = journal_sum(sum, buf + i * block_size);
+    h = (struct journal_header *) (buf + total++ * block_size);
+    h->magic = JOURNAL_MAGIC;
+    h->type = JOURNAL_COMMIT;
+    h->seq = seq;
+    h->sum = sum;
+
+    // the copies must be durable before any of them goes home, so
+    // the blocks stay pinned until journal_commit_finish()
+    retstat = journal_log(buf, total);
+    free(buf);
+    if (retstat < 0)
+	return retstat;
+
+    head = (head + total) % ring;
+    used += total;
+    stats.commits++;
+    stats.blocks += nlog;
+    stats.revoked += nrevoked;
+    journal_fly();
+    *upto = seq;
+
+    return 1;
+}
+
+/** The disk file was synced after journal_commit_start() set @upto
+ *
+ * Called under fs_lock().
+ */
+void journal_commit_finish(const uint64_t upto)
+{
+    if (!active)
+	return;
+
+    journal_finish(upto);
+    // a lost revoke record is made up for by emptying the ring before
+    // the freed blocks can be reused
+    if (force_checkpoint && nflights == 0)
+	journal_checkpoint();
+}
+
+/** Commit the running transaction and wait for it to be durable
+ *
+ * Called under fs_lock() between operations.  Returns 1 if a
+ * transaction was committed, 0 if there was nothing to commit, or
+ * -errno.
+ */
+int journal_commit()
+{
+    uint64_t upto;
+    int retstat, err;
+
+    retstat = journal_commit_start(&upto);
+    if (retstat < 0 || nflights == 0)
+	return retstat;
+
+    err = block_commit();
+    if (err < 0)
+	return err;
+    journal_commit_finish(upto);
+
+    return retstat;
+}
+
+/** Empty the ring
+ *
+ * Every logged block still dirty in the cache is written home and
+ * synced, then the replay start moves up to the head.  The running
+ * transaction is left alone.  The new header only has to be durable
+ * by the next commit, whose sync covers it.  Returns 0 or -errno.
+ */
+int journal_checkpoint()
+{
+    unsigned int i, n;
+    int retstat;
+
+    if (!active || (used == 0 && !force_checkpoint))
+	return 0;
+
+    // transactions in flight have to be durable before they go home
+    if (nflights > 0) {
+	retstat = block_commit();
+	if (retstat < 0)
+	    return retstat;
+	journal_finish(seq);
+    }
+
+    retstat = cache_flush();
+    if (retstat == 0)
+	retstat = block_commit();
+    if (retstat < 0)
+	return retstat;
+
+    tail = head;
+    tail_seq = seq;
+    used = 0;
+    retstat = journal_write_header();
+    if (retstat < 0)
+	return retstat;
+
+    // only the running transaction has copies that can end up in the
+    // ring now, and only its revokes still matter
+    retstat = logged_reset(ring + tx_max);
+    if (retstat < 0)
+	return retstat;
+    for (i = 0; i < ntx; i++)
+	logged_insert(tx[i]);
+    for (i = 0, n = 0; i < nrevoked; i++)
+	if (logged_has(revoked[i]))
+	    revoked[n++] = revoked[i];
+    nrevoked = n;
+    force_checkpoint = 0;
+    stats.checkpoints++;
+
+    return 0;
+}
+
+/** Called after every operation, when the metadata is consistent */
+void journal_end()
+{
+    if (active && ntx >= tx_max)
+	journal_commit();
+}
+
+/** Would journal_end() commit?  For callers without the exclusive lock */
+int journal_due()
+{
+    int due;
+
+    if (!active)
+	return 0;
+
+    pthread_mutex_lock(&tx_lock);
+    due = ntx >= tx_max;
+    pthread_mutex_unlock(&tx_lock);
+
+    return due;
+}
+
+/** How full the ring is, in percent */
+unsigned int journal_usage()
+{
+    return active ? used * 100 / ring : 0;
+}
+
+/** Commit and checkpoint everything and stop journaling
+ *
+ * Afterwards metadata writes go straight to the block cache again.
+ * Returns 0 or -errno.
+ */
+int journal_exit()
+{
+    int retstat;
+
+    if (!active)
+	return 0;
+
+    retstat = journal_commit();
+    // the frees it released dirtied the bitmaps again
+    if (retstat >= 0)
+	retstat = journal_commit();
+    if (retstat >= 0)
+	retstat = journal_checkpoint();
+    // whatever could not be logged is written in place from here on
+    journal_finish(seq);
+    journal_done();
+    active = 0;
+    alloc_free_deferred(alloc_deferred());
+
+    free(tx);
+    free(revoked);
+    free(logged);
+    free(flights);
+    free(flight_blocks);
+    tx = NULL;
+    revoked = NULL;
+    logged = NULL;
+    flights = NULL;
+    flight_blocks = NULL;
+    tx_cap = 0;
+    revoked_cap = 0;
+    flights_cap = 0;
+    flight_blocks_cap = 0;
+
+    return retstat < 0 ? retstat : 0;
+}
+
+void journal_get_stats(struct journal_stats *out)
+{
+    *out = stats;
+}
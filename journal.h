@@ -0,0 +1,69 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdint.h>
+
+#include "block.h"
+
+// default size of the journal in a freshly formatted image, in bytes
+#define JOURNAL_DEFAULT_SIZE (4 * 1024 * 1024)
+// smallest journal worth having, in blocks
+#define JOURNAL_MIN_BLOCKS 64
+// how full the journal gets before the flusher checkpoints it, in percent
+#define JOURNAL_CHECKPOINT 50
+
+#define JOURNAL_MAGIC 0x4c4e524a    // "JRNL" on a little-endian disk
+
+// journal block types
+#define JOURNAL_HEADER 1    // first block of the area, where replay starts
+#define JOURNAL_DESC 2      // home block numbers of the copies that follow
+#define JOURNAL_REVOKE 3    // blocks whose older copies must not be replayed
+#define JOURNAL_COMMIT 4    // ends a transaction
+
+/** Start of every journal block that is not a logged copy
+ *
+ * Descriptor and revoke blocks are followed by @count 64-bit block
+ * numbers.
+ */
+struct journal_header {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t seq;       // transaction; in the header, the oldest one to replay
+    uint32_t count;     // block numbers that follow
+    uint32_t tail;      // header only: where that transaction starts
+    uint64_t sum;       // commit only: checksum of the transaction's blocks
+};
+
+struct journal_stats {
+    unsigned long long commits;     // transactions written to the journal
+    unsigned long long blocks;      // metadata blocks logged
+    unsigned long long revoked;     // revoke records written
+    unsigned long long checkpoints; // times the journal was emptied
+    unsigned long long overflows;   // transactions too big to log
+    unsigned long long replayed;    // transactions replayed at mount
+};
+
+int journal_format();
+int journal_replay();
+int journal_init();
+int journal_exit();
+int journal_active();
+int journal_write(const blkno_t block_num, const void *buf);
+void journal_revoke(const blkno_t block_num, const uint64_t count);
+int journal_commit_start(uint64_t *upto);
+void journal_commit_finish(const uint64_t upto);
+int journal_commit();
+int journal_checkpoint();
+void journal_end();
+int journal_due();
+unsigned int journal_usage();
+void journal_get_stats(struct journal_stats *stats);
+
+#endif
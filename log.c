@@ -8,20 +8,68 @@
   datastructures, I want to see *everything* that happens related to
   its data structures.  This file contains macros and functions to
   accomplish this.
+
+  Seeing everything used to mean an fprintf to sfs.log, and the lock
+  on the FILE that comes with it, inside every fuse call.  Now each
+  thread formats its messages into a ring of its own, which only it
+  writes and only the drain thread reads, so logging from the hot path
+  takes no lock.  The drain thread wakes every LOG_DRAIN_INTERVAL ms,
+  or sooner once a ring is half full or an error is logged, merges
+  the rings in time order and writes them out.  A thread whose ring is
+  full waits for it rather than lose the message.  Before log_start()
+  and after log_stop() messages go straight to the file.  The rings
+  are per-thread slots (perthread.c): one outlives its thread until
+  the drain thread has written it out and a new thread takes it over.
 */
 
 #include "params.h"
 
 #include <fuse.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 
 #include "log.h"
+#include "perthread.h"
+
+// what goes into a ring ahead of each message's text
+struct log_record {
+    uint64_t ns;        // when it was logged
+    uint32_t len;       // bytes of text that follow
+    uint32_t level;
+};
+
+struct log_ring {
+    struct perthread pt;
+    uint64_t head;      // bytes ever queued, moved by the owner only
+    uint64_t tail;      // bytes ever written out, moved by the drain thread only
+    uint64_t pos;       // drain thread only: where this pass has got to
+    uint64_t limit;     // drain thread only: head when the pass started
+    char buf[LOG_RING_SIZE];
+};
+
+int log_level = LOG_INFO;
+
+static FILE *log_file = NULL;
+static int running = 0;
+static pthread_t thread;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static int kicked = 0;
+static int stop = 0;
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER; // one log_drain() at a time
+
+static struct perthread_list rings = PERTHREAD_LIST_INIT(struct log_ring);
+static __thread struct log_ring *self = NULL;
 
 FILE *log_open()
 {
@@ -35,24 +83,247 @@ FILE *log_open()
 	exit(EXIT_FAILURE);
     }
     
-    // set logfile to line buffering
-    setvbuf(logfile, NULL, _IOLBF, 0);
+    // fully buffered: the drain thread flushes after every pass, and
+    // log_write() after every message it writes itself
+    setvbuf(logfile, NULL, _IOFBF, 0);
+    log_file = logfile;
 
     return logfile;
 }
 
-void log_msg(const char *format, ...)
+static uint64_t now_ns()
 {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** The calling thread's ring, set up on its first message */
+static struct log_ring *log_self()
+{
+    if (self == NULL)
+	self = perthread_claim(&rings);
+    return self;
+}
+
+static void ring_put(struct log_ring *r, const uint64_t pos, const void *src, const size_t n)
+{
+    size_t off = pos % LOG_RING_SIZE;
+    size_t first = n < LOG_RING_SIZE - off ? n : LOG_RING_SIZE - off;
+
+    memcpy(r->buf + off, src, first);
+    memcpy(r->buf, (const char *) src + first, n - first);
+}
+
+static void ring_get(const struct log_ring *r, const uint64_t pos, void *dst, const size_t n)
+{
+    size_t off = pos % LOG_RING_SIZE;
+    size_t first = n < LOG_RING_SIZE - off ? n : LOG_RING_SIZE - off;
+
+    memcpy(dst, r->buf + off, first);
+    memcpy((char *) dst + first, r->buf, n - first);
+}
+
+/** Wake the drain thread, unless someone already has */
+static void log_kick()
+{
+    if (__atomic_exchange_n(&kicked, 1, __ATOMIC_ACQ_REL))
+	return;
+    pthread_mutex_lock(&drain_lock);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&drain_lock);
+}
+
+/** Write out everything queued in every ring, oldest message first
+ *
+ * Called with write_lock held.
+ */
+static void log_drain()
+{
+    struct log_ring *first = perthread_first(&rings);
+    struct log_ring *r, *best;
+    struct log_record rec, best_rec;
+    size_t off, n;
+
+    for (r = first; r != NULL; r = (struct log_ring *) r->pt.next) {
+	r->pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+	r->limit = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    }
+
+    for (;;) {
+	best = NULL;
+	for (r = first; r != NULL; r = (struct log_ring *) r->pt.next) {
+	    if (r->pos == r->limit)
+		continue;
+	    ring_get(r, r->pos, &rec, sizeof(rec));
+	    if (best == NULL || rec.ns < best_rec.ns) {
+		best = r;
+		best_rec = rec;
+	    }
+	}
+	if (best == NULL)
+	    break;
+
+	off = (best->pos + sizeof(rec)) % LOG_RING_SIZE;
+	n = best_rec.len < LOG_RING_SIZE - off ? best_rec.len : LOG_RING_SIZE - off;
+	fwrite(best->buf + off, 1, n, log_file);
+	fwrite(best->buf, 1, best_rec.len - n, log_file);
+	best->pos += sizeof(rec) + best_rec.len;
+    }
+
+    for (r = first; r != NULL; r = (struct log_ring *) r->pt.next)
+	__atomic_store_n(&r->tail, r->pos, __ATOMIC_RELEASE);
+    fflush(log_file);
+}
+
+static void *log_thread(void *arg)
+{
+    struct timespec ts;
+    int done;
+
+    pthread_mutex_lock(&drain_lock);
+    for (;;) {
+	if (!__atomic_load_n(&kicked, __ATOMIC_ACQUIRE) && !stop) {
+	    clock_gettime(CLOCK_REALTIME, &ts);
+	    ts.tv_nsec += LOG_DRAIN_INTERVAL * 1000000L;
+	    ts.tv_sec += ts.tv_nsec / 1000000000L;
+	    ts.tv_nsec %= 1000000000L;
+	    pthread_cond_timedwait(&wake, &drain_lock, &ts);
+	}
+	__atomic_store_n(&kicked, 0, __ATOMIC_RELEASE);
+	done = stop;
+	pthread_mutex_unlock(&drain_lock);
+
+	pthread_mutex_lock(&write_lock);
+	log_drain();
+	pthread_mutex_unlock(&write_lock);
+
+	pthread_mutex_lock(&drain_lock);
+	pthread_cond_broadcast(&drained);
+	if (done)
+	    break;
+    }
+    pthread_mutex_unlock(&drain_lock);
+
+    return NULL;
+}
+
+/** Hand the log over to the drain thread
+ *
+ * Called from sfs_init(), after fuse has forked us into the
+ * background.  Messages above @level are not logged.  Returns 0, or
+ * -1 if the thread could not be started and logging stays
+ * synchronous.
+ */
+int log_start(FILE *logfile, const int level)
+{
+    log_file = logfile;
+    log_level = level < LOG_VERBOSE ? level : LOG_VERBOSE;
+    if (running || log_file == NULL)
+	return 0;
+
+    stop = 0;
+    if (pthread_create(&thread, NULL, log_thread, NULL) != 0)
+	return -1;
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/** Write out what is queued and stop the drain thread */
+void log_stop()
+{
+    if (!running)
+	return;
+
+    // anything logged from here on goes straight to the file
+    __atomic_store_n(&running, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&drain_lock);
+    stop = 1;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&drain_lock);
+    pthread_join(thread, NULL);
+
+    // a thread that saw running before it was cleared may have queued
+    // after the thread's last pass; log_write() covers the ones after this
+    pthread_mutex_lock(&write_lock);
+    log_drain();
+    pthread_mutex_unlock(&write_lock);
+}
+
+/** Log a message at @level; call it through log_msg() and friends */
+void log_write(const int level, const char *format, ...)
+{
+    struct log_record rec;
+    struct log_ring *r = NULL;
+    char line[LOG_LINE_MAX];
+    struct timespec ts;
+    uint64_t head;
     va_list ap;
+    int n;
+
     va_start(ap, format);
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) || (r = log_self()) == NULL) {
+	if (log_file != NULL) {
+	    vfprintf(log_file, format, ap);
+	    fflush(log_file);
+	}
+	va_end(ap);
+	return;
+    }
+    n = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    if (n < 0)
+	return;
+    if (n >= (int) sizeof(line))
+	n = sizeof(line) - 1;
+
+    rec.ns = now_ns();
+    rec.len = n;
+    rec.level = level;
+    head = r->head;
+
+    // full: wait for the drain thread to make room
+    while (head + sizeof(rec) + n - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > LOG_RING_SIZE) {
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+	    fwrite(line, 1, n, log_file);
+	    fflush(log_file);
+	    return;
+	}
+	log_kick();
+	pthread_mutex_lock(&drain_lock);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += 10 * 1000000L;
+	ts.tv_sec += ts.tv_nsec / 1000000000L;
+	ts.tv_nsec %= 1000000000L;
+	pthread_cond_timedwait(&drained, &drain_lock, &ts);
+	pthread_mutex_unlock(&drain_lock);
+    }
+
+    ring_put(r, head, &rec, sizeof(rec));
+    ring_put(r, head + sizeof(rec), line, n);
+    __atomic_store_n(&r->head, head + sizeof(rec) + n, __ATOMIC_SEQ_CST);
+
+    // log_stop() may have done its last drain before the message was
+    // queued; either it sees the new head or this sees running cleared
+    if (!__atomic_load_n(&running, __ATOMIC_SEQ_CST)) {
+	pthread_mutex_lock(&write_lock);
+	log_drain();
+	pthread_mutex_unlock(&write_lock);
+	return;
+    }
 
-    vfprintf(SFS_DATA->logfile, format, ap);
+    // errors should reach the file soon, and so should a filling ring
+    if (level == LOG_ERROR ||
+	head + sizeof(rec) + n - __atomic_load_n(&r->tail, __ATOMIC_RELAXED) > LOG_RING_SIZE / 2)
+	log_kick();
 }
 
 // fuse context
-void log_fuse_context(struct fuse_context *context)
+void log_dump_fuse_context(struct fuse_context *context)
 {
-    log_msg("    context:\n");
+    log_at(LOG_VERBOSE, "    context:\n");
     
     /** Pointer to the fuse object */
     //	struct fuse *fuse;
@@ -84,9 +355,9 @@ void log_fuse_context(struct fuse_context *context)
 // struct fuse_conn_info contains information about the socket
 // connection being used.  I don't actually use any of this
 // information in sfs
-void log_conn(struct fuse_conn_info *conn)
+void log_dump_conn(struct fuse_conn_info *conn)
 {
-    log_msg("    conn:\n");
+    log_at(LOG_VERBOSE, "    conn:\n");
     
     /** Major version of the protocol (read-only) */
     // unsigned proto_major;
@@ -124,9 +395,9 @@ void log_conn(struct fuse_conn_info *conn)
 // This dumps all the information in a struct fuse_file_info.  The struct
 // definition, and comments, come from /usr/include/fuse/fuse_common.h
 // Duplicated here for convenience.
-void log_fi (struct fuse_file_info *fi)
+void log_dump_fi(struct fuse_file_info *fi)
 {
-    log_msg("    fi:\n");
+    log_at(LOG_VERBOSE, "    fi:\n");
     
     /** Open flags.  Available in open() and release() */
     //	int flags;
@@ -166,9 +437,9 @@ void log_fi (struct fuse_file_info *fi)
 
 // This dumps the info from a struct stat.  The struct is defined in
 // <bits/stat.h>; this is indirectly included from <fcntl.h>
-void log_stat(struct stat *si)
+void log_dump_stat(struct stat *si)
 {
-    log_msg("    si:\n");
+    log_at(LOG_VERBOSE, "    si:\n");
     
     //  dev_t     st_dev;     /* ID of device containing file */
 	log_struct(si, st_dev, %lld, );
@@ -211,9 +482,9 @@ void log_stat(struct stat *si)
 	
 }
 
-void log_statvfs(struct statvfs *sv)
+void log_dump_statvfs(struct statvfs *sv)
 {
-    log_msg("    sv:\n");
+    log_at(LOG_VERBOSE, "    sv:\n");
     
     //  unsigned long  f_bsize;    /* file system block size */
 	log_struct(sv, f_bsize, %ld, );
@@ -250,9 +521,9 @@ void log_statvfs(struct statvfs *sv)
 	
 }
 
-void log_utime(struct utimbuf *buf)
+void log_dump_utime(struct utimbuf *buf)
 {
-    log_msg("    buf:\n");
+    log_at(LOG_VERBOSE, "    buf:\n");
     
     //    time_t actime;
     log_struct(buf, actime, 0x%08lx, );
@@ -9,16 +9,60 @@
 #define _LOG_H_
 #include <stdio.h>
 
+// log levels, each includes the ones above it
+#define LOG_ERROR 0     // something failed
+#define LOG_INFO 1      // mount and unmount summaries
+#define LOG_DEBUG 2     // one line per fuse call
+#define LOG_VERBOSE 3   // dumps of the structs fuse hands us
+
+// highest level compiled in, anything above it costs nothing at all
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_VERBOSE
+#endif
+
+// per-thread ring the hot path formats into, in bytes
+#define LOG_RING_SIZE (64 * 1024)
+// longest message, longer ones are cut off
+#define LOG_LINE_MAX 1024
+// how often the drain thread writes out what is queued, in ms
+#define LOG_DRAIN_INTERVAL 100
+
+// highest level logged at run time, set by -o log_level
+extern int log_level;
+
+#define log_enabled(level) ((level) <= LOG_LEVEL_MAX && (level) <= log_level)
+
+// the arguments are not even evaluated when the level is off
+#define log_at(level, ...) \
+    do { if (log_enabled(level)) log_write(level, __VA_ARGS__); } while (0)
+
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_msg(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
 //  macro to log fields in structs.
 #define log_struct(st, field, format, typecast) \
-  log_msg("    " #field " = " #format "\n", typecast st->field)
+  log_at(LOG_VERBOSE, "    " #field " = " #format "\n", typecast st->field)
+
+#define log_verbose(dump) \
+    do { if (log_enabled(LOG_VERBOSE)) dump; } while (0)
+
+#define log_fuse_context(context) log_verbose(log_dump_fuse_context(context))
+#define log_conn(conn) log_verbose(log_dump_conn(conn))
+#define log_fi(fi) log_verbose(log_dump_fi(fi))
+#define log_stat(si) log_verbose(log_dump_stat(si))
+#define log_statvfs(sv) log_verbose(log_dump_statvfs(sv))
+#define log_utime(buf) log_verbose(log_dump_utime(buf))
 
 FILE *log_open(void);
-void log_conn (struct fuse_conn_info *conn);
-void log_fi (struct fuse_file_info *fi);
-void log_stat(struct stat *si);
-void log_statvfs(struct statvfs *sv);
-void log_utime(struct utimbuf *buf);
+int log_start(FILE *logfile, const int level);
+void log_stop();
+void log_dump_fuse_context(struct fuse_context *context);
+void log_dump_conn(struct fuse_conn_info *conn);
+void log_dump_fi(struct fuse_file_info *fi);
+void log_dump_stat(struct stat *si);
+void log_dump_statvfs(struct statvfs *sv);
+void log_dump_utime(struct utimbuf *buf);
 
-void log_msg(const char *format, ...);
+void log_write(const int level, const char *format, ...);
 #endif
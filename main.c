@@ -0,0 +1,89 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Entry point of sfs: picks the disk file and our options off the
+  command line and hands the rest to fuse_main().
+*/
+
+#include "params.h"
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "options.h"
+#include "sfs.h"
+#include "trace.h"
+
+void sfs_usage()
+{
+    fprintf(stderr, "usage:  sfs [FUSE and mount options] diskFile mountPoint\n");
+    fprintf(stderr, "\nsfs options:\n");
+    options_usage(stderr);
+    abort();
+}
+
+int main(int argc, char *argv[])
+{
+    int fuse_stat;
+    struct sfs_state *sfs_data;
+    struct fuse_args args;
+
+    // sanity checking on the command line
+    if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
+	sfs_usage();
+
+    sfs_data = malloc(sizeof(struct sfs_state));
+    if (sfs_data == NULL) {
+	perror("main calloc");
+	abort();
+    }
+
+    // Pull the diskfile and save it in internal data
+    // sfs_data->diskfile = argv[argc-2];
+    sfs_data->diskfile = realpath(argv[argc-2], NULL);
+    printf("%s\n", sfs_data->diskfile);
+
+    argv[argc-2] = argv[argc-1];
+    argv[argc-1] = NULL;
+    argc--;
+
+    options_defaults(sfs_data);
+
+    args = (struct fuse_args) FUSE_ARGS_INIT(argc, argv);
+    if (options_parse(&args, sfs_data) == -1)
+	sfs_usage();
+
+    // open files outlive their unlink by themselves (see sfs_file_close),
+    // no need for libfuse to hide them behind a rename we don't have
+    fuse_opt_add_arg(&args, "-ohard_remove");
+
+    sfs_data->logfile = log_open();
+
+    // before fuse_main, like the log: the path may be relative
+    if (sfs_data->trace != NULL &&
+	(fuse_stat = trace_open(sfs_data->trace, sfs_data->trace_size)) < 0) {
+	fprintf(stderr, "sfs: cannot trace to %s: %s\n", sfs_data->trace,
+		strerror(-fuse_stat));
+	exit(EXIT_FAILURE);
+    }
+
+    // turn over control to fuse
+    fprintf(stderr, "about to call fuse_main, %s \n", sfs_data->diskfile);
+    fuse_stat = fuse_main(args.argc, args.argv, &sfs_oper, sfs_data);
+    fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
+    fuse_opt_free_args(&args);
+
+    return fuse_stat;
+}
+
+
+
+/* SCP'ED THIS IN */
+
+
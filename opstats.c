@@ -0,0 +1,256 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Per-operation counters and latency histograms.  Every fuse callback
+  is timed from entry, lock wait included, to return.  Each thread
+  that calls in gets its own set of counters, so recording a call
+  touches nothing another thread writes; reading them (opstats_get(),
+  or the /.sfs_stats file) adds up every thread's set.
+
+  Latencies go into log-linear buckets: 8 per power of two, which
+  keeps any percentile within 12.5% of the real value in 2.4K per
+  operation.  The sets are per-thread slots (perthread.c), so a
+  thread's counts stay in the totals after it exits.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "opstats.h"
+#include "perthread.h"
+
+struct op_counts {
+    unsigned long long count;
+    unsigned long long errors;
+    unsigned long long bytes;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long hist[OPSTATS_BUCKETS];
+};
+
+struct opstats_thread {
+    struct perthread pt;
+    struct op_counts ops[OPSTATS_NOPS];
+};
+
+static const char *op_names[OPSTATS_NOPS] = {
+    [OPSTATS_GETATTR] = "getattr",
+    [OPSTATS_FGETATTR] = "fgetattr",
+    [OPSTATS_CREATE] = "create",
+    [OPSTATS_UNLINK] = "unlink",
+    [OPSTATS_OPEN] = "open",
+    [OPSTATS_RELEASE] = "release",
+    [OPSTATS_READ] = "read",
+    [OPSTATS_WRITE] = "write",
+    [OPSTATS_READ_BUF] = "read_buf",
+    [OPSTATS_WRITE_BUF] = "write_buf",
+    [OPSTATS_FLUSH] = "flush",
+    [OPSTATS_FSYNC] = "fsync",
+    [OPSTATS_RMDIR] = "rmdir",
+    [OPSTATS_MKDIR] = "mkdir",
+    [OPSTATS_OPENDIR] = "opendir",
+    [OPSTATS_READDIR] = "readdir",
+    [OPSTATS_RELEASEDIR] = "releasedir",
+};
+
+static struct perthread_list threads = PERTHREAD_LIST_INIT(struct opstats_thread);
+static __thread struct opstats_thread *self = NULL;
+
+/** The calling thread's counters, set up on its first call */
+static struct opstats_thread *opstats_self()
+{
+    if (self == NULL)
+	self = perthread_claim(&threads);
+    return self;
+}
+
+/** Add @n to a counter only this thread writes, but others may read */
+static void bump(unsigned long long *p, const unsigned long long n)
+{
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static unsigned int bucket_of(const unsigned long long ns)
+{
+    unsigned int shift;
+
+    if (ns < (1ULL << OPSTATS_SUB_BITS))
+	return ns;
+
+    shift = 63 - __builtin_clzll(ns);
+    if (shift > OPSTATS_MAX_SHIFT)
+	return OPSTATS_BUCKETS - 1;
+    return ((shift - OPSTATS_SUB_BITS + 1) << OPSTATS_SUB_BITS)
+	| ((ns >> (shift - OPSTATS_SUB_BITS)) & ((1U << OPSTATS_SUB_BITS) - 1));
+}
+
+/** Largest latency that falls in bucket @b */
+static unsigned long long bucket_top(const unsigned int b)
+{
+    unsigned int shift, sub;
+
+    if (b < (1U << OPSTATS_SUB_BITS))
+	return b;
+
+    shift = (b >> OPSTATS_SUB_BITS) + OPSTATS_SUB_BITS - 1;
+    sub = b & ((1U << OPSTATS_SUB_BITS) - 1);
+    return ((((1ULL << OPSTATS_SUB_BITS) + sub + 1) << (shift - OPSTATS_SUB_BITS)) - 1);
+}
+
+static unsigned long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Timestamp to hand to opstats_end() when the call returns */
+unsigned long long opstats_start()
+{
+    return now_ns();
+}
+
+/** Record a call of @op that started at @start and returned @result
+ *
+ * A negative @result counts as an error, a positive one as bytes
+ * moved; every operation but read and write returns 0 on success.
+ */
+void opstats_end(const int op, const unsigned long long start, const long long result)
+{
+    struct opstats_thread *t = opstats_self();
+    struct op_counts *c;
+    unsigned long long ns = now_ns() - start;
+
+    if (t == NULL)
+	return;
+
+    c = &t->ops[op];
+    bump(&c->count, 1);
+    if (result < 0)
+	bump(&c->errors, 1);
+    else
+	bump(&c->bytes, result);
+    bump(&c->total_ns, ns);
+    if (ns > c->max_ns)
+	__atomic_store_n(&c->max_ns, ns, __ATOMIC_RELAXED);
+    bump(&c->hist[bucket_of(ns)], 1);
+}
+
+/** Latency below which @pct per mille of the calls in @hist fell,
+ *  no more than the slowest call @max
+ */
+static unsigned long long percentile(const unsigned long long *hist,
+				     const unsigned long long count,
+				     const unsigned int pct,
+				     const unsigned long long max)
+{
+    unsigned long long want, seen = 0;
+    unsigned int b;
+
+    if (count == 0)
+	return 0;
+
+    want = (count * pct + 999) / 1000;
+    for (b = 0; b < OPSTATS_BUCKETS - 1; b++) {
+	seen += hist[b];
+	if (seen >= want)
+	    break;
+    }
+    return bucket_top(b) < max ? bucket_top(b) : max;
+}
+
+/** Short name of @op, as in the /.sfs_stats table */
+const char *opstats_name(const int op)
+{
+    if (op < 0 || op >= OPSTATS_NOPS)
+	return "?";
+    return op_names[op];
+}
+
+/** Totals for @op over every thread */
+void opstats_get(const int op, struct opstats_summary *s)
+{
+    unsigned long long *hist;
+    struct opstats_thread *t;
+    struct op_counts *c;
+    unsigned long long v;
+    unsigned int b;
+
+    memset(s, 0, sizeof(*s));
+    hist = calloc(OPSTATS_BUCKETS, sizeof(*hist));
+    if (hist == NULL)
+	return;
+
+    for (t = perthread_first(&threads); t != NULL;
+	 t = (struct opstats_thread *) t->pt.next) {
+	c = &t->ops[op];
+	s->count += __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+	s->errors += __atomic_load_n(&c->errors, __ATOMIC_RELAXED);
+	s->bytes += __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+	s->total_ns += __atomic_load_n(&c->total_ns, __ATOMIC_RELAXED);
+	v = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+	if (v > s->max_ns)
+	    s->max_ns = v;
+	for (b = 0; b < OPSTATS_BUCKETS; b++)
+	    hist[b] += __atomic_load_n(&c->hist[b], __ATOMIC_RELAXED);
+    }
+
+    // the buckets were read a moment after the count, go by their sum
+    for (v = 0, b = 0; b < OPSTATS_BUCKETS; b++)
+	v += hist[b];
+    s->p50_ns = percentile(hist, v, 500, s->max_ns);
+    s->p90_ns = percentile(hist, v, 900, s->max_ns);
+    s->p99_ns = percentile(hist, v, 990, s->max_ns);
+    s->p999_ns = percentile(hist, v, 999, s->max_ns);
+    free(hist);
+}
+
+/** Print a table of every operation's counters, times in usec
+ *
+ * Returns the text in a malloc'ed buffer, with its length in *@len,
+ * or NULL when out of memory.
+ */
+char *opstats_text(size_t *len)
+{
+    struct opstats_summary s[OPSTATS_NOPS];
+    size_t size = 128 * (OPSTATS_NOPS + 1);
+    char *text = NULL, *grown;
+    int op, n;
+
+    for (op = 0; op < OPSTATS_NOPS; op++)
+	opstats_get(op, &s[op]);
+
+    for (;;) {
+	grown = realloc(text, size);
+	if (grown == NULL) {
+	    free(text);
+	    return NULL;
+	}
+	text = grown;
+
+	n = snprintf(text, size, "%-10s %10s %8s %14s %10s %10s %10s %10s %10s %10s\n",
+		     "op", "calls", "errors", "bytes", "avg", "p50", "p90", "p99",
+		     "p99.9", "max");
+	for (op = 0; op < OPSTATS_NOPS && (size_t) n < size; op++)
+	    n += snprintf(text + n, size - n,
+			  "%-10s %10llu %8llu %14llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			  op_names[op], s[op].count, s[op].errors, s[op].bytes,
+			  s[op].count ? s[op].total_ns / 1000.0 / s[op].count : 0.0,
+			  s[op].p50_ns / 1000.0, s[op].p90_ns / 1000.0,
+			  s[op].p99_ns / 1000.0, s[op].p999_ns / 1000.0,
+			  s[op].max_ns / 1000.0);
+	if ((size_t) n < size)
+	    break;
+	size *= 2;
+    }
+
+    *len = n;
+    return text;
+}
@@ -0,0 +1,62 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _OPSTATS_H_
+#define _OPSTATS_H_
+
+#include <stddef.h>
+
+// read-only file in the root of the mount that shows the numbers below
+#define OPSTATS_PATH "/.sfs_stats"
+
+// latency buckets: exact below 2^OPSTATS_SUB_BITS ns, then
+// 2^OPSTATS_SUB_BITS buckets per power of two up to 2^OPSTATS_MAX_SHIFT ns
+#define OPSTATS_SUB_BITS 3
+#define OPSTATS_MAX_SHIFT 39    // about 9 minutes, anything slower lands in the last bucket
+#define OPSTATS_BUCKETS ((OPSTATS_MAX_SHIFT - OPSTATS_SUB_BITS + 2) << OPSTATS_SUB_BITS)
+
+// one per fuse operation we implement
+enum opstats_op {
+    OPSTATS_GETATTR,
+    OPSTATS_FGETATTR,
+    OPSTATS_CREATE,
+    OPSTATS_UNLINK,
+    OPSTATS_OPEN,
+    OPSTATS_RELEASE,
+    OPSTATS_READ,
+    OPSTATS_WRITE,
+    OPSTATS_READ_BUF,
+    OPSTATS_WRITE_BUF,
+    OPSTATS_FLUSH,
+    OPSTATS_FSYNC,
+    OPSTATS_RMDIR,
+    OPSTATS_MKDIR,
+    OPSTATS_OPENDIR,
+    OPSTATS_READDIR,
+    OPSTATS_RELEASEDIR,
+    OPSTATS_NOPS
+};
+
+struct opstats_summary {
+    unsigned long long count;
+    unsigned long long errors;      // calls that returned -errno
+    unsigned long long bytes;       // moved by read and write calls
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long long p50_ns;      // percentiles are bucket upper bounds
+    unsigned long long p90_ns;
+    unsigned long long p99_ns;
+    unsigned long long p999_ns;
+};
+
+unsigned long long opstats_start();
+void opstats_end(const int op, const unsigned long long start, const long long result);
+void opstats_get(const int op, struct opstats_summary *summary);
+const char *opstats_name(const int op);
+char *opstats_text(size_t *len);
+
+#endif
@@ -0,0 +1,246 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  The sfs -o options: their defaults, their parsing out of a fuse
+  command line and their usage text.  Shared by sfs itself and by
+  sfsbench, which runs the file system in-process with the same
+  options.
+*/
+
+#include "params.h"
+
+#include <ctype.h>
+#include <fuse.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "cache.h"
+#include "dcache.h"
+#include "flusher.h"
+#include "icache.h"
+#include "journal.h"
+#include "log.h"
+#include "options.h"
+#include "readahead.h"
+#include "super.h"
+#include "trace.h"
+#include "wbuf.h"
+
+/** Print the -o options to @out, one per line */
+void options_usage(FILE *out)
+{
+    fprintf(out, "    -o cache_size=SIZE     block cache size in bytes, K/M/G suffixes ok (default 8M, 0 disables)\n");
+    fprintf(out, "    -o dcache_size=N       number of paths in the dentry cache (default 64K, 0 disables)\n");
+    fprintf(out, "    -o icache_size=N       number of inodes kept in memory (default 16K, 0 disables)\n");
+    fprintf(out, "    -o wbuf_size=SIZE      memory for buffering small writes (default 4M, 0 disables)\n");
+    fprintf(out, "    -o dirty_background=N  percent of the block cache dirty before background write-back (default 10)\n");
+    fprintf(out, "    -o dirty_limit=N       percent dirty at which writers wait for write-back (default 40)\n");
+    fprintf(out, "    -o dirty_expire=SECS   longest time data stays dirty in memory (default 5)\n");
+    fprintf(out, "    -o commit_window=USEC  time an fsync waits to share its disk flush (default 500)\n");
+    fprintf(out, "    -o readahead=SIZE      largest readahead window per open file (default 1M, 0 disables)\n");
+    fprintf(out, "    -o io_uring            batch multi-block disk I/O through io_uring\n");
+    fprintf(out, "    -o mmap                memory-map the disk file (turns the block cache off)\n");
+    fprintf(out, "    -o o_direct            bypass the host page cache for the disk file\n");
+    fprintf(out, "    -o max_write=SIZE      largest write request (default: as large as fuse allows)\n");
+    fprintf(out, "    -o max_readahead=SIZE  largest kernel readahead (default: the kernel's limit)\n");
+    fprintf(out, "    -o sync_read           one read request at a time per file\n");
+    fprintf(out, "    -o no_big_writes       one page per write request\n");
+    fprintf(out, "    -o no_splice           don't splice data through the fuse device\n");
+    fprintf(out, "    -o log_level=N         0 errors, 1 summaries, 2 every call, 3 struct dumps (default 1)\n");
+    fprintf(out, "    -o trace=FILE          record every call in FILE, for sfstrace\n");
+    fprintf(out, "    -o trace_size=SIZE     size of the trace file (default 64M)\n");
+    fprintf(out, "\nformat options, used only when the disk file is empty:\n");
+    fprintf(out, "    -o block_size=SIZE     block size, a power of two from 512 to 64K (default 4K)\n");
+    fprintf(out, "    -o fs_size=SIZE        file system size (default 64M)\n");
+    fprintf(out, "    -o journal_size=SIZE   metadata journal size (default 4M, 0 for none)\n");
+}
+
+enum {
+    SFS_KEY_CACHE_SIZE,
+    SFS_KEY_DCACHE_SIZE,
+    SFS_KEY_ICACHE_SIZE,
+    SFS_KEY_BLOCK_SIZE,
+    SFS_KEY_FS_SIZE,
+    SFS_KEY_MAX_WRITE,
+    SFS_KEY_MAX_READAHEAD,
+    SFS_KEY_READAHEAD,
+    SFS_KEY_WBUF_SIZE,
+    SFS_KEY_DIRTY_BACKGROUND,
+    SFS_KEY_DIRTY_LIMIT,
+    SFS_KEY_DIRTY_EXPIRE,
+    SFS_KEY_COMMIT_WINDOW,
+    SFS_KEY_JOURNAL_SIZE,
+    SFS_KEY_LOG_LEVEL,
+    SFS_KEY_TRACE_SIZE,
+};
+
+#define SFS_OPT(t, p, v) { t, offsetof(struct sfs_state, p), v }
+
+static struct fuse_opt sfs_opts[] = {
+    FUSE_OPT_KEY("cache_size=", SFS_KEY_CACHE_SIZE),
+    FUSE_OPT_KEY("dcache_size=", SFS_KEY_DCACHE_SIZE),
+    FUSE_OPT_KEY("icache_size=", SFS_KEY_ICACHE_SIZE),
+    FUSE_OPT_KEY("block_size=", SFS_KEY_BLOCK_SIZE),
+    FUSE_OPT_KEY("fs_size=", SFS_KEY_FS_SIZE),
+    FUSE_OPT_KEY("max_write=", SFS_KEY_MAX_WRITE),
+    FUSE_OPT_KEY("max_readahead=", SFS_KEY_MAX_READAHEAD),
+    FUSE_OPT_KEY("readahead=", SFS_KEY_READAHEAD),
+    FUSE_OPT_KEY("wbuf_size=", SFS_KEY_WBUF_SIZE),
+    FUSE_OPT_KEY("dirty_background=", SFS_KEY_DIRTY_BACKGROUND),
+    FUSE_OPT_KEY("dirty_limit=", SFS_KEY_DIRTY_LIMIT),
+    FUSE_OPT_KEY("dirty_expire=", SFS_KEY_DIRTY_EXPIRE),
+    FUSE_OPT_KEY("commit_window=", SFS_KEY_COMMIT_WINDOW),
+    FUSE_OPT_KEY("journal_size=", SFS_KEY_JOURNAL_SIZE),
+    FUSE_OPT_KEY("log_level=", SFS_KEY_LOG_LEVEL),
+    FUSE_OPT_KEY("trace_size=", SFS_KEY_TRACE_SIZE),
+    SFS_OPT("trace=%s", trace, 0),
+    SFS_OPT("io_uring", io_uring, 1),
+    SFS_OPT("mmap", mmap, 1),
+    SFS_OPT("o_direct", o_direct, 1),
+    SFS_OPT("sync_read", sync_read, 1),
+    SFS_OPT("no_big_writes", no_big_writes, 1),
+    SFS_OPT("no_splice", no_splice, 1),
+    FUSE_OPT_END
+};
+
+/** Parse a byte count with an optional K, M or G suffix */
+int options_parse_size(const char *str, unsigned long *size)
+{
+    char *end;
+    unsigned long val;
+
+    val = strtoul(str, &end, 10);
+    if (end == str)
+	return -1;
+
+    switch (toupper(*end)) {
+    case 'G':
+	val <<= 10;
+	/* fall through */
+    case 'M':
+	val <<= 10;
+	/* fall through */
+    case 'K':
+	val <<= 10;
+	end++;
+    }
+    if (*end != '\0')
+	return -1;
+
+    *size = val;
+    return 0;
+}
+
+/** Pick our own -o options out of the command line
+ *
+ * Returns 0 to drop the option, 1 to hand it on to fuse, or -1 on a
+ * malformed value.
+ */
+static int sfs_opt_proc(void *data, const char *arg, int key,
+			struct fuse_args *outargs)
+{
+    struct sfs_state *sfs_data = data;
+    unsigned long *size;
+
+    switch (key) {
+    case SFS_KEY_CACHE_SIZE:
+	size = &sfs_data->cache_size;
+	break;
+    case SFS_KEY_DCACHE_SIZE:
+	size = &sfs_data->dcache_size;
+	break;
+    case SFS_KEY_ICACHE_SIZE:
+	size = &sfs_data->icache_size;
+	break;
+    case SFS_KEY_BLOCK_SIZE:
+	size = &sfs_data->block_size;
+	break;
+    case SFS_KEY_FS_SIZE:
+	size = &sfs_data->fs_size;
+	break;
+    case SFS_KEY_MAX_WRITE:
+	size = &sfs_data->max_write;
+	break;
+    case SFS_KEY_MAX_READAHEAD:
+	size = &sfs_data->max_readahead;
+	break;
+    case SFS_KEY_READAHEAD:
+	size = &sfs_data->readahead_max;
+	break;
+    case SFS_KEY_WBUF_SIZE:
+	size = &sfs_data->wbuf_size;
+	break;
+    case SFS_KEY_DIRTY_BACKGROUND:
+	size = &sfs_data->dirty_background;
+	break;
+    case SFS_KEY_DIRTY_LIMIT:
+	size = &sfs_data->dirty_limit;
+	break;
+    case SFS_KEY_DIRTY_EXPIRE:
+	size = &sfs_data->dirty_expire;
+	break;
+    case SFS_KEY_COMMIT_WINDOW:
+	size = &sfs_data->commit_window;
+	break;
+    case SFS_KEY_JOURNAL_SIZE:
+	size = &sfs_data->journal_size;
+	break;
+    case SFS_KEY_LOG_LEVEL:
+	size = &sfs_data->log_level;
+	break;
+    case SFS_KEY_TRACE_SIZE:
+	size = &sfs_data->trace_size;
+	break;
+    default:
+	return 1;
+    }
+
+    if (options_parse_size(strchr(arg, '=') + 1, size) < 0) {
+	fprintf(stderr, "sfs: bad option \"%s\"\n", arg);
+	return -1;
+    }
+
+    return 0;
+}
+
+/** Fill @state with the defaults of every option */
+void options_defaults(struct sfs_state *state)
+{
+    state->cache_size = CACHE_DEFAULT_SIZE;
+    state->dcache_size = DCACHE_DEFAULT_ENTRIES;
+    state->icache_size = ICACHE_DEFAULT_ENTRIES;
+    state->io_uring = 0;
+    state->mmap = 0;
+    state->o_direct = 0;
+    state->max_write = 0;
+    state->max_readahead = 0;
+    state->readahead_max = READAHEAD_DEFAULT_MAX;
+    state->wbuf_size = WBUF_DEFAULT_SIZE;
+    state->dirty_background = FLUSHER_DEFAULT_BACKGROUND;
+    state->dirty_limit = FLUSHER_DEFAULT_LIMIT;
+    state->dirty_expire = FLUSHER_DEFAULT_EXPIRE;
+    state->commit_window = BLOCK_COMMIT_WINDOW;
+    state->sync_read = 0;
+    state->no_big_writes = 0;
+    state->no_splice = 0;
+    state->block_size = SFS_DEFAULT_BLOCK_SIZE;
+    state->fs_size = SFS_DEFAULT_FS_SIZE;
+    state->journal_size = JOURNAL_DEFAULT_SIZE;
+    state->log_level = LOG_INFO;
+    state->trace = NULL;
+    state->trace_size = TRACE_DEFAULT_SIZE;
+}
+
+/** Take our own -o options out of @args and into @state
+ *
+ * Returns 0, or -1 on an unknown option syntax or a malformed value.
+ */
+int options_parse(struct fuse_args *args, struct sfs_state *state)
+{
+    return fuse_opt_parse(args, state, sfs_opts, sfs_opt_proc);
+}
@@ -0,0 +1,21 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _OPTIONS_H_
+#define _OPTIONS_H_
+
+#include "params.h"
+
+#include <stdio.h>
+#include <fuse.h>
+
+void options_defaults(struct sfs_state *state);
+int options_parse(struct fuse_args *args, struct sfs_state *state);
+int options_parse_size(const char *str, unsigned long *size);
+void options_usage(FILE *out);
+
+#endif
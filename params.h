@@ -26,6 +26,29 @@
 struct sfs_state {
     FILE *logfile;
     char *diskfile;
+    unsigned long cache_size;   // bytes of block cache, 0 disables it
+    unsigned long dcache_size;  // entries in the dentry cache, 0 disables it
+    unsigned long icache_size;  // inodes in the inode cache, 0 disables it
+    unsigned long wbuf_size;    // bytes of buffered small writes, 0 disables it
+    unsigned long dirty_background; // % of the block cache dirty before write-back starts
+    unsigned long dirty_limit;  // % of the block cache dirty at which writers wait
+    unsigned long dirty_expire; // seconds before dirty data is written back
+    unsigned long commit_window; // microseconds an fsync waits to share its fdatasync
+    int io_uring;               // use the io_uring backend if the kernel has it
+    int mmap;                   // map the whole disk file instead of pread/pwrite
+    int o_direct;               // open the disk file with O_DIRECT
+    unsigned long max_write;    // cap on bytes per write request, 0 for the most fuse allows
+    unsigned long max_readahead; // cap on kernel readahead in bytes, 0 for the kernel's limit
+    unsigned long readahead_max; // cap on a file's readahead window in bytes, 0 disables it
+    int sync_read;              // don't let the kernel issue reads concurrently
+    int no_big_writes;          // keep the kernel at one page per write request
+    int no_splice;              // don't ask for splice on the fuse device
+    unsigned long block_size;   // block size to format an empty disk file with
+    unsigned long fs_size;      // and its size in bytes
+    unsigned long journal_size; // and its metadata journal in bytes, 0 for none
+    unsigned long log_level;    // highest LOG_* level written to sfs.log
+    char *trace;                // file to record every call in, NULL for none
+    unsigned long trace_size;   // and its size in bytes
 };
 #define SFS_DATA ((struct sfs_state *) fuse_get_context()->private_data)
 
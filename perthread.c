@@ -0,0 +1,69 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Per-thread slots for the logger's rings and the operation counters.
+  Each fuse worker gets a slot of its own the first time it needs one,
+  so the hot path writes memory no other thread writes.  A slot
+  outlives its thread, since what it holds may still count (counters)
+  or still have to be written out (log messages); the next new thread
+  takes it over instead of growing the list.  Slots are never freed,
+  so readers can walk the list without the lock.
+*/
+
+#include <stdlib.h>
+
+#include "perthread.h"
+
+static void perthread_release(void *arg)
+{
+    struct perthread *p = arg;
+
+    __atomic_store_n(&p->owned, 0, __ATOMIC_RELEASE);
+}
+
+/** A slot of @list for the calling thread: one given up by a thread
+ *  that has exited, or else a new zeroed one
+ *
+ * Callers keep the result in a __thread variable and only come here
+ * once per thread.  Returns NULL when out of memory.
+ */
+void *perthread_claim(struct perthread_list *list)
+{
+    struct perthread *p;
+
+    pthread_mutex_lock(&list->lock);
+    if (!list->keyed) {
+	if (pthread_key_create(&list->key, perthread_release) != 0) {
+	    pthread_mutex_unlock(&list->lock);
+	    return NULL;
+	}
+	list->keyed = 1;
+    }
+    for (p = list->head; p != NULL; p = p->next)
+	if (!__atomic_load_n(&p->owned, __ATOMIC_ACQUIRE))
+	    break;
+    if (p == NULL) {
+	p = calloc(1, list->size);
+	if (p != NULL) {
+	    p->next = list->head;
+	    // readers walk the list without the lock
+	    __atomic_store_n(&list->head, p, __ATOMIC_RELEASE);
+	}
+    }
+    if (p != NULL)
+	p->owned = 1;
+    pthread_mutex_unlock(&list->lock);
+
+    if (p != NULL)
+	pthread_setspecific(list->key, p);
+    return p;
+}
+
+/** Newest slot of @list, to walk through ->next without the lock */
+void *perthread_first(struct perthread_list *list)
+{
+    return __atomic_load_n(&list->head, __ATOMIC_ACQUIRE);
+}
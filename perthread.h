@@ -0,0 +1,35 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _PERTHREAD_H_
+#define _PERTHREAD_H_
+
+#include <pthread.h>
+#include <stddef.h>
+
+/** Start of every per-thread slot, which embeds it as its first member */
+struct perthread {
+    struct perthread *next;
+    int owned;          // a live thread uses this slot
+};
+
+/** Every slot handed out for one purpose, newest first */
+struct perthread_list {
+    struct perthread *head;
+    pthread_mutex_t lock;
+    pthread_key_t key;  // releases a thread's slot when it exits
+    int keyed;
+    size_t size;        // of the slots, zeroed when first handed out
+};
+
+#define PERTHREAD_LIST_INIT(type) \
+    { NULL, PTHREAD_MUTEX_INITIALIZER, 0, 0, sizeof(type) }
+
+void *perthread_claim(struct perthread_list *list);
+void *perthread_first(struct perthread_list *list);
+
+#endif
@@ -0,0 +1,252 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Asynchronous readahead into the block cache.  Runs of blocks are
+  queued in a ring and read from the disk file by a single thread;
+  the block cache itself is only touched by the caller's thread,
+  which installs finished runs with readahead_reap().
+
+  Data read while the same blocks were being written would be stale,
+  so every write that reaches the disk file cancels overlapping runs
+  (readahead_cancel()) and they are dropped instead of installed.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "block.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "holemap.h"
+#include "readahead.h"
+
+enum {
+    RA_FREE,
+    RA_QUEUED,
+    RA_READING,
+    RA_DONE,
+    RA_FILLING,
+};
+
+struct ra_run {
+    blkno_t block_num;
+    int count;
+    int state;
+    int stale;          // blocks were written after the run was queued
+    int res;            // 0 or -errno from the read
+    char *buf;
+};
+
+static struct ra_run runs[READAHEAD_QUEUE];
+static char *slab = NULL;
+static int chunk_blocks = 0;    // most blocks in one run
+static int head = 0;            // next slot to queue into
+static int tail = 0;            // next slot for the thread to read
+static int ndone = 0;           // runs waiting for readahead_reap()
+static int stop = 0;
+static pthread_t thread;
+static pthread_mutex_t ra_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+static struct readahead_stats stats;
+
+static void *readahead_thread(void *arg)
+{
+    struct ra_run *r;
+    int res;
+
+    pthread_mutex_lock(&ra_lock);
+    for (;;) {
+	while (!stop && runs[tail].state != RA_QUEUED)
+	    pthread_cond_wait(&ra_cond, &ra_lock);
+	if (stop)
+	    break;
+
+	r = &runs[tail];
+	tail = (tail + 1) % READAHEAD_QUEUE;
+	r->state = RA_READING;
+	if (!r->stale) {
+	    pthread_mutex_unlock(&ra_lock);
+	    res = disk_read_blocks(r->block_num, r->count, r->buf);
+	    pthread_mutex_lock(&ra_lock);
+	    r->res = res;
+	}
+	r->state = RA_DONE;
+	__atomic_add_fetch(&ndone, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&ra_lock);
+
+    return NULL;
+}
+
+/** Start the readahead thread
+ *
+ * Only useful with the block cache enabled.  Returns 0 or -errno.
+ */
+int readahead_init()
+{
+    size_t chunk;
+    int i;
+
+    if (slab != NULL)
+	return 0;
+
+    chunk = READAHEAD_CHUNK > block_size ? READAHEAD_CHUNK : block_size;
+    chunk_blocks = chunk >> block_shift;
+    // aligned so that the reads also work on an O_DIRECT disk file
+    if (posix_memalign((void **) &slab, BUFPOOL_ALIGN, READAHEAD_QUEUE * chunk) != 0) {
+	slab = NULL;
+	return -ENOMEM;
+    }
+    for (i = 0; i < READAHEAD_QUEUE; i++) {
+	runs[i].state = RA_FREE;
+	runs[i].buf = slab + i * chunk;
+    }
+    head = tail = ndone = stop = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    if (pthread_create(&thread, NULL, readahead_thread, NULL) != 0) {
+	free(slab);
+	slab = NULL;
+	return -EAGAIN;
+    }
+
+    return 0;
+}
+
+/** Stop the thread and forget whatever was still queued */
+void readahead_exit()
+{
+    if (slab == NULL)
+	return;
+
+    pthread_mutex_lock(&ra_lock);
+    stop = 1;
+    pthread_cond_signal(&ra_cond);
+    pthread_mutex_unlock(&ra_lock);
+    pthread_join(thread, NULL);
+
+    free(slab);
+    slab = NULL;
+}
+
+int readahead_active()
+{
+    return slab != NULL;
+}
+
+/** Queue blocks [@block_num, +@count) to be read into the block cache
+ *
+ * Blocks that are cached already or sit in a hole of the disk file
+ * are skipped at the front of each run.  Never blocks: when the ring
+ * is full the rest of the request is dropped.  The cache is looked
+ * at without ra_lock, which a cache eviction takes on its way to
+ * readahead_cancel().
+ */
+void readahead_submit(blkno_t block_num, int count)
+{
+    struct ra_run *r;
+    int n;
+
+    if (slab == NULL)
+	return;
+
+    while (count > 0) {
+	if (cache_peek(block_num, NULL) >= 0
+	    || holemap_is_hole(block_offset(block_num), block_size)) {
+	    block_num++;
+	    count--;
+	    continue;
+	}
+
+	pthread_mutex_lock(&ra_lock);
+	r = &runs[head];
+	if (r->state != RA_FREE) {
+	    stats.full++;
+	    pthread_mutex_unlock(&ra_lock);
+	    break;
+	}
+	n = count < chunk_blocks ? count : chunk_blocks;
+	r->block_num = block_num;
+	r->count = n;
+	r->stale = 0;
+	r->res = 0;
+	r->state = RA_QUEUED;
+	head = (head + 1) % READAHEAD_QUEUE;
+	stats.runs++;
+	pthread_cond_signal(&ra_cond);
+	pthread_mutex_unlock(&ra_lock);
+
+	block_num += n;
+	count -= n;
+    }
+}
+
+/** Install finished runs in the block cache
+ *
+ * Blocks the cache already holds keep the cached copy, which may be
+ * newer.  The lock is dropped while filling since evicting a dirty
+ * frame to make room ends up in readahead_cancel().
+ */
+void readahead_reap()
+{
+    struct ra_run *r;
+    int i, j, filled;
+
+    if (slab == NULL || __atomic_load_n(&ndone, __ATOMIC_ACQUIRE) == 0)
+	return;
+
+    pthread_mutex_lock(&ra_lock);
+    for (i = 0; i < READAHEAD_QUEUE; i++) {
+	r = &runs[i];
+	if (r->state != RA_DONE)
+	    continue;
+	r->state = RA_FILLING;
+	pthread_mutex_unlock(&ra_lock);
+
+	filled = 0;
+	for (j = 0; j < r->count; j++)
+	    if (!r->stale && r->res >= 0
+		&& cache_fill(r->block_num + j, r->buf + ((size_t) j << block_shift)))
+		filled++;
+
+	pthread_mutex_lock(&ra_lock);
+	stats.blocks += filled;
+	stats.dropped += r->count - filled;
+	r->state = RA_FREE;
+	__atomic_sub_fetch(&ndone, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&ra_lock);
+}
+
+/** Blocks [@block_num, +@count) were written to the disk file, so
+ *  any readahead of them is out of date
+ */
+void readahead_cancel(const blkno_t block_num, const int count)
+{
+    struct ra_run *r;
+    int i;
+
+    if (slab == NULL)
+	return;
+
+    pthread_mutex_lock(&ra_lock);
+    for (i = 0; i < READAHEAD_QUEUE; i++) {
+	r = &runs[i];
+	if (r->state != RA_FREE && r->block_num < block_num + count
+	    && block_num < r->block_num + r->count)
+	    r->stale = 1;
+    }
+    pthread_mutex_unlock(&ra_lock);
+}
+
+void readahead_get_stats(struct readahead_stats *out)
+{
+    pthread_mutex_lock(&ra_lock);
+    *out = stats;
+    pthread_mutex_unlock(&ra_lock);
+}
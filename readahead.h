@@ -0,0 +1,34 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include "block.h"
+
+// default cap on a file's readahead window, in bytes
+#define READAHEAD_DEFAULT_MAX (1024 * 1024)
+// runs queued or in flight at once, and the most bytes in one run
+#define READAHEAD_QUEUE 32
+#define READAHEAD_CHUNK (128 * 1024)
+
+struct readahead_stats {
+    unsigned long long runs;        // runs handed to the readahead thread
+    unsigned long long blocks;      // blocks that made it into the block cache
+    unsigned long long dropped;     // blocks read but already cached or overwritten
+    unsigned long long full;        // runs turned away because the queue was full
+};
+
+int readahead_init();
+void readahead_exit();
+int readahead_active();
+void readahead_submit(const blkno_t block_num, int count);
+void readahead_reap();
+void readahead_cancel(const blkno_t block_num, const int count);
+void readahead_get_stats(struct readahead_stats *stats);
+
+#endif
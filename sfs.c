@@ -9,17 +9,36 @@
 
 #include "params.h"
 #include "block.h"
+#include "alloc.h"
+#include "bitops.h"
+#include "cache.h"
+#include "dcache.h"
+#include "dir.h"
+#include "extent.h"
+#include "file.h"
+#include "flusher.h"
+#include "icache.h"
+#include "inode.h"
+#include "journal.h"
+#include "opstats.h"
+#include "readahead.h"
+#include "sfs.h"
+#include "super.h"
+#include "trace.h"
+#include "wbuf.h"
 
-#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -36,6 +55,46 @@
 // come indirectly from /usr/include/fuse.h
 //
 
+/** Ask the kernel for the largest requests and the capabilities we use
+ *
+ * libfuse hands us what the kernel offered: max_write as large as its
+ * own buffer allows and max_readahead at the kernel's limit, so they
+ * only ever come down here, to whatever the mount options cap them at.
+ * Without big_writes the kernel still splits writes into single pages
+ * whatever max_write says.
+ */
+static void sfs_negotiate(struct sfs_state *state, struct fuse_conn_info *conn)
+{
+    if (state->max_write && state->max_write < conn->max_write)
+	conn->max_write = state->max_write;
+    if (state->max_readahead && state->max_readahead < conn->max_readahead)
+	conn->max_readahead = state->max_readahead;
+
+    // read requests never touch shared state outside the caches,
+    // let several of them be in flight at once
+    if (state->sync_read) {
+	conn->async_read = 0;
+	conn->want &= ~FUSE_CAP_ASYNC_READ;
+    } else if (conn->capable & FUSE_CAP_ASYNC_READ) {
+	conn->async_read = 1;
+	conn->want |= FUSE_CAP_ASYNC_READ;
+    }
+
+    if (state->no_big_writes)
+	conn->want &= ~FUSE_CAP_BIG_WRITES;
+    else
+	conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+
+    // read_buf and write_buf move data as fd buffers, splice them
+    if (state->no_splice)
+	conn->want &= ~(FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE |
+			FUSE_CAP_SPLICE_MOVE);
+    else
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ |
+				       FUSE_CAP_SPLICE_WRITE |
+				       FUSE_CAP_SPLICE_MOVE);
+}
+
 /**
  * Initialize filesystem
  *
@@ -48,48 +107,88 @@
  */
 void *sfs_init(struct fuse_conn_info *conn)
 {
+    struct sfs_state *state = SFS_DATA;
+    char *path = state->diskfile;
+    int retstat;
+
     fprintf(stderr, "in bb-init\n");
 
+    if (log_start(state->logfile, state->log_level) < 0)
+	fprintf(stderr, "sfs: log thread could not be started, logging synchronously\n");
     log_msg("\nsfs_init()\n");
-    struct sfs_state* state = SFS_DATA;
-    struct stat temp;
-    struct fuse_file_info file_info; 
-    char* path;
-    path = SFS_DATA->diskfile;
-    //disk open using sfs->state
-    //opendir on path
-    //
-
-    // int fd;
-    // if((fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IXGRP | S_IWGRP | S_IROTH | S_IWOTH | S_IXOTH)) < 0){
-    //   //error
-    // }
-
-    log_msg("path: \t %s\n", path);
-    
-    disk_open(path);
-   
-    
-    fprintf(stderr, "here\n");
+    log_info("path: \t %s\n", path);
+
+    block_commit_window(state->commit_window);
+    disk_open(path, (state->io_uring ? DISK_IO_URING : 0) |
+	      (state->mmap ? DISK_MMAP : 0) |
+	      (state->o_direct ? DISK_DIRECT : 0));
     log_msg("successfully opened file\n");
 
+    retstat = super_load(state->block_size, state->fs_size, state->journal_size);
+    // replay may have rewritten the superblock too
+    if (retstat == 0 && (retstat = journal_replay()) > 0) {
+	log_info("journal: replayed %d transactions\n", retstat);
+	retstat = super_load(state->block_size, state->fs_size, state->journal_size);
+    }
+    if (retstat < 0) {
+	log_error("cannot load superblock: %s\n", strerror(-retstat));
+	fprintf(stderr, "sfs: %s is not a usable sfs image: %s\n",
+		path, strerror(-retstat));
+	log_stop();
+	exit(EXIT_FAILURE);
+    }
+    log_info("block size %u, %llu blocks\n", sb.block_size,
+	     (unsigned long long) sb.nblocks);
 
-    char biscuit[10] = "biscuit";
-    block_write(1, (void*) biscuit);
-    disk_close();
-    log_msg("successful\n");
-    
-    
-    fprintf(stdout, "path: \t %s\n", (SFS_DATA)->diskfile);
+    // the page cache already holds a mapped disk file, don't copy it again
+    if (disk_mapped())
+	log_info("disk file is memory-mapped, block cache off\n");
+    else if (cache_init(state->cache_size) < 0)
+	log_error("block cache disabled, could not allocate %lu bytes\n",
+		  state->cache_size);
+    else
+	log_info("block cache: %lu bytes\n", state->cache_size);
 
-    // sfs_opendir(path, &file_info);
-    // sfs_getattr(path, &temp );
+    retstat = alloc_init();
+    if (retstat < 0) {
+	log_error("cannot load allocation bitmaps: %s\n", strerror(-retstat));
+	fprintf(stderr, "sfs: %s: %s\n", path, strerror(-retstat));
+	log_stop();
+	exit(EXIT_FAILURE);
+    }
+    log_info("%llu free blocks, %llu free inodes\n",
+	     (unsigned long long) sb.free_blocks,
+	     (unsigned long long) sb.free_inodes);
+    log_info("bitmap scan: %s\n", bitops_impl());
+
+    retstat = journal_init();
+    if (retstat < 0)
+	log_error("metadata journal disabled: %s\n", strerror(-retstat));
+    else if (journal_active())
+	log_info("metadata journal: %llu blocks\n",
+		 (unsigned long long) sb.journal_blocks);
 
+    if (dcache_init(state->dcache_size) < 0)
+	log_error("dentry cache disabled, could not allocate %lu entries\n",
+		  state->dcache_size);
+    if (icache_init(state->icache_size) < 0)
+	log_error("inode cache disabled, could not allocate %lu entries\n",
+		  state->icache_size);
+    if (wbuf_init(state->wbuf_size) < 0)
+	log_error("write buffering disabled, could not allocate it\n");
+    if (cache_enabled() && state->readahead_max > 0 && readahead_init() < 0)
+	log_error("readahead thread could not be started\n");
+    if (cache_enabled() && flusher_init(state->dirty_background, state->dirty_limit,
+					state->dirty_expire) < 0)
+	log_error("flusher thread could not be started\n");
+    if (trace_active())
+	log_info("tracing every call to %s\n", state->trace);
 
+    sfs_negotiate(state, conn);
     log_conn(conn);
     log_fuse_context(fuse_get_context());
 
-    return SFS_DATA;
+    return state;
 }
 
 /**
@@ -101,7 +200,360 @@ void *sfs_init(struct fuse_conn_info *conn)
  */
 void sfs_destroy(void *userdata)
 {
+    struct cache_stats cs;
+    struct dcache_stats ds;
+    struct icache_stats is;
+    struct readahead_stats rs;
+    struct wbuf_stats ws;
+    struct flusher_stats fs;
+    struct commit_stats ms;
+    struct journal_stats js;
+    struct trace_stats ts;
+
     log_msg("\nsfs_destroy(userdata=0x%08x)\n", userdata);
+
+    flusher_exit();
+    if (wbuf_flush_all() < 0)
+	log_error("    buffered writes lost\n");
+    if (journal_exit() < 0)
+	log_error("    journal commit failed\n");
+    if (icache_flush() < 0 || super_write() < 0 || block_sync() < 0)
+	log_error("    block_sync failed\n");
+
+    cache_get_stats(&cs);
+    log_info("    cache: %u frames, %llu hits, %llu misses, %llu evictions, %llu writebacks\n",
+	     cs.nframes, cs.hits, cs.misses, cs.evictions, cs.writebacks);
+
+    dcache_get_stats(&ds);
+    log_info("    dcache: %u entries, %llu hits, %llu negative hits, %llu misses, %llu evictions\n",
+	     ds.nentries, ds.hits, ds.negative_hits, ds.misses, ds.evictions);
+    dcache_destroy();
+
+    icache_get_stats(&is);
+    log_info("    icache: %u entries, %llu hits, %llu misses, %llu evictions, %llu writebacks\n",
+	     is.nentries, is.hits, is.misses, is.evictions, is.writebacks);
+    icache_destroy();
+
+    flusher_get_stats(&fs);
+    log_info("    flusher: %llu passes, %llu blocks in %llu ms (%.1f MB/s), %llu stalls, %llu ms stalled, %llu ms worst\n",
+	     fs.passes, fs.blocks, fs.busy_ns / 1000000,
+	     fs.busy_ns ? (double) (fs.blocks << block_shift) * 1000 / fs.busy_ns : 0.0,
+	     fs.stalls, fs.stall_ns / 1000000, fs.max_stall_ns / 1000000);
+
+    block_commit_stats(&ms);
+    log_info("    commit: %llu fsyncs in %llu fdatasyncs\n", ms.requests, ms.syncs);
+
+    journal_get_stats(&js);
+    log_info("    journal: %llu commits, %llu blocks, %llu revoked, %llu checkpoints, %llu overflows, %llu replayed\n",
+	     js.commits, js.blocks, js.revoked, js.checkpoints, js.overflows, js.replayed);
+
+    wbuf_get_stats(&ws);
+    log_info("    wbuf: %llu writes buffered, %llu passed through, %llu flushes, %llu bytes, %llu forced\n",
+	     ws.absorbed, ws.bypassed, ws.flushes, ws.flushed, ws.pressure);
+    wbuf_destroy();
+
+    readahead_get_stats(&rs);
+    log_info("    readahead: %llu runs, %llu blocks, %llu dropped, %llu queue full\n",
+	     rs.runs, rs.blocks, rs.dropped, rs.full);
+
+    if (trace_active()) {
+	trace_get_stats(&ts);
+	log_info("    trace: %llu calls recorded, %llu dropped\n",
+		 ts.records, ts.dropped);
+    }
+    trace_close();
+
+    alloc_exit();
+    disk_close();
+    log_stop();
+}
+
+/** Per-open state, kept in fi->fh */
+struct sfs_file {
+    uint32_t ino;               // 0 for the stats file
+    int flags;                  // open(2) flags
+    struct sfs_open *open;      // shared by every open of the inode, NULL for the stats file
+    struct sfs_inode *inode;    // pinned in the inode cache, NULL if it is off
+    char *text;                 // stats file only: its contents as of open
+    size_t text_len;
+    pthread_mutex_t ra_lock;    // reads of one open file can run at once
+    uint64_t ra_next;           // where the next read continues a sequential run
+    uint64_t ra_end;            // readahead has been started up to here
+    unsigned long ra_window;    // readahead window in bytes, 0 while reads look random
+};
+
+/** Open count of one inode, whether or not the inode cache is on
+ *
+ * Writes run under the shared fs lock, so each open inode also has a
+ * lock of its own: writes take it exclusively, and reads and stats
+ * of the inode share it.
+ */
+struct sfs_open {
+    uint32_t ino;
+    unsigned int count;
+    pthread_rwlock_t lock;
+    struct sfs_open *next;
+};
+
+#define SFS_OPEN_BUCKETS 256
+
+// only changed by open, release and unlink, all under the exclusive
+// fs lock, so holders of the shared one can look things up
+static struct sfs_open *open_inodes[SFS_OPEN_BUCKETS];
+
+static struct sfs_open **sfs_open_find(const uint32_t ino)
+{
+    struct sfs_open **link = &open_inodes[(ino * 0x9e3779b1U) % SFS_OPEN_BUCKETS];
+
+    while (*link != NULL && (*link)->ino != ino)
+	link = &(*link)->next;
+    return link;
+}
+
+/** Count another open of @ino; returns its entry or NULL for -ENOMEM */
+static struct sfs_open *sfs_open_get(const uint32_t ino)
+{
+    struct sfs_open **link = sfs_open_find(ino);
+
+    if (*link == NULL) {
+	*link = calloc(1, sizeof(struct sfs_open));
+	if (*link == NULL)
+	    return NULL;
+	(*link)->ino = ino;
+	pthread_rwlock_init(&(*link)->lock, NULL);
+    }
+    (*link)->count++;
+    return *link;
+}
+
+/** Drop an open of @ino; returns the opens left */
+static unsigned int sfs_open_put(const uint32_t ino)
+{
+    struct sfs_open **link = sfs_open_find(ino);
+    struct sfs_open *o = *link;
+
+    if (o == NULL)
+	return 0;
+    if (--o->count > 0)
+	return o->count;
+    *link = o->next;
+    pthread_rwlock_destroy(&o->lock);
+    free(o);
+    return 0;
+}
+
+/** Number of open files on inode @ino */
+static unsigned int sfs_open_count(const uint32_t ino)
+{
+    struct sfs_open *o = *sfs_open_find(ino);
+
+    return o != NULL ? o->count : 0;
+}
+
+static struct sfs_file *sfs_file(struct fuse_file_info *fi)
+{
+    return (struct sfs_file *) (uintptr_t) fi->fh;
+}
+
+/** Take the inode lock of an open file, exclusively if @excl */
+static void sfs_file_lock(const struct sfs_file *f, const int excl)
+{
+    if (f->open == NULL)
+	return;
+    if (excl)
+	pthread_rwlock_wrlock(&f->open->lock);
+    else
+	pthread_rwlock_rdlock(&f->open->lock);
+}
+
+static void sfs_file_unlock(const struct sfs_file *f)
+{
+    if (f->open != NULL)
+	pthread_rwlock_unlock(&f->open->lock);
+}
+
+/** Set up the handle for a new open of inode @ino */
+static int sfs_file_open(const uint32_t ino, struct fuse_file_info *fi)
+{
+    struct sfs_file *f;
+    int retstat;
+
+    f = malloc(sizeof(*f));
+    if (f == NULL)
+	return -ENOMEM;
+    f->ino = ino;
+    trace_note(ino, 0, 0);
+    f->flags = fi->flags;
+    f->open = NULL;
+    f->text = NULL;
+    f->text_len = 0;
+    pthread_mutex_init(&f->ra_lock, NULL);
+    f->ra_next = 0;
+    f->ra_end = 0;
+    f->ra_window = 0;
+
+    f->open = sfs_open_get(ino);
+    retstat = f->open != NULL ? 0 : -ENOMEM;
+    if (retstat == 0) {
+	retstat = icache_get(ino, &f->inode);
+	if (retstat < 0)
+	    sfs_open_put(ino);
+    }
+    if (retstat < 0) {
+	pthread_mutex_destroy(&f->ra_lock);
+	free(f);
+	return retstat;
+    }
+
+    fi->fh = (uintptr_t) f;
+    return 0;
+}
+
+/** The inode behind an open file: the pinned copy, or else a fresh
+ * one loaded into @copy
+ */
+static int sfs_file_inode(struct sfs_file *f, struct sfs_inode *copy,
+			  struct sfs_inode **inode)
+{
+    int retstat;
+
+    if (f->inode != NULL) {
+	*inode = f->inode;
+	return 0;
+    }
+
+    retstat = inode_load(f->ino, copy);
+    *inode = copy;
+    return retstat;
+}
+
+/** Write back what sfs_file_inode() handed out */
+static int sfs_file_dirty(struct sfs_file *f, struct sfs_inode *inode)
+{
+    if (f->inode != NULL) {
+	icache_dirty(f->ino);
+	return 0;
+    }
+
+    return inode_store(f->ino, inode);
+}
+
+/** Write out buffered writes for the file, for callers that are
+ *  about to go around the write buffer
+ */
+static int sfs_file_flush(struct sfs_file *f, struct sfs_inode *inode)
+{
+    int retstat;
+    int err;
+
+    retstat = wbuf_flush(f->ino, inode);
+    if (retstat == 0)
+	return 0;
+
+    err = sfs_file_dirty(f, inode);
+    return retstat < 0 ? retstat : err;
+}
+
+/** Drop the handle; an unlinked file goes away with its last one */
+static int sfs_file_close(struct fuse_file_info *fi)
+{
+    struct sfs_file *f = sfs_file(fi);
+    struct sfs_inode inode;
+    int retstat = 0;
+
+    if (f->text != NULL) {
+	free(f->text);
+	free(f);
+	return 0;
+    }
+
+    icache_put(f->ino);
+    if (sfs_open_put(f->ino) == 0 && inode_load(f->ino, &inode) == 0
+	&& inode.nlink == 0 && inode.mode != 0) {
+	retstat = inode_release(f->ino, &inode);
+    } else if (wbuf_flush(f->ino, NULL) < 0) {
+	retstat = -EIO;
+    }
+    pthread_mutex_destroy(&f->ra_lock);
+    free(f);
+
+    return retstat;
+}
+
+/** Is @path the virtual stats file?  It has no inode and is not
+ *  listed in the root directory, but can be opened for reading.
+ */
+static int sfs_is_stats(const char *path)
+{
+    return path != NULL && strcmp(path, OPSTATS_PATH) == 0;
+}
+
+static void sfs_stats_stat(struct stat *statbuf)
+{
+    memset(statbuf, 0, sizeof(*statbuf));
+    statbuf->st_mode = S_IFREG | 0444;
+    statbuf->st_nlink = 1;
+    statbuf->st_uid = getuid();
+    statbuf->st_gid = getgid();
+    statbuf->st_blksize = block_size;
+    statbuf->st_atime = statbuf->st_mtime = statbuf->st_ctime = time(NULL);
+}
+
+/** Open the stats file: the counters are printed into the handle
+ *
+ * Its size is not known up front, so it is 0 in stat() and read with
+ * direct_io, which reads until we return nothing, as with /proc files.
+ */
+static int sfs_stats_open(struct fuse_file_info *fi)
+{
+    struct sfs_file *f;
+
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+	return -EACCES;
+
+    f = calloc(1, sizeof(*f));
+    if (f == NULL)
+	return -ENOMEM;
+    f->text = opstats_text(&f->text_len);
+    if (f->text == NULL) {
+	free(f);
+	return -ENOMEM;
+    }
+    f->flags = fi->flags;
+
+    fi->fh = (uintptr_t) f;
+    fi->direct_io = 1;
+    return 0;
+}
+
+/** Copy out part of the stats file; returns the bytes copied */
+static int sfs_stats_read(struct sfs_file *f, char *buf, size_t size,
+			  off_t offset)
+{
+    if (offset < 0 || (uint64_t) offset >= f->text_len)
+	return 0;
+    if (size > f->text_len - offset)
+	size = f->text_len - offset;
+    memcpy(buf, f->text + offset, size);
+
+    return size;
+}
+
+static void sfs_stat(const uint32_t ino, const struct sfs_inode *inode,
+		     struct stat *statbuf)
+{
+    memset(statbuf, 0, sizeof(*statbuf));
+    statbuf->st_ino = ino;
+    statbuf->st_mode = inode->mode;
+    statbuf->st_nlink = inode->nlink;
+    statbuf->st_uid = inode->uid;
+    statbuf->st_gid = inode->gid;
+    statbuf->st_size = inode->size;
+    statbuf->st_blksize = block_size;
+    statbuf->st_blocks = (inode->blocks << block_shift) / 512;
+    statbuf->st_atime = inode->atime;
+    statbuf->st_mtime = inode->mtime;
+    statbuf->st_ctime = inode->ctime;
 }
 
 /** Get file attributes.
@@ -113,11 +565,111 @@ void sfs_destroy(void *userdata)
 int sfs_getattr(const char *path, struct stat *statbuf)
 {
     int retstat = 0;
-    char fpath[PATH_MAX];
-    
+    struct sfs_inode inode;
+    struct sfs_open *o;
+    uint32_t ino;
+
     log_msg("\nsfs_getattr(path=\"%s\", statbuf=0x%08x)\n",
 	  path, statbuf);
-    
+
+    if (sfs_is_stats(path)) {
+	sfs_stats_stat(statbuf);
+	return 0;
+    }
+
+    retstat = path_lookup(path, &ino, NULL);
+    if (retstat < 0)
+	return retstat;
+
+    // an open file may be being written under the shared fs lock
+    o = *sfs_open_find(ino);
+    if (o != NULL)
+	pthread_rwlock_rdlock(&o->lock);
+    trace_note(ino, 0, 0);
+    retstat = inode_load(ino, &inode);
+    if (retstat == 0)
+	sfs_stat(ino, &inode, statbuf);
+    if (o != NULL)
+	pthread_rwlock_unlock(&o->lock);
+
+    return retstat;
+}
+
+/**
+ * Get attributes from an open file
+ *
+ * This method is called instead of the getattr() method if the
+ * file information is available.
+ *
+ * Currently this is only called after the create() method if that
+ * is implemented (see above).  Later it may be called for
+ * invocations of fstat() too.
+ *
+ * Introduced in version 2.5
+ */
+int sfs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    struct sfs_file *f = sfs_file(fi);
+    struct sfs_inode copy, *inode;
+
+    log_msg("\nsfs_fgetattr(path=\"%s\", statbuf=0x%08x, fi=0x%08x)\n",
+	    path, statbuf, fi);
+
+    if (f->text != NULL) {
+	sfs_stats_stat(statbuf);
+	return 0;
+    }
+
+    trace_note(f->ino, 0, 0);
+    retstat = sfs_file_inode(f, &copy, &inode);
+    if (retstat == 0)
+	sfs_stat(f->ino, inode, statbuf);
+
+    return retstat;
+}
+
+/** Make a new inode and link it into its parent directory */
+static int sfs_mknode(const char *path, mode_t mode, uint32_t *inop)
+{
+    struct fuse_context *ctx = fuse_get_context();
+    struct sfs_inode dir, inode;
+    uint32_t dir_ino, ino;
+    const char *name;
+    int retstat;
+
+    if (sfs_is_stats(path))
+	return -EEXIST;
+
+    retstat = path_parent(path, &dir_ino, &dir, &name);
+    if (retstat < 0)
+	return retstat;
+    if (dir_lookup(&dir, name, &ino) == 0)
+	return -EEXIST;
+
+    retstat = inode_new(mode, ctx->uid, ctx->gid, &ino, &inode);
+    if (retstat < 0)
+	return retstat;
+    if (S_ISDIR(mode)) {
+	inode.nlink = 2;
+	retstat = inode_store(ino, &inode);
+    }
+
+    if (retstat == 0)
+	retstat = dir_add(&dir, name, ino);
+    if (retstat < 0) {
+	inode_release(ino, &inode);
+	return retstat;
+    }
+
+    if (S_ISDIR(mode))
+	dir.nlink++;
+    retstat = inode_store(dir_ino, &dir);
+    if (retstat == 0)
+	dcache_add(path, strlen(path), ino);
+    trace_note(ino, 0, 0);
+    *inop = ino;
+
     return retstat;
 }
 
@@ -136,10 +688,15 @@ int sfs_getattr(const char *path, struct stat *statbuf)
 int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    uint32_t ino;
+
     log_msg("\nsfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n",
 	    path, mode, fi);
-    
-    
+
+    retstat = sfs_mknode(path, S_IFREG | (mode & 07777), &ino);
+    if (retstat == 0)
+	retstat = sfs_file_open(ino, fi);
+
     return retstat;
 }
 
@@ -147,9 +704,41 @@ int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 int sfs_unlink(const char *path)
 {
     int retstat = 0;
+    struct sfs_inode dir, inode;
+    uint32_t dir_ino, ino;
+    const char *name;
+
     log_msg("sfs_unlink(path=\"%s\")\n", path);
 
-    
+    if (sfs_is_stats(path))
+	return -EPERM;
+
+    retstat = path_parent(path, &dir_ino, &dir, &name);
+    if (retstat == 0)
+	retstat = dir_lookup(&dir, name, &ino);
+    if (retstat == 0) {
+	trace_note(ino, 0, 0);
+	retstat = inode_load(ino, &inode);
+    }
+    if (retstat < 0)
+	return retstat;
+    if (S_ISDIR(inode.mode))
+	return -EISDIR;
+
+    retstat = dir_remove(&dir, name);
+    if (retstat == 0)
+	retstat = inode_store(dir_ino, &dir);
+    if (retstat < 0)
+	return retstat;
+
+    dcache_add(path, strlen(path), 0);
+
+    // while the file is still open, the last release frees it
+    if (--inode.nlink == 0 && sfs_open_count(ino) == 0)
+	retstat = inode_release(ino, &inode);
+    else
+	retstat = inode_store(ino, &inode);
+
     return retstat;
 }
 
@@ -166,10 +755,21 @@ int sfs_unlink(const char *path)
 int sfs_open(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    struct sfs_inode inode;
+    uint32_t ino;
+
     log_msg("\nsfs_open(path\"%s\", fi=0x%08x)\n",
 	    path, fi);
 
-    
+    if (sfs_is_stats(path))
+	return sfs_stats_open(fi);
+
+    retstat = path_lookup(path, &ino, &inode);
+    if (retstat == 0 && S_ISDIR(inode.mode))
+	retstat = -EISDIR;
+    if (retstat == 0)
+	retstat = sfs_file_open(ino, fi);
+
     return retstat;
 }
 
@@ -192,11 +792,57 @@ int sfs_release(const char *path, struct fuse_file_info *fi)
     int retstat = 0;
     log_msg("\nsfs_release(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
-    
+
+    retstat = sfs_file_close(fi);
 
     return retstat;
 }
 
+/** Follow the access pattern of an open file and read ahead of it
+ *
+ * A read that starts where the previous one ended continues a
+ * sequential run.  The first such read opens a window of twice its
+ * size; each time the reader gets into the second half of what has
+ * been read ahead, the window doubles, up to -o readahead, and the
+ * next window's worth is started.  Any other read closes the window
+ * so random access costs no extra I/O.
+ */
+static void sfs_readahead(struct sfs_file *f, const struct sfs_inode *inode,
+			  const off_t offset, const size_t size, const int via_fd)
+{
+    unsigned long max = SFS_DATA->readahead_max;
+    uint64_t end = offset + size;
+    uint64_t from;
+
+    if (max == 0)
+	return;
+
+    pthread_mutex_lock(&f->ra_lock);
+    if ((uint64_t) offset != f->ra_next) {
+	f->ra_next = end;
+	f->ra_end = 0;
+	f->ra_window = 0;
+	goto out;
+    }
+    f->ra_next = end;
+
+    if (f->ra_window != 0 && end + f->ra_window / 2 < f->ra_end)
+	goto out;
+    f->ra_window = f->ra_window != 0 ? 2 * f->ra_window : 2 * size;
+    if (f->ra_window > max)
+	f->ra_window = max;
+
+    from = f->ra_end > end ? f->ra_end : end;
+    if (from >= inode->size)
+	goto out;
+    f->ra_end = end + f->ra_window;
+    if (f->ra_end > from)
+	file_readahead(inode, from, f->ra_end - from, via_fd);
+
+out:
+    pthread_mutex_unlock(&f->ra_lock);
+}
+
 /** Read data from an open file
  *
  * Read should return exactly the number of bytes requested except
@@ -211,10 +857,50 @@ int sfs_release(const char *path, struct fuse_file_info *fi)
 int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    struct sfs_file *f = sfs_file(fi);
+    struct sfs_inode copy, *inode;
+
     log_msg("\nsfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 	    path, buf, size, offset, fi);
 
-   
+    if (f->text != NULL)
+	return sfs_stats_read(f, buf, size, offset);
+
+    trace_note(f->ino, offset, size);
+    retstat = sfs_file_inode(f, &copy, &inode);
+    if (retstat == 0) {
+	sfs_readahead(f, inode, offset, size, 0);
+	retstat = file_read(inode, buf, size, offset);
+	if (retstat > 0)
+	    wbuf_read(f->ino, buf, retstat, offset);
+    }
+
+    return retstat;
+}
+
+/** Write @size bytes from memory to an open file, gathering small
+ *  writes in the write buffer
+ */
+static int sfs_write_mem(struct sfs_file *f, struct sfs_inode *inode,
+			 const char *buf, size_t size, off_t offset)
+{
+    int retstat;
+    int err;
+
+    // small writes are gathered in memory, their blocks allocated later
+    retstat = wbuf_write(f->ino, inode, buf, size, offset);
+    if (retstat > 0) {
+	if (offset + size > inode->size)
+	    inode->size = offset + size;
+	inode->mtime = inode->ctime = time(NULL);
+    } else if (retstat == 0) {
+	// a short write still changed the file
+	retstat = file_write(inode, buf, size, offset);
+    }
+    err = sfs_file_dirty(f, inode);
+    if (retstat >= 0 && err < 0)
+	retstat = err;
+
     return retstat;
 }
 
@@ -230,10 +916,422 @@ int sfs_write(const char *path, const char *buf, size_t size, off_t offset,
 	     struct fuse_file_info *fi)
 {
     int retstat = 0;
+    struct sfs_file *f = sfs_file(fi);
+    struct sfs_inode copy, *inode;
+
     log_msg("\nsfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
 	    path, buf, size, offset, fi);
-    
-    
+
+    trace_note(f->ino, offset, size);
+    retstat = sfs_file_inode(f, &copy, &inode);
+    if (retstat < 0)
+	return retstat;
+
+    return sfs_write_mem(f, inode, buf, size, offset);
+}
+
+/** Add @b to the bufvec being built in *@bufp, growing it as needed */
+static int sfs_bufvec_add(struct fuse_bufvec **bufp, size_t *cap,
+			  const struct fuse_buf *b)
+{
+    struct fuse_bufvec *bv = *bufp;
+
+    if (bv->count == *cap) {
+	bv = realloc(bv, sizeof(*bv) + (2 * *cap - 1) * sizeof(struct fuse_buf));
+	if (bv == NULL)
+	    return -ENOMEM;
+	*cap *= 2;
+	*bufp = bv;
+    }
+    bv->buf[bv->count++] = *b;
+
+    return 0;
+}
+
+/** Store data from an open file in a buffer
+ *
+ * Similar to the read() method, but data is stored and
+ * returned in a generic buffer.
+ *
+ * No actual copying of data has to take place, the source
+ * file descriptor may simply be stored in the buffer for
+ * later data transfer.
+ *
+ * The buffer must be allocated dynamically and stored at the
+ * location pointed to by bufp.  If the buffer contains memory
+ * regions, they too must be allocated using malloc().  The
+ * allocated memory will be freed by the caller.
+ *
+ * Each mapped run of the file becomes a buffer pointing into the disk
+ * file, so libfuse can splice it to the kernel without the data ever
+ * passing through here.  Holes become zeroed memory buffers.  With an
+ * O_DIRECT disk file, runs are read into memory instead.
+ *
+ * Introduced in version 2.9
+ */
+int sfs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+		 off_t offset, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    struct sfs_file *f = sfs_file(fi);
+    struct sfs_inode copy, *inode = NULL;
+    struct fuse_bufvec *bv;
+    struct fuse_buf b;
+    uint64_t pos, end, len, n;
+    unsigned int boff;
+    size_t i, cap = 4;
+    blkno_t pblk;
+    off_t doff;
+    int fd;
+
+    log_msg("\nsfs_read_buf(path=\"%s\", bufp=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+	    path, bufp, size, offset, fi);
+
+    if (f->text == NULL) {
+	trace_note(f->ino, offset, size);
+	retstat = sfs_file_inode(f, &copy, &inode);
+	if (retstat == 0)
+	    retstat = sfs_file_flush(f, inode);
+	if (retstat < 0)
+	    return retstat;
+    }
+
+    bv = malloc(sizeof(*bv) + (cap - 1) * sizeof(struct fuse_buf));
+    if (bv == NULL)
+	return -ENOMEM;
+    bv->count = 0;
+    bv->idx = 0;
+    bv->off = 0;
+
+    if (f->text != NULL) {
+	memset(&b, 0, sizeof(b));
+	b.fd = -1;
+	b.mem = malloc(size ? size : 1);
+	if (b.mem == NULL) {
+	    free(bv);
+	    return -ENOMEM;
+	}
+	b.size = sfs_stats_read(f, b.mem, size, offset);
+	bv->buf[bv->count++] = b;
+	*bufp = bv;
+	return 0;
+    }
+
+    sfs_readahead(f, inode, offset, size, 1);
+
+    pos = offset;
+    end = (uint64_t) offset < inode->size ? offset + size : pos;
+    if (end > inode->size)
+	end = inode->size;
+
+    while (pos < end) {
+	retstat = extent_map(inode, pos >> block_shift, &pblk, &len);
+	if (retstat < 0)
+	    goto fail;
+	boff = pos & (block_size - 1);
+	if (len > (end - pos + boff) >> block_shift)
+	    n = end - pos;
+	else
+	    n = (len << block_shift) - boff;
+
+	memset(&b, 0, sizeof(b));
+	b.size = n;
+	b.fd = -1;
+	if (retstat == 0) {
+	    b.mem = calloc(1, n);
+	    if (b.mem == NULL) {
+		retstat = -ENOMEM;
+		goto fail;
+	    }
+	} else {
+	    fd = block_fd(pblk, (boff + n + block_size - 1) >> block_shift, &doff);
+	    if (fd >= 0) {
+		b.flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		b.fd = fd;
+		b.pos = doff + boff;
+	    } else {
+		b.mem = malloc(n);
+		if (b.mem == NULL) {
+		    retstat = -ENOMEM;
+		    goto fail;
+		}
+		retstat = file_read(inode, b.mem, n, pos);
+		if (retstat < 0) {
+		    free(b.mem);
+		    goto fail;
+		}
+	    }
+	}
+
+	retstat = sfs_bufvec_add(&bv, &cap, &b);
+	if (retstat < 0) {
+	    free(b.mem);
+	    goto fail;
+	}
+	pos += n;
+    }
+
+    *bufp = bv;
+    return 0;
+
+fail:
+    for (i = 0; i < bv->count; i++)
+	free(bv->buf[i].mem);
+    free(bv);
+    return retstat;
+}
+
+/** Zero blocks [@pblk, +@count) that a failed write left holding
+ *  whatever was on the disk before, so they never show up in the file.
+ */
+static void sfs_zero_blocks(const blkno_t pblk, const uint64_t count)
+{
+    char *buf;
+    uint64_t i;
+
+    buf = calloc(1, block_size);
+    if (buf == NULL) {
+	log_error("sfs_zero_blocks: no memory, blocks %llu+%llu left stale\n",
+		  (unsigned long long) pblk, (unsigned long long) count);
+	return;
+    }
+    for (i = 0; i < count; i++)
+	if (block_write(pblk + i, buf) < 0)
+	    break;
+    free(buf);
+}
+
+/** Copy @n bytes from @src into memory and write them with file_write */
+static int sfs_write_staged(struct sfs_inode *inode, struct fuse_bufvec *src,
+			    const size_t n, const off_t offset)
+{
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(n);
+    ssize_t res;
+    int retstat;
+
+    dst.buf[0].mem = malloc(n);
+    if (dst.buf[0].mem == NULL)
+	return -ENOMEM;
+
+    res = fuse_buf_copy(&dst, src, 0);
+    if (res != (ssize_t) n)
+	retstat = res < 0 ? res : -EIO;
+    else
+	retstat = file_write(inode, dst.buf[0].mem, n, offset);
+    free(dst.buf[0].mem);
+
+    return retstat;
+}
+
+/** Write contents of buffer to an open file
+ *
+ * Similar to the write() method, but data is supplied in a
+ * generic buffer.  Use fuse_buf_copy() to transfer data to
+ * the destination.
+ *
+ * Writes under WBUF_BYPASS bytes or not starting on a block boundary
+ * are taken into memory and go the way of sfs_write(), through the
+ * write buffer.  In larger aligned writes, whole blocks are copied
+ * straight into the disk file, spliced when the data arrives in a
+ * pipe; only a partial block at the end is staged in memory for a
+ * read-modify-write.
+ *
+ * Introduced in version 2.9
+ */
+int sfs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+		  struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    struct sfs_file *f = sfs_file(fi);
+    struct sfs_inode copy, *inode;
+    struct fuse_bufvec dst, mem = FUSE_BUFVEC_INIT(0);
+    struct fuse_buf *b = &buf->buf[buf->idx];
+    size_t size = fuse_buf_size(buf), done = 0, n;
+    uint64_t pos = offset, len, nblocks;
+    blkno_t pblk, goal = 0;
+    unsigned int boff;
+    ssize_t res;
+    off_t doff;
+    int fd, err, fresh;
+
+    log_msg("\nsfs_write_buf(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+	    path, buf, size, offset, fi);
+
+    trace_note(f->ino, offset, size);
+    retstat = sfs_file_inode(f, &copy, &inode);
+    if (retstat < 0)
+	return retstat;
+
+    if (size < WBUF_BYPASS || (offset & (block_size - 1)) != 0) {
+	// libfuse hands over a single memory buffer unless it spliced
+	if (buf->count - buf->idx == 1 && !(b->flags & FUSE_BUF_IS_FD))
+	    return sfs_write_mem(f, inode, (char *) b->mem + buf->off, size, offset);
+
+	mem.buf[0].size = size;
+	mem.buf[0].mem = malloc(size ? size : 1);
+	if (mem.buf[0].mem == NULL)
+	    return -ENOMEM;
+	res = fuse_buf_copy(&mem, buf, 0);
+	if (res == (ssize_t) size)
+	    retstat = sfs_write_mem(f, inode, mem.buf[0].mem, size, offset);
+	else
+	    retstat = res < 0 ? res : -EIO;
+	free(mem.buf[0].mem);
+	return retstat;
+    }
+
+    retstat = sfs_file_flush(f, inode);
+    if (retstat < 0)
+	return retstat;
+
+    while (done < size) {
+	boff = pos & (block_size - 1);
+	if (boff != 0 || size - done < block_size) {
+	    n = block_size - boff;
+	    if (n > size - done)
+		n = size - done;
+	    retstat = sfs_write_staged(inode, buf, n, pos);
+	    if (retstat < 0)
+		break;
+	} else {
+	    nblocks = (size - done) >> block_shift;
+	    retstat = file_alloc(inode, pos >> block_shift, nblocks, goal, &pblk, &len);
+	    if (retstat < 0)
+		break;
+	    fresh = retstat == 0;
+	    if (len > nblocks)
+		len = nblocks;
+	    n = len << block_shift;
+	    goal = pblk + len;
+
+	    fd = block_fd(pblk, len, &doff);
+	    if (fd < 0) {
+		retstat = sfs_write_staged(inode, buf, n, pos);
+		if (retstat < 0) {
+		    if (fresh)
+			sfs_zero_blocks(pblk, len);
+		    break;
+		}
+	    } else {
+		dst = FUSE_BUFVEC_INIT(n);
+		dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+		dst.buf[0].fd = fd;
+		dst.buf[0].pos = doff;
+		res = fuse_buf_copy(&dst, buf, 0);
+		block_fd_written(pblk, len);
+		if (res != (ssize_t) n) {
+		    // the blocks are mapped already but this chunk is not
+		    // counted as written, so scrub what a new mapping exposes
+		    if (fresh)
+			sfs_zero_blocks(pblk, len);
+		    retstat = res < 0 ? res : -EIO;
+		    break;
+		}
+	    }
+	}
+	pos += n;
+	done += n;
+    }
+
+    if (done > 0) {
+	if (pos > inode->size)
+	    inode->size = pos;
+	inode->mtime = inode->ctime = time(NULL);
+    }
+    err = sfs_file_dirty(f, inode);
+    if (done > 0)
+	retstat = done;
+    else if (retstat >= 0 && err < 0)
+	retstat = err;
+
+    return retstat;
+}
+
+/** Possibly flush cached data
+ *
+ * BIG NOTE: This is not equivalent to fsync().  It's not a
+ * request to sync dirty data.
+ *
+ * Flush is called on each close() of a file descriptor.  So if a
+ * filesystem wants to return write errors in close() and the file
+ * has cached dirty data, this is a good place to write back data
+ * and return any errors.
+ *
+ * Buffered writes are given their blocks and written to the block
+ * cache here, so allocation failures show up in close().
+ *
+ * Changed in version 2.2
+ */
+int sfs_flush(const char *path, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    struct sfs_file *f = sfs_file(fi);
+    struct sfs_inode copy, *inode;
+
+    log_msg("\nsfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
+
+    trace_note(f->ino, 0, 0);
+    if (!wbuf_pending(f->ino))
+	return 0;
+
+    retstat = sfs_file_inode(f, &copy, &inode);
+    if (retstat == 0)
+	retstat = sfs_file_flush(f, inode);
+
+    return retstat;
+}
+
+/** Synchronize file contents
+ *
+ * If the datasync parameter is non-zero, then only the user data
+ * should be flushed, not the meta data.
+ *
+ * The file's buffered writes, dirty inodes and every dirty block in
+ * the block cache are written back to the disk file, so datasync
+ * makes no difference here.  The fdatasync that makes them durable
+ * runs without the file system lock and is shared with concurrent
+ * fsync callers (block_commit()); with the journal on, that includes
+ * the one for the transaction this fsync logged.
+ *
+ * Changed in version 2.2
+ */
+int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    int retstat = 0;
+    uint64_t upto = 0;
+    log_msg("\nsfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n",
+	    path, datasync, fi);
+
+    if (sfs_file(fi)->text != NULL)
+	return 0;
+
+    trace_note(sfs_file(fi)->ino, 0, 0);
+    retstat = wbuf_flush(sfs_file(fi)->ino, NULL);
+    if (retstat >= 0 && journal_active()) {
+	// data first, then the transaction that points at it; the sync
+	// below makes both durable before its blocks are let go home
+	retstat = block_flush();
+	if (retstat == 0)
+	    retstat = journal_commit_start(&upto);
+	if (retstat < 0)
+	    return retstat;
+    } else {
+	if (retstat >= 0)
+	    retstat = icache_flush();
+	if (retstat == 0)
+	    retstat = super_write();
+	if (retstat == 0)
+	    retstat = block_flush();
+	if (retstat < 0)
+	    return retstat;
+    }
+
+    fs_unlock();
+    retstat = block_commit();
+    fs_lock();
+    if (retstat == 0)
+	journal_commit_finish(upto);
+
     return retstat;
 }
 
@@ -244,8 +1342,11 @@ int sfs_mkdir(const char *path, mode_t mode)
     int retstat = 0;
     log_msg("\nsfs_mkdir(path=\"%s\", mode=0%3o)\n",
 	    path, mode);
-   
-    
+
+    uint32_t ino;
+
+    retstat = sfs_mknode(path, S_IFDIR | (mode & 07777), &ino);
+
     return retstat;
 }
 
@@ -254,10 +1355,43 @@ int sfs_mkdir(const char *path, mode_t mode)
 int sfs_rmdir(const char *path)
 {
     int retstat = 0;
+    struct sfs_inode dir, inode;
+    uint32_t dir_ino, ino;
+    const char *name;
+
     log_msg("sfs_rmdir(path=\"%s\")\n",
 	    path);
-    
-    
+
+    if (sfs_is_stats(path))
+	return -ENOTDIR;
+
+    retstat = path_parent(path, &dir_ino, &dir, &name);
+    if (retstat == 0)
+	retstat = dir_lookup(&dir, name, &ino);
+    if (retstat == 0) {
+	trace_note(ino, 0, 0);
+	retstat = inode_load(ino, &inode);
+    }
+    if (retstat < 0)
+	return retstat;
+    if (!S_ISDIR(inode.mode))
+	return -ENOTDIR;
+
+    retstat = dir_is_empty(&inode);
+    if (retstat < 0)
+	return retstat;
+    if (retstat == 0)
+	return -ENOTEMPTY;
+
+    retstat = dir_remove(&dir, name);
+    if (retstat < 0)
+	return retstat;
+    dcache_add(path, strlen(path), 0);
+    dir.nlink--;
+    retstat = inode_store(dir_ino, &dir);
+    if (retstat == 0)
+	retstat = inode_release(ino, &inode);
+
     return retstat;
 }
 
@@ -272,10 +1406,21 @@ int sfs_rmdir(const char *path)
 int sfs_opendir(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    struct sfs_inode inode;
+    uint32_t ino;
+
     log_msg("\nsfs_opendir(path=\"%s\", fi=0x%08x)\n",
 	  path, fi);
-    
-    
+
+    if (sfs_is_stats(path))
+	return -ENOTDIR;
+
+    retstat = path_lookup(path, &ino, &inode);
+    if (retstat == 0 && !S_ISDIR(inode.mode))
+	retstat = -ENOTDIR;
+    if (retstat == 0)
+	retstat = sfs_file_open(ino, fi);
+
     return retstat;
 }
 
@@ -300,12 +1445,38 @@ int sfs_opendir(const char *path, struct fuse_file_info *fi)
  *
  * Introduced in version 2.3
  */
+struct sfs_fill {
+    void *buf;
+    fuse_fill_dir_t filler;
+};
+
+static int sfs_fill_fn(void *arg, const char *name, uint32_t ino)
+{
+    struct sfs_fill *f = arg;
+
+    return f->filler(f->buf, name, NULL, 0);
+}
+
 int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
 	       struct fuse_file_info *fi)
 {
     int retstat = 0;
-    
-    
+    struct sfs_fill fill = { buf, filler };
+    struct sfs_inode copy, *inode;
+
+    log_msg("\nsfs_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n",
+	    path, buf, filler, offset, fi);
+
+    trace_note(sfs_file(fi)->ino, offset, 0);
+    retstat = sfs_file_inode(sfs_file(fi), &copy, &inode);
+    if (retstat < 0)
+	return retstat;
+
+    // mode 1 above: the whole directory in one go
+    if (filler(buf, ".", NULL, 0) || filler(buf, "..", NULL, 0))
+	return 0;
+    retstat = dir_iterate(inode, sfs_fill_fn, &fill);
+
     return retstat;
 }
 
@@ -316,73 +1487,211 @@ int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offse
 int sfs_releasedir(const char *path, struct fuse_file_info *fi)
 {
     int retstat = 0;
+    log_msg("\nsfs_releasedir(path=\"%s\", fi=0x%08x)\n",
+	    path, fi);
+
+    retstat = sfs_file_close(fi);
 
-    
     return retstat;
 }
 
-struct fuse_operations sfs_oper = {
-  .init = sfs_init,
-  .destroy = sfs_destroy,
-
-  .getattr = sfs_getattr,
-  .create = sfs_create,
-  .unlink = sfs_unlink,
-  .open = sfs_open,
-  .release = sfs_release,
-  .read = sfs_read,
-  .write = sfs_write,
+// every other operation that changes the file system runs under the
+// exclusive file system lock, which the background flusher takes too
+// (see flusher.c), ends where the journal may commit, and is timed
+// into its opstats, lock wait included
+#define SFS_LOCKED(op, OP, params, args)		\
+    static int sfs_##op##_locked params			\
+    {							\
+	unsigned long long start = opstats_start();	\
+	int retstat;					\
+							\
+	fs_lock();					\
+	retstat = sfs_##op args;			\
+	journal_end();					\
+	fs_unlock();					\
+	opstats_end(OPSTATS_##OP, start, retstat);	\
+	trace_end(OPSTATS_##OP, start, retstat);	\
+							\
+	return retstat;					\
+    }
 
-  .rmdir = sfs_rmdir,
-  .mkdir = sfs_mkdir,
+// lookups and reads share the lock and run side by side; they may
+// add an evicted inode to the running transaction, but leave
+// committing it to the next exclusive holder
+#define SFS_SHARED(op, OP, params, args)		\
+    static int sfs_##op##_locked params			\
+    {							\
+	unsigned long long start = opstats_start();	\
+	int retstat;					\
+							\
+	fs_lock_shared();				\
+	retstat = sfs_##op args;			\
+	fs_unlock();					\
+	opstats_end(OPSTATS_##OP, start, retstat);	\
+	trace_end(OPSTATS_##OP, start, retstat);	\
+							\
+	return retstat;					\
+    }
 
-  .opendir = sfs_opendir,
-  .readdir = sfs_readdir,
-  .releasedir = sfs_releasedir
-};
+// the same for an open file, which also shares its inode lock with
+// any other reads and keeps writes to it out
+#define SFS_SHARED_FILE(op, OP, params, args)		\
+    static int sfs_##op##_locked params			\
+    {							\
+	unsigned long long start = opstats_start();	\
+	int retstat;					\
+							\
+	fs_lock_shared();				\
+	sfs_file_lock(sfs_file(fi), 0);			\
+	retstat = sfs_##op args;			\
+	sfs_file_unlock(sfs_file(fi));			\
+	fs_unlock();					\
+	opstats_end(OPSTATS_##OP, start, retstat);	\
+	trace_end(OPSTATS_##OP, start, retstat);	\
+							\
+	return retstat;					\
+    }
 
-void sfs_usage()
+/** Before a write: wait for write-back if the cache is too dirty, and
+ *  make room in the write buffers, which takes the exclusive fs lock
+ */
+static void sfs_write_begin()
 {
-    fprintf(stderr, "usage:  sfs [FUSE and mount options] diskFile mountPoint\n");
-    abort();
+    flusher_throttle();
+    if (wbuf_crowded()) {
+	fs_lock();
+	wbuf_trim();
+	journal_end();
+	fs_unlock();
+    }
 }
 
-int main(int argc, char *argv[])
+/** After a write: commit the running transaction if it has grown too
+ *  big, which the shared fs lock the write ran under does not allow
+ */
+static void sfs_write_end()
 {
-    int fuse_stat;
-    struct sfs_state *sfs_data;
-    
-    // sanity checking on the command line
-    if ((argc < 3) || (argv[argc-2][0] == '-') || (argv[argc-1][0] == '-'))
-	sfs_usage();
+    if (journal_due()) {
+	fs_lock();
+	journal_end();
+	fs_unlock();
+    }
+}
 
-    sfs_data = malloc(sizeof(struct sfs_state));
-    if (sfs_data == NULL) {
-	perror("main calloc");
-	abort();
+// writes to different files run side by side under the shared fs
+// lock: each holds its file's inode lock exclusively, and the
+// allocator, write buffers, journal and caches below lock for
+// themselves
+#define SFS_WRITING(op, OP, params, args)		\
+    static int sfs_##op##_locked params			\
+    {							\
+	unsigned long long start = opstats_start();	\
+	int retstat;					\
+							\
+	sfs_write_begin();				\
+	fs_lock_shared();				\
+	sfs_file_lock(sfs_file(fi), 1);			\
+	retstat = sfs_##op args;			\
+	sfs_file_unlock(sfs_file(fi));			\
+	fs_unlock();					\
+	sfs_write_end();				\
+	opstats_end(OPSTATS_##OP, start, retstat);	\
+	trace_end(OPSTATS_##OP, start, retstat);	\
+							\
+	return retstat;					\
     }
 
-    // Pull the diskfile and save it in internal data
-    // sfs_data->diskfile = argv[argc-2];
-    sfs_data->diskfile = realpath(argv[argc-2], NULL);
-    printf("%s\n", sfs_data->diskfile);
+SFS_SHARED(getattr, GETATTR, (const char *path, struct stat *statbuf),
+	   (path, statbuf))
+SFS_SHARED_FILE(fgetattr, FGETATTR, (const char *path, struct stat *statbuf, struct fuse_file_info *fi),
+	   (path, statbuf, fi))
+SFS_LOCKED(create, CREATE, (const char *path, mode_t mode, struct fuse_file_info *fi),
+	   (path, mode, fi))
+SFS_LOCKED(unlink, UNLINK, (const char *path),
+	   (path))
+SFS_LOCKED(open, OPEN, (const char *path, struct fuse_file_info *fi),
+	   (path, fi))
+SFS_LOCKED(release, RELEASE, (const char *path, struct fuse_file_info *fi),
+	   (path, fi))
+SFS_SHARED_FILE(read, READ, (const char *path, char *buf, size_t size, off_t offset,
+	   struct fuse_file_info *fi),
+	   (path, buf, size, offset, fi))
+SFS_WRITING(write, WRITE, (const char *path, const char *buf, size_t size, off_t offset,
+	   struct fuse_file_info *fi),
+	   (path, buf, size, offset, fi))
+SFS_WRITING(write_buf, WRITE_BUF, (const char *path, struct fuse_bufvec *buf, off_t offset,
+	   struct fuse_file_info *fi),
+	   (path, buf, offset, fi))
+SFS_LOCKED(flush, FLUSH, (const char *path, struct fuse_file_info *fi),
+	   (path, fi))
+SFS_LOCKED(fsync, FSYNC, (const char *path, int datasync, struct fuse_file_info *fi),
+	   (path, datasync, fi))
+SFS_LOCKED(rmdir, RMDIR, (const char *path),
+	   (path))
+SFS_LOCKED(mkdir, MKDIR, (const char *path, mode_t mode),
+	   (path, mode))
+SFS_LOCKED(opendir, OPENDIR, (const char *path, struct fuse_file_info *fi),
+	   (path, fi))
+SFS_SHARED(readdir, READDIR, (const char *path, void *buf, fuse_fill_dir_t filler,
+	   off_t offset, struct fuse_file_info *fi),
+	   (path, buf, filler, offset, fi))
+SFS_LOCKED(releasedir, RELEASEDIR, (const char *path, struct fuse_file_info *fi),
+	   (path, fi))
+
+// read_buf shares the lock too, unless the file has buffered writes
+// that must reach the disk file before it can be handed out
+static int sfs_read_buf_locked(const char *path, struct fuse_bufvec **bufp,
+			       size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    unsigned long long start = opstats_start();
+    long long moved;
+    int retstat;
+
+    fs_lock_shared();
+    sfs_file_lock(sfs_file(fi), 0);
+    if (wbuf_pending(sfs_file(fi)->ino)) {
+	sfs_file_unlock(sfs_file(fi));
+	fs_unlock();
+	fs_lock();
+	retstat = sfs_read_buf(path, bufp, size, offset, fi);
+	journal_end();
+    } else {
+	retstat = sfs_read_buf(path, bufp, size, offset, fi);
+	sfs_file_unlock(sfs_file(fi));
+    }
+    fs_unlock();
+    moved = retstat == 0 ? fuse_buf_size(*bufp) : retstat;
+    opstats_end(OPSTATS_READ_BUF, start, moved);
+    trace_end(OPSTATS_READ_BUF, start, moved);
 
-    argv[argc-2] = argv[argc-1];
-    argv[argc-1] = NULL;
-    argc--;
-    
-    sfs_data->logfile = log_open();
-    
-    // turn over control to fuse
-    fprintf(stderr, "about to call fuse_main, %s \n", sfs_data->diskfile);
-    fuse_stat = fuse_main(argc, argv, &sfs_oper, sfs_data);
-    fprintf(stderr, "fuse_main returned %d\n", fuse_stat);
-    
-    return fuse_stat;
+    return retstat;
 }
 
+struct fuse_operations sfs_oper = {
+  .init = sfs_init,
+  .destroy = sfs_destroy,
 
+  .getattr = sfs_getattr_locked,
+  .fgetattr = sfs_fgetattr_locked,
+  .create = sfs_create_locked,
+  .unlink = sfs_unlink_locked,
+  .open = sfs_open_locked,
+  .release = sfs_release_locked,
+  .read = sfs_read_locked,
+  .write = sfs_write_locked,
+  .read_buf = sfs_read_buf_locked,
+  .write_buf = sfs_write_buf_locked,
+  .flush = sfs_flush_locked,
+  .fsync = sfs_fsync_locked,
 
-/* SCP'ED THIS IN */
+  .rmdir = sfs_rmdir_locked,
+  .mkdir = sfs_mkdir_locked,
 
+  .opendir = sfs_opendir_locked,
+  .readdir = sfs_readdir_locked,
+  .releasedir = sfs_releasedir_locked,
 
+  // read, write, flush, release, fsync, readdir and releasedir only need fi->fh
+  .flag_nullpath_ok = 1,
+  .flag_nopath = 1
+};
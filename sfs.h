@@ -0,0 +1,18 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _SFS_H_
+#define _SFS_H_
+
+#include "params.h"
+
+#include <fuse.h>
+
+// every operation sfs implements, for fuse_main() or a driver of its own
+extern struct fuse_operations sfs_oper;
+
+#endif
@@ -0,0 +1,1058 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  sfsbench: workloads for measuring sfs.  Each one runs either on a
+  mounted sfs, through the kernel like any other program, or with -d
+  on a disk file directly: sfsbench then mounts it in-process and
+  calls the operations in sfs_oper itself, the way libfuse would,
+  which leaves out the kernel round trip and measures sfs alone.  The
+  -o options are those of sfs and only apply in-process.
+
+  usage: sfsbench [-d diskfile] [-o options] [-t threads] [-r reqsize]
+		  [-s size] [-n count] workload [dir]
+*/
+
+// posix_memalign() is hidden by params.h's _XOPEN_SOURCE otherwise
+#define _GNU_SOURCE
+
+#include "params.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "bitops.h"
+#include "block.h"
+#include "log.h"
+#include "options.h"
+#include "sfs.h"
+#include "super.h"
+#include "trace.h"
+
+#define BENCH_MAX_THREADS 64
+// size of the images sfsbench formats
+#define BENCH_FS_SIZE (4UL << 30)
+// how long each timed loop of the bitmap workload runs for, at least
+#define BENCH_MIN_SECS 0.5
+// seconds each client count of the scale workload runs for
+#define BENCH_SCALE_SECS 2
+// size of each client's file in the scale workload
+#define BENCH_SCALE_FILE (1 << 20)
+// image the sparse workload formats, and the files it writes to it
+#define BENCH_SPARSE_SIZE (4ULL << 40)
+#define BENCH_SPARSE_FILES 20
+
+/** The file operations a workload needs, either through a mount
+ *  or straight into sfs_oper
+ *
+ * All return 0 (or a byte count) or -errno.  Paths are relative to
+ * the directory the workload runs in.
+ */
+struct bench_ops {
+    int (*create)(const char *path, uint64_t *fh);
+    int (*open)(const char *path, uint64_t *fh);
+    int (*close)(const uint64_t fh);
+    ssize_t (*pread)(const uint64_t fh, void *buf, const size_t len, const off_t off);
+    ssize_t (*pwrite)(const uint64_t fh, const void *buf, const size_t len, const off_t off);
+    int (*fsync)(const uint64_t fh);
+    int (*stat)(const char *path, struct stat *st);
+    int (*unlink)(const char *path);
+    int (*mkdir)(const char *path);
+    void (*remount)();          // drop whatever sfs keeps in memory
+};
+
+// what the command line asked for
+struct bench_args {
+    int threads;
+    unsigned long reqsize;      // 0 for the workload's own default
+    unsigned long size;         // bytes per file, 0 for the default
+    unsigned long count;        // files or calls, 0 for the default
+};
+
+static const struct bench_ops *ops;
+static const char *root;        // directory the workload runs in
+static struct bench_args args;
+
+// in-process only
+static struct sfs_state state;
+static struct fuse_context context;
+static double mount_secs;       // how long the first mount took, formatting included
+static const char *disk;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void die(const char *what, const int err)
+{
+    fprintf(stderr, "sfsbench: %s: %s\n", what, strerror(-err));
+    exit(EXIT_FAILURE);
+}
+
+/** Fill @buf with a pattern that depends on where it goes */
+static void fill(char *buf, const size_t len, const int file, const off_t off)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+	buf[i] = (char) ((off + i) * 31 + file * 7);
+}
+
+static char *bench_path(char *buf, const size_t len, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    n = snprintf(buf, len, "%s/", root);
+    va_start(ap, fmt);
+    vsnprintf(buf + n, len - n, fmt, ap);
+    va_end(ap);
+
+    return buf;
+}
+
+static void *bench_alloc(const size_t len)
+{
+    void *buf;
+
+    // page aligned, so O_DIRECT images in-process take it as it is
+    if (posix_memalign(&buf, 4096, len) != 0)
+	die("out of memory", -ENOMEM);
+
+    return buf;
+}
+
+///////////////////////////////////////////////////////////
+//
+// Through a mounted sfs
+//
+
+static int mount_create(const char *path, uint64_t *fh)
+{
+    int fd = open(path, O_CREAT|O_TRUNC|O_RDWR, 0644);
+
+    if (fd < 0)
+	return -errno;
+    *fh = fd;
+    return 0;
+}
+
+static int mount_open(const char *path, uint64_t *fh)
+{
+    int fd = open(path, O_RDWR);
+
+    if (fd < 0)
+	return -errno;
+    *fh = fd;
+    return 0;
+}
+
+static int mount_close(const uint64_t fh)
+{
+    return close(fh) < 0 ? -errno : 0;
+}
+
+static ssize_t mount_pread(const uint64_t fh, void *buf, const size_t len, const off_t off)
+{
+    ssize_t n = pread(fh, buf, len, off);
+
+    return n < 0 ? -errno : n;
+}
+
+static ssize_t mount_pwrite(const uint64_t fh, const void *buf, const size_t len, const off_t off)
+{
+    ssize_t n = pwrite(fh, buf, len, off);
+
+    return n < 0 ? -errno : n;
+}
+
+static int mount_fsync(const uint64_t fh)
+{
+    return fsync(fh) < 0 ? -errno : 0;
+}
+
+static int mount_stat(const char *path, struct stat *st)
+{
+    return stat(path, st) < 0 ? -errno : 0;
+}
+
+static int mount_unlink(const char *path)
+{
+    return unlink(path) < 0 ? -errno : 0;
+}
+
+static int mount_mkdir(const char *path)
+{
+    return mkdir(path, 0755) < 0 ? -errno : 0;
+}
+
+// the kernel's caches can't be dropped from here
+static void mount_remount()
+{
+}
+
+static const struct bench_ops mount_ops = {
+    mount_create, mount_open, mount_close, mount_pread, mount_pwrite,
+    mount_fsync, mount_stat, mount_unlink, mount_mkdir, mount_remount
+};
+
+///////////////////////////////////////////////////////////
+//
+// In-process, straight into sfs_oper
+//
+
+/** sfsbench plays libfuse here, so it answers for the fuse context too */
+struct fuse_context *fuse_get_context(void)
+{
+    return &context;
+}
+
+static int direct_create(const char *path, uint64_t *fh)
+{
+    struct fuse_file_info fi = { .flags = O_CREAT|O_TRUNC|O_RDWR };
+    int retstat;
+
+    retstat = sfs_oper.create(path, 0644, &fi);
+    *fh = fi.fh;
+    return retstat;
+}
+
+static int direct_open(const char *path, uint64_t *fh)
+{
+    struct fuse_file_info fi = { .flags = O_RDWR };
+    int retstat;
+
+    retstat = sfs_oper.open(path, &fi);
+    *fh = fi.fh;
+    return retstat;
+}
+
+static int direct_close(const uint64_t fh)
+{
+    struct fuse_file_info fi = { .flags = O_RDWR, .fh = fh };
+    int retstat;
+
+    retstat = sfs_oper.flush(NULL, &fi);
+    sfs_oper.release(NULL, &fi);
+    return retstat;
+}
+
+/** Read through read_buf and copy the result out, as libfuse 2.9
+ *  does when it replies to the kernel
+ */
+static ssize_t direct_pread(const uint64_t fh, void *buf, const size_t len, const off_t off)
+{
+    struct fuse_file_info fi = { .flags = O_RDWR, .fh = fh };
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len), *src = NULL;
+    ssize_t retstat;
+    size_t i;
+
+    retstat = sfs_oper.read_buf(NULL, &src, len, off, &fi);
+    if (retstat < 0)
+	return retstat;
+
+    dst.buf[0].mem = buf;
+    retstat = fuse_buf_copy(&dst, src, 0);
+    for (i = 0; i < src->count; i++)
+	if (!(src->buf[i].flags & FUSE_BUF_IS_FD))
+	    free(src->buf[i].mem);
+    free(src);
+
+    return retstat;
+}
+
+/** Write a memory buffer through write_buf, as libfuse 2.9 does for
+ *  a write that was not spliced
+ */
+static ssize_t direct_pwrite(const uint64_t fh, const void *buf, const size_t len, const off_t off)
+{
+    struct fuse_file_info fi = { .flags = O_RDWR, .fh = fh };
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(len);
+
+    src.buf[0].mem = (void *) buf;
+    return sfs_oper.write_buf(NULL, &src, off, &fi);
+}
+
+static int direct_fsync(const uint64_t fh)
+{
+    struct fuse_file_info fi = { .flags = O_RDWR, .fh = fh };
+
+    return sfs_oper.fsync(NULL, 0, &fi);
+}
+
+static int direct_stat(const char *path, struct stat *st)
+{
+    return sfs_oper.getattr(path, st);
+}
+
+static int direct_unlink(const char *path)
+{
+    return sfs_oper.unlink(path);
+}
+
+static int direct_mkdir(const char *path)
+{
+    return sfs_oper.mkdir(path, 0755);
+}
+
+static void direct_mount()
+{
+    struct fuse_conn_info conn = { .max_write = UINT32_MAX, .max_readahead = UINT32_MAX };
+
+    sfs_oper.init(&conn);
+}
+
+static void direct_remount()
+{
+    sfs_oper.destroy(&state);
+    direct_mount();
+}
+
+static const struct bench_ops direct_ops = {
+    direct_create, direct_open, direct_close, direct_pread, direct_pwrite,
+    direct_fsync, direct_stat, direct_unlink, direct_mkdir, direct_remount
+};
+
+///////////////////////////////////////////////////////////
+//
+// Workloads
+//
+
+/** Run @fn on args.threads threads, each handed its index, and
+ *  return the seconds they took together
+ */
+static double run_threads(void *(*fn)(void *))
+{
+    pthread_t tid[BENCH_MAX_THREADS];
+    double start;
+    long k;
+
+    start = now();
+    for (k = 0; k < args.threads; k++)
+	if (pthread_create(&tid[k], NULL, fn, (void *) k) != 0)
+	    die("cannot start a thread", -EAGAIN);
+    for (k = 0; k < args.threads; k++)
+	pthread_join(tid[k], NULL);
+
+    return now() - start;
+}
+
+static void report(const char *what, const double bytes, const double reqs,
+		   const double secs)
+{
+    printf("  %-6s %9.1f MiB/s %10.0f req/s %9.1f us/req\n", what,
+	   bytes / secs / (1 << 20), reqs / secs, secs * 1e6 / reqs * args.threads);
+}
+
+static void *seq_write(void *arg)
+{
+    long k = (long) arg;
+    char path[PATH_MAX], *buf = bench_alloc(args.reqsize);
+    uint64_t fh;
+    off_t off;
+    ssize_t n;
+    int retstat;
+
+    retstat = ops->create(bench_path(path, sizeof(path), "seq.%ld", k), &fh);
+    if (retstat < 0)
+	die(path, retstat);
+    for (off = 0; off < (off_t) args.size; off += args.reqsize) {
+	fill(buf, args.reqsize, k, off);
+	n = ops->pwrite(fh, buf, args.reqsize, off);
+	if (n != (ssize_t) args.reqsize)
+	    die(path, n < 0 ? n : -EIO);
+    }
+    retstat = ops->fsync(fh);
+    if (retstat < 0)
+	die(path, retstat);
+    ops->close(fh);
+    free(buf);
+
+    return NULL;
+}
+
+static void *seq_read(void *arg)
+{
+    long k = (long) arg;
+    char path[PATH_MAX], *buf = bench_alloc(args.reqsize);
+    uint64_t fh;
+    off_t off;
+    ssize_t n;
+    int retstat;
+
+    retstat = ops->open(bench_path(path, sizeof(path), "seq.%ld", k), &fh);
+    if (retstat < 0)
+	die(path, retstat);
+    for (off = 0; off < (off_t) args.size; off += args.reqsize) {
+	n = ops->pread(fh, buf, args.reqsize, off);
+	if (n != (ssize_t) args.reqsize)
+	    die(path, n < 0 ? n : -EIO);
+	// one byte per request keeps the check off the profile
+	if (buf[0] != (char) (off * 31 + k * 7))
+	    die(path, -EIO);
+    }
+    ops->close(fh);
+    free(buf);
+
+    return NULL;
+}
+
+/** Every thread writes a file of its own front to back, then reads
+ *  it back after a remount
+ */
+static void bench_seq()
+{
+    double bytes, reqs, secs;
+    char path[PATH_MAX];
+    long k;
+
+    if (args.reqsize == 0)
+	args.reqsize = 128 * 1024;
+    if (args.size == 0)
+	args.size = 64 << 20;
+    args.size -= args.size % args.reqsize;
+    bytes = (double) args.size * args.threads;
+    reqs = bytes / args.reqsize;
+
+    printf("seq: %d thread%s, %lu KiB each in %lu KiB requests\n", args.threads,
+	   args.threads > 1 ? "s" : "", args.size >> 10, args.reqsize >> 10);
+    secs = run_threads(seq_write);
+    report("write", bytes, reqs, secs);
+    ops->remount();
+    secs = run_threads(seq_read);
+    report("read", bytes, reqs, secs);
+
+    for (k = 0; k < args.threads; k++)
+	ops->unlink(bench_path(path, sizeof(path), "seq.%ld", k));
+}
+
+static void *fsync_append(void *arg)
+{
+    long k = (long) arg;
+    char path[PATH_MAX], *buf = bench_alloc(args.reqsize);
+    unsigned long i;
+    uint64_t fh;
+    ssize_t n;
+    int retstat;
+
+    retstat = ops->create(bench_path(path, sizeof(path), "fsync.%ld", k), &fh);
+    if (retstat < 0)
+	die(path, retstat);
+    for (i = 0; i < args.count; i++) {
+	fill(buf, args.reqsize, k, i * args.reqsize);
+	n = ops->pwrite(fh, buf, args.reqsize, i * args.reqsize);
+	if (n != (ssize_t) args.reqsize)
+	    die(path, n < 0 ? n : -EIO);
+	retstat = ops->fsync(fh);
+	if (retstat < 0)
+	    die(path, retstat);
+    }
+    ops->close(fh);
+    ops->unlink(path);
+    free(buf);
+
+    return NULL;
+}
+
+/** Every thread appends -r bytes to a file of its own and fsyncs it,
+ *  -n times
+ *
+ * In-process, it also tells how many fdatasyncs of the disk file
+ * group commit needed for them.
+ */
+static void bench_fsync()
+{
+    struct commit_stats before, after;
+    double secs, calls;
+
+    if (args.reqsize == 0)
+	args.reqsize = 4096;
+    if (args.count == 0)
+	args.count = 1000;
+    calls = (double) args.count * args.threads;
+
+    printf("fsync: %d thread%s, %lu appends of %lu bytes each\n", args.threads,
+	   args.threads > 1 ? "s" : "", args.count, args.reqsize);
+    block_commit_stats(&before);
+    secs = run_threads(fsync_append);
+    block_commit_stats(&after);
+    printf("  %10.0f fsyncs/s %9.1f us/fsync\n", calls / secs,
+	   secs * 1e6 / calls * args.threads);
+    if (ops == &direct_ops)
+	printf("  %10llu fsyncs in %llu fdatasyncs\n",
+	       after.requests - before.requests, after.syncs - before.syncs);
+}
+
+static volatile int scale_stop;
+static int scale_writes;                // the clients write as well as read
+static unsigned long scale_ops[BENCH_MAX_THREADS];
+
+/** Work on a file of the client's own until told to stop: stat it,
+ *  read 4 KiB of it and, in the mixed run, write 4 KiB of it and
+ *  every 16th time around create and unlink another file
+ */
+static void *scale_client(void *arg)
+{
+    long k = (long) arg;
+    char path[PATH_MAX], tmp[PATH_MAX], *buf = bench_alloc(4096);
+    unsigned int seed = k;
+    unsigned long i, n = 0;
+    struct stat st;
+    uint64_t fh, fh2;
+    off_t off;
+    int retstat;
+
+    bench_path(path, sizeof(path), "scale.%ld", k);
+    bench_path(tmp, sizeof(tmp), "scale.%ld.tmp", k);
+    retstat = ops->open(path, &fh);
+    if (retstat < 0)
+	die(path, retstat);
+    fill(buf, 4096, k, 0);
+
+    for (i = 1; !scale_stop; i++) {
+	off = (off_t) (rand_r(&seed) % (BENCH_SCALE_FILE / 4096)) * 4096;
+	if ((retstat = ops->stat(path, &st)) < 0 ||
+	    (retstat = ops->pread(fh, buf, 4096, off)) < 0)
+	    die(path, retstat);
+	n += 2;
+	if (!scale_writes)
+	    continue;
+	if ((retstat = ops->pwrite(fh, buf, 4096, off)) < 0)
+	    die(path, retstat);
+	n++;
+	if (i % 16 == 0) {
+	    if ((retstat = ops->create(tmp, &fh2)) < 0 ||
+		(retstat = ops->close(fh2)) < 0 ||
+		(retstat = ops->unlink(tmp)) < 0)
+		die(tmp, retstat);
+	    n += 3;
+	}
+    }
+    ops->close(fh);
+    free(buf);
+    scale_ops[k] = n;
+
+    return NULL;
+}
+
+/** Calls per second args.threads clients get through together */
+static double scale_run()
+{
+    pthread_t tid[BENCH_MAX_THREADS];
+    unsigned long total = 0;
+    double start, secs;
+    long k;
+
+    scale_stop = 0;
+    start = now();
+    for (k = 0; k < args.threads; k++)
+	if (pthread_create(&tid[k], NULL, scale_client, (void *) k) != 0)
+	    die("cannot start a thread", -EAGAIN);
+    sleep(BENCH_SCALE_SECS);
+    scale_stop = 1;
+    for (k = 0; k < args.threads; k++)
+	pthread_join(tid[k], NULL);
+    secs = now() - start;
+
+    for (k = 0; k < args.threads; k++)
+	total += scale_ops[k];
+    return total / secs;
+}
+
+/** Calls per second from 1 client up to -t clients (32 by default),
+ *  doubling each time, read only and mixed with writes
+ */
+static void bench_scale()
+{
+    int max = args.threads > 1 ? args.threads : 32;
+    double read1 = 0, mixed1 = 0, r, m;
+    char path[PATH_MAX], *buf = bench_alloc(BENCH_SCALE_FILE);
+    uint64_t fh;
+    int retstat;
+    long k;
+
+    for (k = 0; k < max; k++) {
+	retstat = ops->create(bench_path(path, sizeof(path), "scale.%ld", k), &fh);
+	if (retstat < 0)
+	    die(path, retstat);
+	fill(buf, BENCH_SCALE_FILE, k, 0);
+	if ((retstat = ops->pwrite(fh, buf, BENCH_SCALE_FILE, 0)) < 0)
+	    die(path, retstat);
+	ops->close(fh);
+    }
+    free(buf);
+
+    printf("scale: %d s per step, %d KiB file per client\n", BENCH_SCALE_SECS,
+	   BENCH_SCALE_FILE >> 10);
+    printf("  %7s %12s %8s %12s %8s\n", "clients", "read ops/s", "speedup",
+	   "mixed ops/s", "speedup");
+    for (args.threads = 1; args.threads <= max; args.threads *= 2) {
+	scale_writes = 0;
+	r = scale_run();
+	scale_writes = 1;
+	m = scale_run();
+	if (args.threads == 1) {
+	    read1 = r;
+	    mixed1 = m;
+	}
+	printf("  %7d %12.0f %7.2fx %12.0f %7.2fx\n", args.threads, r, r / read1,
+	       m, m / mixed1);
+    }
+
+    for (k = 0; k < max; k++)
+	ops->unlink(bench_path(path, sizeof(path), "scale.%ld", k));
+}
+
+/** seq at every request size from 4 KiB to 1 MiB, one row each
+ *
+ * Through a mount the kernel decides the size of the requests sfs
+ * sees: one page each without big_writes, up to max_write with it.
+ * These rows give the cost of each on either side of that choice.
+ */
+static void bench_reqsize()
+{
+    unsigned long size = args.size ? args.size : 64 << 20;
+    double bytes, reqs, wsecs, rsecs;
+    char path[PATH_MAX];
+    long k;
+
+    printf("reqsize: %d thread%s, %lu KiB each\n", args.threads,
+	   args.threads > 1 ? "s" : "", size >> 10);
+    printf("  %8s %12s %12s %12s %12s\n", "request", "write MiB/s", "us/write",
+	   "read MiB/s", "us/read");
+    for (args.reqsize = 4096; args.reqsize <= 1 << 20; args.reqsize *= 4) {
+	args.size = size - size % args.reqsize;
+	bytes = (double) args.size * args.threads;
+	reqs = bytes / args.reqsize;
+	wsecs = run_threads(seq_write);
+	ops->remount();
+	rsecs = run_threads(seq_read);
+	printf("  %7luK %12.1f %12.1f %12.1f %12.1f\n", args.reqsize >> 10,
+	       bytes / wsecs / (1 << 20), wsecs * 1e6 / reqs * args.threads,
+	       bytes / rsecs / (1 << 20), rsecs * 1e6 / reqs * args.threads);
+	for (k = 0; k < args.threads; k++)
+	    ops->unlink(bench_path(path, sizeof(path), "seq.%ld", k));
+    }
+}
+
+/** The scan the bitmap allocator replaced: a byte at a time, then
+ *  a bit at a time within the byte that differs
+ */
+static uint64_t naive_find(const uint64_t *words, uint64_t from,
+			   const uint64_t end, const int set)
+{
+    const unsigned char *bytes = (const unsigned char *) words;
+    const unsigned char skip = set ? 0x00 : 0xff;
+
+    while (from < end) {
+	if ((from & 7) == 0 && from + 8 <= end && bytes[from >> 3] == skip) {
+	    from += 8;
+	    continue;
+	}
+	if (((bytes[from >> 3] >> (from & 7)) & 1) == set)
+	    return from;
+	from++;
+    }
+
+    return end;
+}
+
+static uint64_t naive_count(const uint64_t *words, const uint64_t from,
+			    const uint64_t end)
+{
+    const unsigned char *bytes = (const unsigned char *) words;
+    uint64_t i, n = 0;
+
+    for (i = from; i < end; i += 8)
+	n += __builtin_popcount(bytes[i >> 3]);
+
+    return n;
+}
+
+/** Sweep @words end to end with @find, stopping at every bit equal
+ *  to @set, for at least BENCH_MIN_SECS
+ */
+static void bitmap_sweep(const char *what, const char *impl,
+			 uint64_t (*find)(const uint64_t *, const uint64_t,
+					  const uint64_t, const int),
+			 const uint64_t *words, const uint64_t nbits, const int set)
+{
+    uint64_t i, hits = 0, sweeps = 0;
+    double start = now(), secs;
+
+    do {
+	for (i = 0; (i = find(words, i, nbits, set)) < nbits; i++)
+	    hits++;
+	sweeps++;
+    } while ((secs = now() - start) < BENCH_MIN_SECS);
+
+    printf("  %-10s %-6s %8.2f GiB/s %9.2f us/hit\n", what, impl,
+	   sweeps * (nbits / 8) / secs / (1 << 30), secs * 1e6 / hits);
+}
+
+static void bitmap_count(const char *impl,
+			 uint64_t (*count)(const uint64_t *, const uint64_t,
+					   const uint64_t),
+			 const uint64_t *words, const uint64_t nbits)
+{
+    uint64_t n = 0, sweeps = 0;
+    double start = now(), secs;
+
+    do {
+	n += count(words, 0, nbits);
+	sweeps++;
+    } while ((secs = now() - start) < BENCH_MIN_SECS);
+
+    printf("  %-10s %-6s %8.2f GiB/s\n", "count", impl,
+	   sweeps * (nbits / 8) / secs / (1 << 30));
+    if (n % sweeps != 0)
+	die("count", -EIO);
+}
+
+/** Scan a bitmap of args.size bytes with the allocator's word scans
+ *  and with the naive scan, without touching a file system
+ *
+ * The bitmap is all ones with a zero every -r bits for the search for
+ * a clear bit, and the other way round for the search for a set one,
+ * like a mostly full disk and a mostly empty one.
+ */
+static void bench_bitmap()
+{
+    uint64_t *words, nbits, i;
+    int set;
+
+    if (args.size == 0)
+	args.size = 32 << 20;
+    if (args.reqsize == 0)
+	args.reqsize = 1 << 20;
+    args.size -= args.size % 8;
+    nbits = 8ULL * args.size;
+    words = bench_alloc(args.size);
+    bitops_init();
+
+    printf("bitmap: %lu KiB, one hit every %lu bits\n", args.size >> 10,
+	   args.reqsize);
+    for (set = 0; set <= 1; set++) {
+	memset(words, set ? 0x00 : 0xff, args.size);
+	for (i = args.reqsize / 2; i < nbits; i += args.reqsize)
+	    words[i >> 6] ^= 1ULL << (i & 63);
+	bitmap_sweep(set ? "find set" : "find clear", bitops_impl(),
+		     bitops_find, words, nbits, set);
+	bitmap_sweep(set ? "find set" : "find clear", "naive",
+		     naive_find, words, nbits, set);
+    }
+    bitmap_count("bitops", bitops_count, words, nbits);
+    bitmap_count("naive", naive_count, words, nbits);
+
+    free(words);
+}
+
+/** Create, stat or unlink this thread's share of the files in dir/ */
+static void *dir_phase(void *arg, const int phase)
+{
+    long k = (long) arg;
+    unsigned long i;
+    char path[PATH_MAX];
+    struct stat st;
+    uint64_t fh;
+    int retstat;
+
+    for (i = k; i < args.count; i += args.threads) {
+	bench_path(path, sizeof(path), "dir/f%lu", i);
+	switch (phase) {
+	case 0:
+	    retstat = ops->create(path, &fh);
+	    if (retstat == 0)
+		retstat = ops->close(fh);
+	    break;
+	case 1:
+	    retstat = ops->stat(path, &st);
+	    break;
+	default:
+	    retstat = ops->unlink(path);
+	}
+	if (retstat < 0)
+	    die(path, retstat);
+    }
+
+    return NULL;
+}
+
+static void *dir_create(void *arg)
+{
+    return dir_phase(arg, 0);
+}
+
+static void *dir_stat(void *arg)
+{
+    return dir_phase(arg, 1);
+}
+
+static void *dir_unlink(void *arg)
+{
+    return dir_phase(arg, 2);
+}
+
+/** Fill one directory with -n empty files, stat each of them after a
+ *  remount, then unlink them all
+ */
+static void bench_dir()
+{
+    char path[PATH_MAX];
+    double secs;
+    int retstat;
+
+    if (args.count == 0)
+	args.count = 100000;
+    retstat = ops->mkdir(bench_path(path, sizeof(path), "dir"));
+    if (retstat < 0 && retstat != -EEXIST)
+	die(path, retstat);
+
+    printf("dir: %lu files in one directory, %d thread%s\n", args.count,
+	   args.threads, args.threads > 1 ? "s" : "");
+    secs = run_threads(dir_create);
+    printf("  %-6s %10.0f ops/s %9.1f us/op\n", "create", args.count / secs,
+	   secs * 1e6 / args.count * args.threads);
+    ops->remount();
+    secs = run_threads(dir_stat);
+    printf("  %-6s %10.0f ops/s %9.1f us/op\n", "stat", args.count / secs,
+	   secs * 1e6 / args.count * args.threads);
+    secs = run_threads(dir_unlink);
+    printf("  %-6s %10.0f ops/s %9.1f us/op\n", "unlink", args.count / secs,
+	   secs * 1e6 / args.count * args.threads);
+}
+
+/** Format a new disk file as a sparse 4 TiB image of 512-byte blocks */
+static void sparse_prepare()
+{
+    struct stat st;
+
+    if (disk == NULL) {
+	fprintf(stderr, "sfsbench: sparse runs in-process only, with -d\n");
+	exit(EXIT_FAILURE);
+    }
+    if (stat(disk, &st) == 0 && st.st_size > 0) {
+	fprintf(stderr, "sfsbench: sparse needs a new disk file, %s is not empty\n",
+		disk);
+	exit(EXIT_FAILURE);
+    }
+    state.block_size = SFS_MIN_BLOCK_SIZE;
+    state.fs_size = BENCH_SPARSE_SIZE;
+}
+
+static long max_rss_kib()
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+/** Check that a huge, mostly empty image is cheap to format and mount
+ *
+ * Writes BENCH_SPARSE_FILES files of 1 MiB, unlinks one and remounts,
+ * then checks the free block count survived the remount and reads
+ * every file back.  Exits with a failure if anything is off.
+ */
+static void bench_sparse()
+{
+    char path[PATH_MAX], *buf = bench_alloc(1 << 20), *want = bench_alloc(1 << 20);
+    uint64_t fh, free_blocks;
+    struct stat st;
+    double start, secs;
+    ssize_t n;
+    int retstat;
+    long k;
+
+    printf("sparse: %llu GiB image of %lu-byte blocks, %llu blocks\n",
+	   BENCH_SPARSE_SIZE >> 30, state.block_size, (unsigned long long) sb.nblocks);
+    printf("  %-16s %8.2f s, max RSS %ld KiB\n", "format and mount", mount_secs,
+	   max_rss_kib());
+
+    for (k = 0; k < BENCH_SPARSE_FILES; k++) {
+	retstat = ops->create(bench_path(path, sizeof(path), "sparse.%ld", k), &fh);
+	if (retstat < 0)
+	    die(path, retstat);
+	fill(want, 1 << 20, k, 0);
+	n = ops->pwrite(fh, want, 1 << 20, 0);
+	if (n != 1 << 20)
+	    die(path, n < 0 ? n : -EIO);
+	ops->close(fh);
+    }
+    retstat = ops->unlink(bench_path(path, sizeof(path), "sparse.%d", 0));
+    if (retstat < 0)
+	die(path, retstat);
+
+    sfs_oper.destroy(&state);
+    free_blocks = sb.free_blocks;
+    start = now();
+    direct_mount();
+    secs = now() - start;
+    printf("  %-16s %8.2f s, max RSS %ld KiB\n", "remount", secs, max_rss_kib());
+    if (sb.free_blocks != free_blocks) {
+	fprintf(stderr, "sfsbench: %llu free blocks before the remount, %llu after\n",
+		(unsigned long long) free_blocks, (unsigned long long) sb.free_blocks);
+	exit(EXIT_FAILURE);
+    }
+
+    for (k = 1; k < BENCH_SPARSE_FILES; k++) {
+	retstat = ops->open(bench_path(path, sizeof(path), "sparse.%ld", k), &fh);
+	if (retstat < 0)
+	    die(path, retstat);
+	fill(want, 1 << 20, k, 0);
+	n = ops->pread(fh, buf, 1 << 20, 0);
+	if (n != 1 << 20 || memcmp(buf, want, 1 << 20) != 0)
+	    die(path, n < 0 ? n : -EIO);
+	ops->close(fh);
+	ops->unlink(path);
+    }
+    free(buf);
+    free(want);
+
+    if (stat(disk, &st) == 0)
+	printf("  %-16s %8lld MiB allocated, %lld GiB long\n", "image on disk",
+	       (long long) st.st_blocks / 2048, (long long) st.st_size >> 30);
+    printf("  %d files written and read back, free blocks intact\n",
+	   BENCH_SPARSE_FILES - 1);
+}
+
+static const struct {
+    const char *name;
+    void (*run)();
+    void (*prepare)();          // before the options are parsed, may be NULL
+} workloads[] = {
+    { "seq", bench_seq, NULL },
+    { "reqsize", bench_reqsize, NULL },
+    { "bitmap", bench_bitmap, NULL },
+    { "dir", bench_dir, NULL },
+    { "fsync", bench_fsync, NULL },
+    { "scale", bench_scale, NULL },
+    { "sparse", bench_sparse, sparse_prepare },
+};
+
+#define NWORKLOADS ((int) (sizeof(workloads) / sizeof(workloads[0])))
+
+static void usage()
+{
+    int i;
+
+    fprintf(stderr, "usage: sfsbench [options] workload dir\n");
+    fprintf(stderr, "       sfsbench [options] -d diskfile workload\n");
+    fprintf(stderr, "\nworkloads:");
+    for (i = 0; i < NWORKLOADS; i++)
+	fprintf(stderr, " %s", workloads[i].name);
+    fprintf(stderr, "\n\noptions:\n");
+    fprintf(stderr, "    -d diskfile run sfs in-process on diskfile instead of through a mount\n");
+    fprintf(stderr, "    -o options  sfs -o options, in-process only\n");
+    fprintf(stderr, "    -t threads  concurrent clients (default 1)\n");
+    fprintf(stderr, "    -r size     bytes per request, K/M/G suffixes ok\n");
+    fprintf(stderr, "    -s size     bytes per file\n");
+    fprintf(stderr, "    -n count    files, or calls per thread\n");
+    fprintf(stderr, "\nsfs options:\n");
+    options_usage(stderr);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args fargs = FUSE_ARGS_INIT(0, NULL);
+    double start;
+    int c, i, retstat;
+
+    args.threads = 1;
+    options_defaults(&state);
+    // big enough for every workload's defaults; -o fs_size still wins
+    state.fs_size = BENCH_FS_SIZE;
+    fuse_opt_add_arg(&fargs, "sfsbench");
+
+    while ((c = getopt(argc, argv, "d:o:t:r:s:n:")) != -1) {
+	switch (c) {
+	case 'd':
+	    disk = optarg;
+	    break;
+	case 'o':
+	    fuse_opt_add_arg(&fargs, "-o");
+	    fuse_opt_add_arg(&fargs, optarg);
+	    break;
+	case 't':
+	    args.threads = atoi(optarg);
+	    break;
+	case 'r':
+	    if (options_parse_size(optarg, &args.reqsize) < 0)
+		usage();
+	    break;
+	case 's':
+	    if (options_parse_size(optarg, &args.size) < 0)
+		usage();
+	    break;
+	case 'n':
+	    if (options_parse_size(optarg, &args.count) < 0)
+		usage();
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (argc - optind != (disk == NULL ? 2 : 1) || args.threads < 1 ||
+	args.threads > BENCH_MAX_THREADS)
+	usage();
+    for (i = 0; i < NWORKLOADS; i++)
+	if (strcmp(argv[optind], workloads[i].name) == 0)
+	    break;
+    if (i == NWORKLOADS)
+	usage();
+    if (workloads[i].prepare != NULL)
+	workloads[i].prepare();
+
+    if (options_parse(&fargs, &state) == -1)
+	usage();
+    if (fargs.argc > 1)
+	fprintf(stderr, "sfsbench: ignoring options sfs does not know\n");
+    fuse_opt_free_args(&fargs);
+
+    if (disk == NULL) {
+	ops = &mount_ops;
+	root = argv[optind + 1];
+    } else {
+	ops = &direct_ops;
+	root = "";
+	state.diskfile = (char *) disk;
+	state.logfile = log_open();
+	if (state.trace != NULL &&
+	    (retstat = trace_open(state.trace, state.trace_size)) < 0)
+	    die(state.trace, retstat);
+	context.uid = getuid();
+	context.gid = getgid();
+	context.pid = getpid();
+	context.private_data = &state;
+	start = now();
+	direct_mount();
+	mount_secs = now() - start;
+    }
+
+    workloads[i].run();
+
+    if (disk != NULL)
+	sfs_oper.destroy(&state);
+
+    return EXIT_SUCCESS;
+}
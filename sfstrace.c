@@ -0,0 +1,437 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  sfstrace: decoder for the binary trace sfs writes with -o trace=FILE
+  (see trace.c).  Prints a summary of the run, a latency breakdown of
+  every operation with exact percentiles, and two heatmaps: calls per
+  operation over time, and where in the busiest files reads and
+  writes landed.
+
+  usage: sfstrace [-n inodes] [-w width] tracefile
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "opstats.h"
+#include "trace.h"
+
+// heatmap cells from idle to busiest
+static const char shades[] = " .:-=+*#%@";
+#define NSHADES ((int) sizeof(shades) - 1)
+
+// one file's reads and writes, a run of the by-inode sorted records
+struct inode_total {
+    uint32_t ino;
+    uint64_t bytes;     // read and written
+    uint64_t extent;    // end of the furthest access
+    size_t first, count;
+};
+
+static int is_read(const int op)
+{
+    return op == OPSTATS_READ || op == OPSTATS_READ_BUF;
+}
+
+static int is_write(const int op)
+{
+    return op == OPSTATS_WRITE || op == OPSTATS_WRITE_BUF;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static int cmp_time(const void *a, const void *b)
+{
+    const struct trace_record *x = a, *y = b;
+
+    return x->ts_ns < y->ts_ns ? -1 : x->ts_ns > y->ts_ns;
+}
+
+static int cmp_ino(const void *a, const void *b)
+{
+    const struct trace_record *x = *(const struct trace_record **) a;
+    const struct trace_record *y = *(const struct trace_record **) b;
+
+    if (x->ino != y->ino)
+	return x->ino < y->ino ? -1 : 1;
+    return x->ts_ns < y->ts_ns ? -1 : x->ts_ns > y->ts_ns;
+}
+
+static int cmp_bytes(const void *a, const void *b)
+{
+    const struct inode_total *x = a, *y = b;
+
+    return x->bytes > y->bytes ? -1 : x->bytes < y->bytes;
+}
+
+/** @bytes with a K/M/G suffix, in a static buffer good for a few calls */
+static const char *human(const uint64_t bytes)
+{
+    static char bufs[4][16];
+    static int next;
+    const char *units = "BKMGT";
+    double v = bytes;
+    char *buf = bufs[next++ % 4];
+
+    while (v >= 1024 && units[1] != '\0') {
+	v /= 1024;
+	units++;
+    }
+    if (*units == 'B')
+	snprintf(buf, sizeof(bufs[0]), "%llu", (unsigned long long) bytes);
+    else
+	snprintf(buf, sizeof(bufs[0]), "%.1f%c", v, *units);
+    return buf;
+}
+
+/** Number of distinct values among @n 32-bit ones; sorts them */
+static size_t distinct(uint32_t *v, const size_t n)
+{
+    size_t i, count = 0;
+
+    qsort(v, n, sizeof(*v), cmp_u32);
+    for (i = 0; i < n; i++)
+	if (i == 0 || v[i] != v[i - 1])
+	    count++;
+    return count;
+}
+
+/** Latency below which @pct per mille of the @n sorted ones fall */
+static uint64_t percentile(const uint64_t *lat, const size_t n, const unsigned int pct)
+{
+    size_t want;
+
+    if (n == 0)
+	return 0;
+    want = (n * pct + 999) / 1000;
+    return lat[want > 0 ? want - 1 : 0];
+}
+
+/** Print one heatmap row of @width cells scaled to @max */
+static void print_row(const uint64_t *cells, const int width, const uint64_t max)
+{
+    int i, shade;
+
+    putchar('|');
+    for (i = 0; i < width; i++) {
+	shade = 0;
+	if (cells[i] > 0 && max > 0)
+	    shade = 1 + (int) ((cells[i] - 1) * (NSHADES - 1) / max);
+	putchar(shades[shade < NSHADES ? shade : NSHADES - 1]);
+    }
+    putchar('|');
+}
+
+static void print_summary(const char *path, const struct trace_header *h,
+			  const struct trace_record *recs, const size_t n)
+{
+    uint64_t rbytes = 0, wbytes = 0, rcalls = 0, wcalls = 0, errors = 0, end = 0;
+    uint32_t *ids;
+    size_t i, nthreads, ninodes;
+    time_t started = h->start_time / 1000000000ULL;
+    double span;
+
+    ids = malloc((n > 0 ? n : 1) * sizeof(*ids));
+    if (ids == NULL) {
+	perror("sfstrace");
+	exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n; i++) {
+	if (recs[i].ts_ns + recs[i].latency_ns > end)
+	    end = recs[i].ts_ns + recs[i].latency_ns;
+	if (recs[i].result < 0) {
+	    errors++;
+	} else if (is_read(recs[i].op)) {
+	    rcalls++;
+	    rbytes += recs[i].result;
+	} else if (is_write(recs[i].op)) {
+	    wcalls++;
+	    wbytes += recs[i].result;
+	}
+    }
+    span = n > 0 ? (end - recs[0].ts_ns) / 1e9 : 0.0;
+
+    for (i = 0; i < n; i++)
+	ids[i] = recs[i].tid;
+    nthreads = distinct(ids, n);
+    for (i = 0; i < n; i++)
+	ids[i] = recs[i].ino;
+    ninodes = distinct(ids, n);
+    if (ninodes > 0 && ids[0] == 0)
+	ninodes--;
+    free(ids);
+
+    printf("trace:    %s, started %s", path, ctime(&started));
+    printf("calls:    %zu recorded, %llu dropped, %llu failed\n",
+	   n, (unsigned long long) h->dropped, (unsigned long long) errors);
+    printf("span:     %.3f s, %.0f calls/s\n", span, span > 0 ? n / span : 0.0);
+    printf("threads:  %zu, inodes touched: %zu\n", nthreads, ninodes);
+    printf("read:     %s in %llu calls\n", human(rbytes), (unsigned long long) rcalls);
+    printf("written:  %s in %llu calls\n", human(wbytes), (unsigned long long) wcalls);
+}
+
+/** Per operation: calls, errors, bytes and latency percentiles in usec */
+static void print_ops(const struct trace_record *recs, const size_t n)
+{
+    uint64_t *lat, errors, bytes, total;
+    size_t i, count;
+    int op;
+
+    lat = malloc((n > 0 ? n : 1) * sizeof(*lat));
+    if (lat == NULL) {
+	perror("sfstrace");
+	exit(EXIT_FAILURE);
+    }
+
+    printf("\n%-10s %10s %8s %10s %10s %10s %10s %10s %10s %10s\n",
+	   "op", "calls", "errors", "bytes", "avg", "p50", "p90", "p99",
+	   "p99.9", "max");
+    for (op = 0; op < OPSTATS_NOPS; op++) {
+	count = 0;
+	errors = bytes = total = 0;
+	for (i = 0; i < n; i++) {
+	    if (recs[i].op != op)
+		continue;
+	    lat[count++] = recs[i].latency_ns;
+	    total += recs[i].latency_ns;
+	    if (recs[i].result < 0)
+		errors++;
+	    else if (is_read(op) || is_write(op))
+		bytes += recs[i].result;
+	}
+	if (count == 0)
+	    continue;
+
+	qsort(lat, count, sizeof(*lat), cmp_u64);
+	printf("%-10s %10zu %8llu %10s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+	       opstats_name(op), count, (unsigned long long) errors, human(bytes),
+	       total / 1000.0 / count,
+	       percentile(lat, count, 500) / 1000.0,
+	       percentile(lat, count, 900) / 1000.0,
+	       percentile(lat, count, 990) / 1000.0,
+	       percentile(lat, count, 999) / 1000.0,
+	       lat[count - 1] / 1000.0);
+    }
+    free(lat);
+}
+
+/** Calls of each operation over the length of the trace */
+static void print_timeline(const struct trace_record *recs, const size_t n, const int width)
+{
+    uint64_t *cells, max, start, span;
+    size_t i;
+    int op, c;
+
+    if (n == 0)
+	return;
+    cells = calloc(width, sizeof(*cells));
+    if (cells == NULL) {
+	perror("sfstrace");
+	exit(EXIT_FAILURE);
+    }
+
+    start = recs[0].ts_ns;
+    span = recs[n - 1].ts_ns - start + 1;
+    printf("\ncalls over time, %.3f s per column, each row scaled to its busiest column\n",
+	   span / 1e9 / width);
+    for (op = 0; op < OPSTATS_NOPS; op++) {
+	memset(cells, 0, width * sizeof(*cells));
+	max = 0;
+	for (i = 0; i < n; i++) {
+	    if (recs[i].op != op)
+		continue;
+	    c = (recs[i].ts_ns - start) * width / span;
+	    if (++cells[c] > max)
+		max = cells[c];
+	}
+	if (max == 0)
+	    continue;
+
+	printf("%-10s ", opstats_name(op));
+	print_row(cells, width, max);
+	printf(" %llu/col max\n", (unsigned long long) max);
+    }
+    free(cells);
+}
+
+/** Add the @len bytes at @offset to the columns of @cells they cover */
+static void spread(uint64_t *cells, const int width, const uint64_t col,
+		   const uint64_t offset, const uint64_t len)
+{
+    uint64_t pos = offset, end = offset + len, stop;
+    int c;
+
+    while (pos < end) {
+	c = pos / col;
+	if (c >= width)
+	    break;
+	stop = (uint64_t) (c + 1) * col < end ? (uint64_t) (c + 1) * col : end;
+	cells[c] += stop - pos;
+	pos = stop;
+    }
+}
+
+/** Where in the @top busiest files the reads and writes went */
+static void print_inodes(const struct trace_record *recs, const size_t n,
+			 const int top, const int width)
+{
+    const struct trace_record **io;
+    struct inode_total *files;
+    uint64_t *rcells, *wcells, col, max, end;
+    size_t i, j, nio = 0, nfiles = 0;
+    const struct trace_record *r;
+
+    io = malloc((n > 0 ? n : 1) * sizeof(*io));
+    files = malloc((n > 0 ? n : 1) * sizeof(*files));
+    rcells = calloc(width, sizeof(*rcells));
+    wcells = calloc(width, sizeof(*wcells));
+    if (io == NULL || files == NULL || rcells == NULL || wcells == NULL) {
+	perror("sfstrace");
+	exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n; i++)
+	if ((is_read(recs[i].op) || is_write(recs[i].op)) && recs[i].result > 0)
+	    io[nio++] = &recs[i];
+    qsort(io, nio, sizeof(*io), cmp_ino);
+
+    for (i = 0; i < nio; i = j) {
+	files[nfiles].ino = io[i]->ino;
+	files[nfiles].bytes = 0;
+	files[nfiles].extent = 0;
+	files[nfiles].first = i;
+	for (j = i; j < nio && io[j]->ino == io[i]->ino; j++) {
+	    end = io[j]->offset + io[j]->result;
+	    files[nfiles].bytes += io[j]->result;
+	    if (end > files[nfiles].extent)
+		files[nfiles].extent = end;
+	}
+	files[nfiles].count = j - i;
+	nfiles++;
+    }
+    qsort(files, nfiles, sizeof(*files), cmp_bytes);
+
+    if (nfiles > 0)
+	printf("\nbytes moved across the %d busiest files, r for reads and w for writes\n",
+	       (int) nfiles < top ? (int) nfiles : top);
+    for (i = 0; i < nfiles && i < (size_t) top; i++) {
+	memset(rcells, 0, width * sizeof(*rcells));
+	memset(wcells, 0, width * sizeof(*wcells));
+	col = (files[i].extent + width - 1) / width;
+	for (j = 0; j < files[i].count; j++) {
+	    r = io[files[i].first + j];
+	    spread(is_read(r->op) ? rcells : wcells, width, col, r->offset, r->result);
+	}
+	for (max = 0, j = 0; j < (size_t) width; j++) {
+	    if (rcells[j] > max)
+		max = rcells[j];
+	    if (wcells[j] > max)
+		max = wcells[j];
+	}
+
+	printf("ino %-6u r ", files[i].ino);
+	print_row(rcells, width, max);
+	printf(" %s in %zu calls\n", human(files[i].bytes), files[i].count);
+	printf("%10s w ", "");
+	print_row(wcells, width, max);
+	printf(" 0 to %s, %s per column\n", human(files[i].extent), human(col));
+    }
+
+    free(wcells);
+    free(rcells);
+    free(files);
+    free(io);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: sfstrace [-n inodes] [-w width] tracefile\n");
+    fprintf(stderr, "    -n inodes   files in the access heatmap (default 10)\n");
+    fprintf(stderr, "    -w width    columns per heatmap row (default 64)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct trace_header h;
+    struct trace_record *recs;
+    size_t i, n, valid;
+    int top = 10, width = 64;
+    FILE *f;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:w:")) != -1) {
+	switch (c) {
+	case 'n':
+	    top = atoi(optarg);
+	    break;
+	case 'w':
+	    width = atoi(optarg);
+	    break;
+	default:
+	    usage();
+	}
+    }
+    if (optind != argc - 1 || top < 0 || width < 1)
+	usage();
+
+    f = fopen(argv[optind], "r");
+    if (f == NULL) {
+	perror(argv[optind]);
+	return EXIT_FAILURE;
+    }
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC) {
+	fprintf(stderr, "sfstrace: %s is not an sfs trace\n", argv[optind]);
+	return EXIT_FAILURE;
+    }
+    if (h.version != TRACE_VERSION || h.record_size != sizeof(struct trace_record) ||
+	h.nops != OPSTATS_NOPS) {
+	fprintf(stderr, "sfstrace: %s was written by a different version of sfs\n",
+		argv[optind]);
+	return EXIT_FAILURE;
+    }
+
+    // a trace cut short by a crash was never trimmed, only read
+    // as far as slots were handed out
+    n = h.claimed < h.capacity ? h.claimed : h.capacity;
+    recs = malloc((n > 0 ? n : 1) * sizeof(*recs));
+    if (recs == NULL) {
+	perror("sfstrace");
+	return EXIT_FAILURE;
+    }
+    n = fread(recs, sizeof(*recs), n, f);
+    fclose(f);
+
+    for (valid = 0, i = 0; i < n; i++)
+	if (recs[i].ts_ns != 0 && recs[i].op < OPSTATS_NOPS)
+	    recs[valid++] = recs[i];
+    qsort(recs, valid, sizeof(*recs), cmp_time);
+
+    print_summary(argv[optind], &h, recs, valid);
+    print_ops(recs, valid);
+    print_timeline(recs, valid, width);
+    print_inodes(recs, valid, top, width);
+
+    free(recs);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Superblock handling: reading it at mount time, and formatting a
+  fresh image when there is none.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "block.h"
+#include "inode.h"
+#include "journal.h"
+#include "super.h"
+
+struct sfs_super sb;
+
+/** Write the in-memory superblock back to block 0 */
+int super_write()
+{
+    char *buf;
+    int retstat;
+
+    buf = calloc(1, block_size);
+    if (buf == NULL)
+	return -ENOMEM;
+
+    memcpy(buf, &sb, sizeof(sb));
+    retstat = journal_write(0, buf);
+    free(buf);
+
+    return retstat < 0 ? retstat : 0;
+}
+
+/** Number of blocks needed to hold @bits bits */
+static uint64_t bits_to_blocks(const uint64_t bits)
+{
+    return (bits + 8ULL * block_size - 1) / (8ULL * block_size);
+}
+
+/** Zero @count blocks starting at @start, with the first @set bits
+ *  of the first block turned on.
+ */
+static int super_zero(const blkno_t start, const uint64_t count, const int set)
+{
+    char *buf;
+    int retstat;
+
+    retstat = disk_zero(start, count);
+    if (retstat < 0 || !set)
+	return retstat;
+
+    buf = calloc(1, block_size);
+    if (buf == NULL)
+	return -ENOMEM;
+    buf[0] = (1 << set) - 1;
+    retstat = block_write(start, buf);
+    free(buf);
+
+    return retstat < 0 ? retstat : 0;
+}
+
+/** Lay down a fresh file system: superblock, empty bitmaps, an empty
+ *  journal and the root directory.
+ */
+static int super_format(const unsigned long format_block_size,
+			const unsigned long format_size,
+			const unsigned long format_journal_size)
+{
+    struct sfs_inode root;
+    int retstat;
+
+    retstat = block_set_size(format_block_size);
+    if (retstat < 0)
+	return retstat;
+
+    memset(&sb, 0, sizeof(sb));
+    sb.magic = SFS_MAGIC;
+    sb.version = SFS_VERSION;
+    sb.block_size = block_size;
+    sb.inode_size = SFS_INODE_SIZE;
+    sb.nblocks = format_size / block_size;
+    sb.ninodes = format_size / SFS_BYTES_PER_INODE;
+    if (sb.ninodes < 64)
+	sb.ninodes = 64;
+    if (sb.ninodes > SFS_MAX_INODES)
+	sb.ninodes = SFS_MAX_INODES;
+
+    sb.ibitmap_blocks = bits_to_blocks(sb.ninodes);
+    sb.itable_blocks = (sb.ninodes * SFS_INODE_SIZE + block_size - 1) / block_size;
+    sb.bitmap_start = 1;
+    // the block bitmap only covers data blocks, but sizing it for the
+    // whole image keeps the arithmetic simple and costs a few blocks
+    sb.bitmap_blocks = bits_to_blocks(sb.nblocks);
+    sb.ibitmap_start = sb.bitmap_start + sb.bitmap_blocks;
+    sb.itable_start = sb.ibitmap_start + sb.ibitmap_blocks;
+    sb.journal_start = sb.itable_start + sb.itable_blocks;
+    // a journal smaller than the minimum is rounded up, one that would
+    // take more than an eighth of the image is cut down or left out
+    sb.journal_blocks = format_journal_size / block_size;
+    if (sb.journal_blocks > 0 && sb.journal_blocks < JOURNAL_MIN_BLOCKS)
+	sb.journal_blocks = JOURNAL_MIN_BLOCKS;
+    if (sb.journal_blocks > sb.nblocks / 8)
+	sb.journal_blocks = sb.nblocks / 8;
+    if (sb.journal_blocks < JOURNAL_MIN_BLOCKS)
+	sb.journal_blocks = 0;
+    sb.data_start = sb.journal_start + sb.journal_blocks;
+    if (sb.data_start >= sb.nblocks)
+	return -ENOSPC;
+    sb.free_blocks = sb.nblocks - sb.data_start;
+    // inode 0 means "no inode", inode 1 is the root directory
+    sb.free_inodes = sb.ninodes - 2;
+
+    retstat = super_zero(sb.bitmap_start, sb.bitmap_blocks, 0);
+    if (retstat < 0)
+	return retstat;
+    retstat = super_zero(sb.ibitmap_start, sb.ibitmap_blocks, 2);
+    if (retstat < 0)
+	return retstat;
+    retstat = journal_format();
+    if (retstat < 0)
+	return retstat;
+
+    inode_init(&root, S_IFDIR | 0755, getuid(), getgid());
+    root.nlink = 2;
+    retstat = inode_store(SFS_ROOT_INO, &root);
+    if (retstat < 0)
+	return retstat;
+
+    return super_write();
+}
+
+/** Read the superblock and switch the block layer to its block size
+ *
+ * An image that is empty (or all zeroes at the start) is formatted
+ * with @format_block_size and @format_size, gets a journal of
+ * @format_journal_size bytes (0 for none) and an empty root directory.
+ * Those three values are ignored for an image that already has a
+ * superblock.  Must be called before the block cache is set up.
+ * Returns 0, or -EINVAL if the image holds something that is not an
+ * sfs file system.
+ */
+int super_load(const unsigned long format_block_size,
+	       const unsigned long format_size,
+	       const unsigned long format_journal_size)
+{
+    char buf[SFS_MIN_BLOCK_SIZE];
+    unsigned int i;
+    int retstat;
+
+    retstat = block_set_size(SFS_MIN_BLOCK_SIZE);
+    if (retstat < 0)
+	return retstat;
+
+    retstat = block_read(0, buf);
+    if (retstat < 0)
+	return retstat;
+
+    memcpy(&sb, buf, sizeof(sb));
+    if (sb.magic == SFS_MAGIC) {
+	if (sb.version != SFS_VERSION || sb.ninodes > SFS_MAX_INODES)
+	    return -EINVAL;
+	return block_set_size(sb.block_size);
+    }
+
+    for (i = 0; i < sizeof(buf); i++)
+	if (buf[i] != 0)
+	    return -EINVAL;
+
+    return super_format(format_block_size, format_size, format_journal_size);
+}
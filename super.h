@@ -0,0 +1,64 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _SUPER_H_
+#define _SUPER_H_
+
+#include <stdint.h>
+
+#define SFS_MAGIC 0x21534653    // "SFS!" on a little-endian disk
+#define SFS_VERSION 5
+
+// used when formatting, unless -o block_size / -o fs_size say otherwise
+#define SFS_DEFAULT_BLOCK_SIZE 4096
+#define SFS_DEFAULT_FS_SIZE (64 * 1024 * 1024)
+
+// one inode for every this many bytes of file system
+#define SFS_BYTES_PER_INODE 16384
+// inode numbers are 32 bits wide, so images of 64 TiB and up get no more
+#define SFS_MAX_INODES (UINT32_MAX - 1)
+
+#define SFS_ROOT_INO 1
+
+/** On-disk superblock
+ *
+ * Lives at byte 0 of the image and always fits in SFS_MIN_BLOCK_SIZE
+ * bytes, so it can be read before the block size is known.
+ *
+ * The image is laid out as superblock, block bitmap, inode bitmap,
+ * inode table, metadata journal and then data blocks.  Bit i of the
+ * block bitmap stands for block data_start + i.
+ */
+struct sfs_super {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_size;        // bytes per block, fixed at format time
+    uint32_t inode_size;        // bytes per on-disk inode
+    uint64_t nblocks;           // size of the file system in blocks
+    uint64_t ninodes;
+    uint64_t bitmap_start;      // block allocation bitmap
+    uint64_t bitmap_blocks;
+    uint64_t ibitmap_start;     // inode allocation bitmap
+    uint64_t ibitmap_blocks;
+    uint64_t itable_start;      // inode table
+    uint64_t itable_blocks;
+    uint64_t journal_start;     // metadata journal, see journal.c
+    uint64_t journal_blocks;    // 0 if the image has none
+    uint64_t data_start;        // first block that can hold file data
+    uint64_t free_blocks;
+    uint64_t free_inodes;
+};
+
+// superblock of the mounted image
+extern struct sfs_super sb;
+
+int super_load(const unsigned long format_block_size,
+	       const unsigned long format_size,
+	       const unsigned long format_journal_size);
+int super_write();
+
+#endif
@@ -0,0 +1,197 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Binary operation trace.  With -o trace=FILE every fuse call leaves
+  one fixed-size record (op, inode, offset, size, result, latency,
+  thread, start time) in a file mapped into memory, for sfstrace to
+  pick apart afterwards.  Recording a call is a handful of stores
+  into the map: each thread claims TRACE_CHUNK slots at a time from
+  the header's counter and fills them in order, so threads only meet
+  on the counter once every TRACE_CHUNK calls.  The page cache writes
+  the records out; nothing is formatted and nothing waits on the disk.
+
+  Operations say which inode and range they worked on through
+  trace_note(); the wrappers in sfs.c add the timing and result with
+  trace_end().  Once the file is full further calls are only counted
+  as dropped.  At unmount the file is trimmed to the slots handed
+  out, a few of which may be empty where a thread's last chunk was
+  not used up.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "opstats.h"
+#include "trace.h"
+
+static struct trace_header *header = NULL;
+static struct trace_record *records;
+static size_t map_len;
+static int fd = -1;
+static unsigned int generation = 0;     // bumped by every trace_open()
+
+// the calling thread's claimed slots, and what its current call touched
+static __thread unsigned int chunk_gen;
+static __thread uint64_t chunk_next, chunk_end;
+static __thread uint32_t tid;
+static __thread uint32_t note_ino;
+static __thread uint64_t note_offset, note_size;
+
+static uint64_t now_ns(const clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/** Start tracing into @path, replacing it, in a file of @size bytes
+ *
+ * Returns 0 or -errno.
+ */
+int trace_open(const char *path, const unsigned long size)
+{
+    uint64_t capacity;
+    void *map;
+    int err;
+
+    if (header != NULL)
+	return -EBUSY;
+    if (size < sizeof(struct trace_header) + TRACE_CHUNK * sizeof(struct trace_record))
+	return -EINVAL;
+    capacity = (size - sizeof(struct trace_header)) / sizeof(struct trace_record);
+    map_len = sizeof(struct trace_header) + capacity * sizeof(struct trace_record);
+
+    fd = open(path, O_CREAT|O_RDWR|O_TRUNC, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+    if (fd < 0)
+	return -errno;
+    if (ftruncate(fd, map_len) < 0) {
+	err = -errno;
+	close(fd);
+	return err;
+    }
+    map = mmap(NULL, map_len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+	err = -errno;
+	close(fd);
+	return err;
+    }
+
+    header = map;
+    records = (struct trace_record *) (header + 1);
+    header->magic = TRACE_MAGIC;
+    header->version = TRACE_VERSION;
+    header->record_size = sizeof(struct trace_record);
+    header->nops = OPSTATS_NOPS;
+    header->capacity = capacity;
+    header->start_ns = now_ns(CLOCK_MONOTONIC);
+    header->start_time = now_ns(CLOCK_REALTIME);
+    generation++;
+
+    return 0;
+}
+
+/** Stop tracing and trim the file to the records handed out */
+void trace_close()
+{
+    uint64_t used;
+
+    if (header == NULL)
+	return;
+
+    used = header->claimed < header->capacity ? header->claimed : header->capacity;
+    header->capacity = used;
+    msync(header, map_len, MS_SYNC);
+    munmap(header, map_len);
+    header = NULL;
+
+    if (ftruncate(fd, sizeof(struct trace_header) + used * sizeof(struct trace_record)) == 0)
+	fsync(fd);
+    close(fd);
+    fd = -1;
+}
+
+int trace_active()
+{
+    return header != NULL;
+}
+
+/** Record that the calling thread's current call works on @ino,
+ *  @size bytes at @offset
+ */
+void trace_note(const uint32_t ino, const uint64_t offset, const uint64_t size)
+{
+    if (header == NULL)
+	return;
+
+    note_ino = ino;
+    note_offset = offset;
+    note_size = size;
+}
+
+/** Record a call of @op that started at @start and returned @result
+ *
+ * @start comes from opstats_start(), on the same clock.
+ */
+void trace_end(const int op, const unsigned long long start, const long long result)
+{
+    struct trace_record *r;
+    uint64_t idx;
+
+    if (header == NULL)
+	return;
+
+    if (chunk_gen != generation || chunk_next == chunk_end) {
+	idx = __atomic_fetch_add(&header->claimed, TRACE_CHUNK, __ATOMIC_RELAXED);
+	if (idx >= header->capacity) {
+	    __atomic_fetch_add(&header->dropped, 1, __ATOMIC_RELAXED);
+	    chunk_next = chunk_end = 0;
+	    goto out;
+	}
+	chunk_gen = generation;
+	chunk_next = idx;
+	chunk_end = idx + TRACE_CHUNK < header->capacity ? idx + TRACE_CHUNK : header->capacity;
+    }
+    if (tid == 0)
+	tid = syscall(SYS_gettid);
+
+    r = &records[chunk_next++];
+    r->latency_ns = now_ns(CLOCK_MONOTONIC) - start;
+    r->offset = note_offset;
+    r->size = note_size;
+    r->result = result;
+    r->ino = note_ino;
+    r->tid = tid;
+    r->op = op;
+    // last, so a slot with a timestamp is a whole record
+    __atomic_store_n(&r->ts_ns, start, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&header->recorded, 1, __ATOMIC_RELAXED);
+
+out:
+    note_ino = 0;
+    note_offset = note_size = 0;
+}
+
+/** Calls recorded so far, and calls lost to a full file */
+void trace_get_stats(struct trace_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (header == NULL)
+	return;
+
+    stats->records = __atomic_load_n(&header->recorded, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&header->dropped, __ATOMIC_RELAXED);
+}
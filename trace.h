@@ -0,0 +1,60 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+// default size of the trace file, in bytes
+#define TRACE_DEFAULT_SIZE (64 * 1024 * 1024)
+// records a thread claims at a time, so threads don't share a counter per call
+#define TRACE_CHUNK 64
+
+#define TRACE_MAGIC 0x43525453      // "STRC" on a little-endian disk
+#define TRACE_VERSION 1
+
+/** Start of the trace file, followed by @capacity records */
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;   // sizeof(struct trace_record)
+    uint32_t nops;          // OPSTATS_NOPS of the sfs that wrote it
+    uint64_t capacity;      // records that fit; trimmed to those used at unmount
+    uint64_t claimed;       // records handed out to threads so far
+    uint64_t dropped;       // calls not recorded because the file was full
+    uint64_t start_ns;      // CLOCK_MONOTONIC when tracing started
+    uint64_t start_time;    // and the wall clock then, in ns since the epoch
+    uint64_t recorded;      // records written in full so far
+};
+
+/** One fuse call, fixed size so the file can be indexed directly */
+struct trace_record {
+    uint64_t ts_ns;     // CLOCK_MONOTONIC at entry; 0 in a slot never written
+    uint64_t latency_ns; // entry to return, lock wait included
+    uint64_t offset;    // for reads, writes and readdir
+    uint32_t size;      // bytes asked for
+    int32_t result;     // bytes moved, 0, or -errno
+    uint32_t ino;       // 0 if the call never got as far as an inode
+    uint32_t tid;       // kernel thread id of the fuse worker
+    uint16_t op;        // enum opstats_op
+    uint16_t reserved[3];
+};
+
+struct trace_stats {
+    unsigned long long records;     // calls recorded
+    unsigned long long dropped;     // calls lost to a full trace file
+};
+
+int trace_open(const char *path, const unsigned long size);
+void trace_close();
+int trace_active();
+void trace_note(const uint32_t ino, const uint64_t offset, const uint64_t size);
+void trace_end(const int op, const unsigned long long start, const long long result);
+void trace_get_stats(struct trace_stats *stats);
+
+#endif
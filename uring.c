@@ -0,0 +1,224 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Minimal io_uring driver for the block layer, talking to the kernel
+  through the raw io_uring_setup/io_uring_enter system calls.  It only
+  knows how to push a batch of readv/writev requests and wait for all
+  of them to complete.  There is one ring, so batches from different
+  threads take turns on it.
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+struct uring {
+    int fd;
+    unsigned int entries;
+
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    void *cq_ptr;
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+};
+
+static struct uring ring = { .fd = -1 };
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		   NULL, 0);
+}
+
+/** Set up a ring with room for @entries requests in flight
+ *
+ * Returns 0 on success or -errno, in which case the block layer keeps
+ * using synchronous preadv/pwritev.
+ */
+int uring_init(unsigned int entries)
+{
+    struct io_uring_params p;
+    int retstat;
+
+    if (ring.fd >= 0)
+	return 0;
+
+    memset(&p, 0, sizeof(p));
+    ring.fd = sys_io_uring_setup(entries, &p);
+    if (ring.fd < 0)
+	return -errno;
+
+    ring.entries = p.sq_entries;
+    ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	if (ring.cq_len > ring.sq_len)
+	    ring.sq_len = ring.cq_len;
+	ring.cq_len = ring.sq_len;
+    }
+    ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring.sq_ptr = mmap(NULL, ring.sq_len, PROT_READ|PROT_WRITE,
+		       MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED)
+	goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	ring.cq_ptr = ring.sq_ptr;
+    } else {
+	ring.cq_ptr = mmap(NULL, ring.cq_len, PROT_READ|PROT_WRITE,
+			   MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	if (ring.cq_ptr == MAP_FAILED)
+	    goto fail_sq;
+    }
+
+    ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ|PROT_WRITE,
+		     MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED)
+	goto fail_cq;
+
+    ring.sq_head = (unsigned int *) ((char *) ring.sq_ptr + p.sq_off.head);
+    ring.sq_tail = (unsigned int *) ((char *) ring.sq_ptr + p.sq_off.tail);
+    ring.sq_mask = (unsigned int *) ((char *) ring.sq_ptr + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned int *) ((char *) ring.sq_ptr + p.sq_off.array);
+    ring.cq_head = (unsigned int *) ((char *) ring.cq_ptr + p.cq_off.head);
+    ring.cq_tail = (unsigned int *) ((char *) ring.cq_ptr + p.cq_off.tail);
+    ring.cq_mask = (unsigned int *) ((char *) ring.cq_ptr + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) ((char *) ring.cq_ptr + p.cq_off.cqes);
+
+    return 0;
+
+fail_cq:
+    if (ring.cq_ptr != ring.sq_ptr)
+	munmap(ring.cq_ptr, ring.cq_len);
+fail_sq:
+    munmap(ring.sq_ptr, ring.sq_len);
+fail:
+    retstat = -errno;
+    close(ring.fd);
+    ring.fd = -1;
+    return retstat;
+}
+
+void uring_exit()
+{
+    if (ring.fd < 0)
+	return;
+
+    munmap(ring.sqes, ring.sqes_len);
+    if (ring.cq_ptr != ring.sq_ptr)
+	munmap(ring.cq_ptr, ring.cq_len);
+    munmap(ring.sq_ptr, ring.sq_len);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+int uring_available()
+{
+    return ring.fd >= 0;
+}
+
+/** Reap every completion currently in the CQ ring into @reqs */
+static int uring_reap(struct uring_req *reqs)
+{
+    unsigned int head, tail;
+    struct io_uring_cqe *cqe;
+    int n = 0;
+
+    head = *ring.cq_head;
+    tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+	cqe = &ring.cqes[head & *ring.cq_mask];
+	reqs[cqe->user_data].res = cqe->res;
+	head++;
+	n++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+    return n;
+}
+
+/** Issue a batch of requests and wait until all of them complete
+ *
+ * At most ring.entries requests are in flight at a time.  Each
+ * request's result lands in its res field.  Returns 0 once every
+ * request has completed, or -errno if the ring itself failed.
+ */
+int uring_submit(struct uring_req *reqs, const int nreqs)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail, idx;
+    unsigned int unsubmitted = 0;
+    int queued = 0, inflight = 0, done = 0;
+    int n, ret;
+
+    pthread_mutex_lock(&ring_lock);
+    while (done < nreqs) {
+	tail = *ring.sq_tail;
+	while (queued < nreqs && inflight < (int) ring.entries) {
+	    idx = tail & *ring.sq_mask;
+	    sqe = &ring.sqes[idx];
+	    memset(sqe, 0, sizeof(*sqe));
+	    sqe->opcode = reqs[queued].write ? IORING_OP_WRITEV : IORING_OP_READV;
+	    sqe->fd = reqs[queued].fd;
+	    sqe->off = reqs[queued].offset;
+	    sqe->addr = (unsigned long) reqs[queued].iov;
+	    sqe->len = reqs[queued].iovcnt;
+	    sqe->user_data = queued;
+	    ring.sq_array[idx] = idx;
+	    tail++;
+	    queued++;
+	    inflight++;
+	    unsubmitted++;
+	}
+	__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+	ret = sys_io_uring_enter(ring.fd, unsubmitted, 1, IORING_ENTER_GETEVENTS);
+	if (ret < 0) {
+	    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+		ret = -errno;
+		perror("io_uring_enter failed");
+		pthread_mutex_unlock(&ring_lock);
+		return ret;
+	    }
+	} else {
+	    unsubmitted -= ret;
+	}
+
+	n = uring_reap(reqs);
+	inflight -= n;
+	done += n;
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES 64
+
+// one preadv/pwritev worth of work for uring_submit()
+struct uring_req {
+    int write;
+    int fd;
+    off_t offset;
+    const struct iovec *iov;
+    int iovcnt;
+    int res;            // bytes transferred, or -errno
+};
+
+int uring_init(unsigned int entries);
+void uring_exit();
+int uring_available();
+int uring_submit(struct uring_req *reqs, const int nreqs);
+
+#endif
@@ -0,0 +1,469 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+
+  Write buffers with delayed allocation.  Small writes to a file are
+  gathered in memory, one contiguous run per file, and no blocks are
+  allocated for them until the run is written out: on flush, release,
+  fsync, when the run is full, or when the memory limit is reached.
+  The whole run then goes through a single file_write(), which
+  allocates it as one extent and writes the whole blocks in one go,
+  so a stream of 100-byte appends costs one read-modify-write per
+  flush instead of one per call.
+
+  The file size is updated at write time by the caller, so the
+  buffered range reads back from file_read() as a hole and
+  wbuf_read() lays the buffered bytes over it.
+
+  Writes to different files run at the same time, each holding only
+  its own file's inode lock, so the slots and counters are under
+  wbuf_lock and a write never writes out another file's run.  When
+  the slots or the memory run out, writes go around the buffer until
+  wbuf_trim(), called under the exclusive fs lock, has made room.
+  A run being written out is taken off its slot first, so the lock
+  is not held across file_write().
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "file.h"
+#include "inode.h"
+#include "wbuf.h"
+
+// smallest buffer handed to a file, grown by doubling
+#define WBUF_MIN (4 * 1024)
+
+struct wbuf {
+    uint32_t ino;       // 0 when the slot is free
+    off_t offset;       // file offset of data[0]
+    size_t len;
+    size_t cap;
+    unsigned long stamp; // last write, for picking what to flush first
+    time_t dirtied;     // when the run was started
+    char *data;
+};
+
+static struct wbuf *slots = NULL;
+static size_t budget = 0;
+static size_t run_max = 0;
+static unsigned long ticks = 0;
+static struct wbuf_stats stats;
+static pthread_mutex_t wbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Set up write buffering with at most @mem_budget bytes buffered
+ *
+ * A budget of 0 leaves buffering off.  Returns 0 or -ENOMEM.
+ */
+int wbuf_init(size_t mem_budget)
+{
+    if (slots != NULL || mem_budget == 0)
+	return 0;
+
+    slots = calloc(WBUF_SLOTS, sizeof(struct wbuf));
+    if (slots == NULL)
+	return -ENOMEM;
+
+    budget = mem_budget;
+    run_max = mem_budget < WBUF_RUN_MAX ? mem_budget : WBUF_RUN_MAX;
+    ticks = 0;
+    memset(&stats, 0, sizeof(stats));
+
+    return 0;
+}
+
+/** Free the buffers; anything still buffered is lost, flush first */
+void wbuf_destroy()
+{
+    int i;
+
+    if (slots == NULL)
+	return;
+
+    for (i = 0; i < WBUF_SLOTS; i++)
+	free(slots[i].data);
+    free(slots);
+    slots = NULL;
+}
+
+static struct wbuf *wbuf_lookup(const uint32_t ino)
+{
+    int i;
+
+    for (i = 0; i < WBUF_SLOTS; i++)
+	if (slots[i].ino == ino)
+	    return &slots[i];
+
+    return NULL;
+}
+
+static void wbuf_free(struct wbuf *w)
+{
+    stats.bytes -= w->cap;
+    free(w->data);
+    memset(w, 0, sizeof(*w));
+}
+
+/** Write out a buffered run and free its slot
+ *
+ * Called with wbuf_lock held, which is dropped while the run is
+ * written.  @inode is the caller's copy of the file's inode, which
+ * it stores afterwards; with NULL the inode is loaded and stored
+ * here.  The times were set when the data was buffered and are kept
+ * as they are.  Returns the bytes written or -errno; the data is
+ * dropped either way.
+ */
+static int wbuf_writeout(struct wbuf *w, struct sfs_inode *inode)
+{
+    struct sfs_inode copy;
+    struct wbuf run = *w;
+    uint64_t mtime, ctime;
+    int retstat;
+
+    stats.bytes -= w->cap;
+    memset(w, 0, sizeof(*w));
+    pthread_mutex_unlock(&wbuf_lock);
+
+    if (inode == NULL) {
+	retstat = inode_load(run.ino, &copy);
+	if (retstat < 0)
+	    goto out;
+	inode = &copy;
+    }
+
+    mtime = inode->mtime;
+    ctime = inode->ctime;
+    retstat = file_write(inode, run.data, run.len, run.offset);
+    inode->mtime = mtime;
+    inode->ctime = ctime;
+    if (inode == &copy && retstat >= 0)
+	retstat = inode_store(run.ino, &copy);
+
+out:
+    free(run.data);
+    pthread_mutex_lock(&wbuf_lock);
+    stats.flushes++;
+    if (retstat >= 0) {
+	stats.flushed += run.len;
+	retstat = run.len;
+    }
+
+    return retstat;
+}
+
+/** The least recently written run, or NULL if there is none */
+static struct wbuf *wbuf_oldest()
+{
+    struct wbuf *w = NULL;
+    int i;
+
+    for (i = 0; i < WBUF_SLOTS; i++)
+	if (slots[i].ino != 0 && (w == NULL || slots[i].stamp < w->stamp))
+	    w = &slots[i];
+
+    return w;
+}
+
+/** Make room in @w for file range [@start, @end), keeping its data */
+static int wbuf_grow(struct wbuf *w, const off_t start, const off_t end)
+{
+    size_t need = end - start;
+    size_t shift = w->len > 0 ? w->offset - start : 0;
+    size_t cap = w->cap > 0 ? w->cap : WBUF_MIN;
+    char *data;
+
+    while (cap < need)
+	cap *= 2;
+    if (cap > run_max)
+	cap = run_max;
+
+    if (cap != w->cap) {
+	data = realloc(w->data, cap);
+	if (data == NULL)
+	    return -ENOMEM;
+	stats.bytes += cap - w->cap;
+	w->data = data;
+	w->cap = cap;
+    }
+    if (shift > 0)
+	memmove(w->data + shift, w->data, w->len);
+    if (w->len == 0 || start < w->offset)
+	w->offset = start;
+
+    return 0;
+}
+
+/** Take a write of @size bytes at @offset into the file's buffer
+ *
+ * Returns @size if the data was buffered, in which case the caller
+ * updates the inode's size and times itself, or 0 if it must go to
+ * file_write() instead; any buffered data for the file has then been
+ * written out first.  @inode is the caller's copy, as for
+ * wbuf_flush(), and the caller holds the file's inode lock.
+ * Negative on error.
+ */
+int wbuf_write(const uint32_t ino, struct sfs_inode *inode, const char *buf,
+	       size_t size, off_t offset)
+{
+    struct wbuf *w;
+    off_t start, end;
+    size_t len;
+    int retstat, err;
+
+    if (slots == NULL || offset < 0)
+	return 0;
+
+    pthread_mutex_lock(&wbuf_lock);
+    w = wbuf_lookup(ino);
+    if (w != NULL) {
+	start = offset < w->offset ? offset : w->offset;
+	end = w->offset + (off_t) w->len;
+	if (offset + (off_t) size > end)
+	    end = offset + size;
+	// only runs that stay contiguous and within bounds are merged
+	if (offset > w->offset + (off_t) w->len || offset + (off_t) size < w->offset
+	    || (size_t) (end - start) > run_max) {
+	    retstat = wbuf_writeout(w, inode);
+	    if (retstat < 0)
+		goto out;
+	    w = NULL;
+	}
+    }
+
+    if (w == NULL) {
+	// a new run needs a free slot and memory; making room would mean
+	// writing out another file's run, which is left to wbuf_trim()
+	if (size >= WBUF_BYPASS || size > run_max || stats.bytes >= budget
+	    || (w = wbuf_lookup(0)) == NULL) {
+	    stats.bypassed++;
+	    retstat = 0;
+	    goto out;
+	}
+	w->ino = ino;
+	w->dirtied = time(NULL);
+	start = offset;
+	end = offset + size;
+    }
+
+    retstat = wbuf_grow(w, start, end);
+    if (retstat < 0) {
+	if (w->len == 0) {
+	    wbuf_free(w);
+	    retstat = 0;
+	}
+	goto out;
+    }
+    memcpy(w->data + (offset - w->offset), buf, size);
+    len = end - w->offset;
+    if (len > w->len)
+	w->len = len;
+    w->stamp = ++ticks;
+    stats.absorbed++;
+    retstat = size;
+
+    // a full run goes out now rather than blocking the next write
+    if (w->len == run_max) {
+	err = wbuf_writeout(w, inode);
+	if (err < 0)
+	    retstat = err;
+    }
+
+out:
+    pthread_mutex_unlock(&wbuf_lock);
+    return retstat;
+}
+
+static unsigned int wbuf_free_slots()
+{
+    unsigned int i, n = 0;
+
+    for (i = 0; i < WBUF_SLOTS; i++)
+	if (slots[i].ino == 0)
+	    n++;
+
+    return n;
+}
+
+/** Are the buffers over their memory budget or out of slots, so that
+ *  new runs go around them until wbuf_trim()?
+ */
+int wbuf_crowded()
+{
+    int crowded;
+
+    if (slots == NULL)
+	return 0;
+
+    pthread_mutex_lock(&wbuf_lock);
+    crowded = stats.bytes >= budget || wbuf_free_slots() == 0;
+    pthread_mutex_unlock(&wbuf_lock);
+
+    return crowded;
+}
+
+/** Write out the least recently written runs until a quarter of the
+ *  memory and of the slots are free again
+ *
+ * Writes to other files' inodes, so it needs the exclusive fs lock.
+ * Returns the number of runs written or the first error.
+ */
+int wbuf_trim()
+{
+    struct wbuf *w;
+    int n = 0, err, retstat = 0;
+
+    if (slots == NULL)
+	return 0;
+
+    pthread_mutex_lock(&wbuf_lock);
+    while ((stats.bytes > budget - budget / 4 || wbuf_free_slots() < WBUF_SLOTS / 4)
+	   && (w = wbuf_oldest()) != NULL) {
+	stats.pressure++;
+	err = wbuf_writeout(w, NULL);
+	if (err < 0 && retstat == 0)
+	    retstat = err;
+	n++;
+    }
+    pthread_mutex_unlock(&wbuf_lock);
+
+    return retstat < 0 ? retstat : n;
+}
+
+/** Lay buffered data for @ino over what file_read() returned in @buf
+ *
+ * @size is the byte count file_read() returned for @offset.
+ */
+void wbuf_read(const uint32_t ino, char *buf, size_t size, off_t offset)
+{
+    struct wbuf *w;
+    off_t start, end;
+
+    if (slots == NULL || size == 0)
+	return;
+
+    pthread_mutex_lock(&wbuf_lock);
+    w = wbuf_lookup(ino);
+    if (w != NULL) {
+	start = offset > w->offset ? offset : w->offset;
+	end = offset + (off_t) size;
+	if (end > w->offset + (off_t) w->len)
+	    end = w->offset + w->len;
+	if (start < end)
+	    memcpy(buf + (start - offset), w->data + (start - w->offset), end - start);
+    }
+    pthread_mutex_unlock(&wbuf_lock);
+}
+
+/** Does @ino have buffered data? */
+int wbuf_pending(const uint32_t ino)
+{
+    int pending;
+
+    if (slots == NULL)
+	return 0;
+
+    pthread_mutex_lock(&wbuf_lock);
+    pending = wbuf_lookup(ino) != NULL;
+    pthread_mutex_unlock(&wbuf_lock);
+
+    return pending;
+}
+
+/** Write out whatever is buffered for @ino
+ *
+ * @inode is the caller's copy of the inode, updated in place for the
+ * caller to store, or NULL to have the inode loaded and stored here.
+ * Returns the bytes written, 0 if nothing was buffered, or -errno.
+ */
+int wbuf_flush(const uint32_t ino, struct sfs_inode *inode)
+{
+    struct wbuf *w;
+    int retstat = 0;
+
+    if (slots == NULL)
+	return 0;
+
+    pthread_mutex_lock(&wbuf_lock);
+    w = wbuf_lookup(ino);
+    if (w != NULL)
+	retstat = wbuf_writeout(w, inode);
+    pthread_mutex_unlock(&wbuf_lock);
+
+    return retstat;
+}
+
+/** Write out every buffer
+ *
+ * Returns 0 or the first error.
+ */
+int wbuf_flush_all()
+{
+    int i, retstat = 0, err;
+
+    if (slots == NULL)
+	return 0;
+
+    pthread_mutex_lock(&wbuf_lock);
+    for (i = 0; i < WBUF_SLOTS; i++) {
+	if (slots[i].ino == 0)
+	    continue;
+	err = wbuf_writeout(&slots[i], NULL);
+	if (err < 0 && retstat == 0)
+	    retstat = err;
+    }
+    pthread_mutex_unlock(&wbuf_lock);
+
+    return retstat;
+}
+
+/** Write out runs started at or before @expire
+ *
+ * Returns the number of runs written or the first error.
+ */
+int wbuf_flush_old(const time_t expire)
+{
+    int i, n = 0, err, retstat = 0;
+
+    if (slots == NULL)
+	return 0;
+
+    pthread_mutex_lock(&wbuf_lock);
+    for (i = 0; i < WBUF_SLOTS; i++) {
+	if (slots[i].ino == 0 || slots[i].dirtied > expire)
+	    continue;
+	err = wbuf_writeout(&slots[i], NULL);
+	if (err < 0 && retstat == 0)
+	    retstat = err;
+	n++;
+    }
+    pthread_mutex_unlock(&wbuf_lock);
+
+    return retstat < 0 ? retstat : n;
+}
+
+/** Forget buffered data for a file that is going away */
+void wbuf_drop(const uint32_t ino)
+{
+    struct wbuf *w;
+
+    if (slots == NULL)
+	return;
+
+    pthread_mutex_lock(&wbuf_lock);
+    w = wbuf_lookup(ino);
+    if (w != NULL)
+	wbuf_free(w);
+    pthread_mutex_unlock(&wbuf_lock);
+}
+
+void wbuf_get_stats(struct wbuf_stats *out)
+{
+    pthread_mutex_lock(&wbuf_lock);
+    *out = stats;
+    pthread_mutex_unlock(&wbuf_lock);
+}
@@ -0,0 +1,50 @@
+/*
+  Copyright (C) 2015 CS416/CS516
+
+  This program can be distributed under the terms of the GNU GPLv3.
+  See the file COPYING.
+*/
+
+#ifndef _WBUF_H_
+#define _WBUF_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "inode.h"
+
+// default memory for buffered writes across all files, in bytes
+#define WBUF_DEFAULT_SIZE (4 * 1024 * 1024)
+// files that can have writes buffered at the same time
+#define WBUF_SLOTS 64
+// most bytes one file buffers before they are written out
+#define WBUF_RUN_MAX (1024 * 1024)
+// writes at least this large skip the buffer
+#define WBUF_BYPASS (64 * 1024)
+
+struct wbuf_stats {
+    unsigned long long absorbed;    // writes taken into a buffer
+    unsigned long long bypassed;    // writes passed straight to the file
+    unsigned long long flushes;     // buffers written out
+    unsigned long long flushed;     // bytes written out
+    unsigned long long pressure;    // flushes forced by the memory or slot limit
+    size_t bytes;                   // buffered right now
+};
+
+int wbuf_init(size_t mem_budget);
+void wbuf_destroy();
+int wbuf_write(const uint32_t ino, struct sfs_inode *inode, const char *buf,
+	       size_t size, off_t offset);
+void wbuf_read(const uint32_t ino, char *buf, size_t size, off_t offset);
+int wbuf_pending(const uint32_t ino);
+int wbuf_flush(const uint32_t ino, struct sfs_inode *inode);
+int wbuf_flush_all();
+int wbuf_flush_old(const time_t expire);
+int wbuf_crowded();
+int wbuf_trim();
+void wbuf_drop(const uint32_t ino);
+void wbuf_get_stats(struct wbuf_stats *stats);
+
+#endif